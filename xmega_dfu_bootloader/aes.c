@@ -0,0 +1,32 @@
+/* aes.c
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * AES-128 with the XMEGA crypto engine
+ */
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "aes.h"
+#include "dfu_config.h"
+
+#if defined(AES_DECRYPT) || defined(IMAGE_AUTH)
+
+/**************************************************************************************************
+* Encrypt one block in place. The key is loaded every time because the engine leaves the last
+* subkey in the key memory. key is the far address of the key in the boot section.
+*/
+void aes_encrypt(uint8_t *block, uint32_t key)
+{
+	AES.CTRL = AES_RESET_bm;
+	for (uint8_t i = 0; i < AES_BLOCK_SIZE; i++)
+		AES.KEY = pgm_read_byte_far(key + i);
+	for (uint8_t i = 0; i < AES_BLOCK_SIZE; i++)
+		AES.STATE = block[i];
+	AES.CTRL = AES_START_bm;
+	while (!(AES.STATUS & (AES_SRIF_bm | AES_ERROR_bm)));
+	for (uint8_t i = 0; i < AES_BLOCK_SIZE; i++)
+		block[i] = AES.STATE;
+}
+
+#endif // AES_DECRYPT || IMAGE_AUTH
@@ -0,0 +1,21 @@
+/*
+ * aes.h
+ *
+ * AES-128 encryption of single blocks (AES_DECRYPT, IMAGE_AUTH). The
+ * bootloader only needs the encrypt direction, for CTR mode and CMAC. The
+ * key is read from the boot section by far address.
+ */
+
+
+#ifndef AES_H
+#define AES_H
+
+#include <stdint.h>
+
+#define AES_BLOCK_SIZE		16
+
+
+extern void aes_encrypt(uint8_t *block, uint32_t key);
+
+
+#endif // AES_H
@@ -25,14 +25,207 @@
 #define	UPLOAD_SUPPORT
 
 
+/* Manifestation tolerant mode. After manifestation the bootloader goes back to
+ * dfuIDLE instead of resetting, so the host can verify the download with UPLOAD
+ * or program another memory straight away, and then sends DFU_DETACH to start
+ * the application. DFU_MANIFEST_POLL_MS is the poll timeout reported while in
+ * dfuMANIFEST.
+ */
+//#define MANIFEST_TOLERANT
+#define DFU_MANIFEST_POLL_MS	10
+
+
+/* Start the application directly after an update instead of through a software
+ * reset. The bootloader still waits and detaches as usual, then puts the USB
+ * controller, clocks, interrupt controller and NVM back into their reset state
+ * and jumps to the application if CheckStartConditions() allows it. Peripherals
+ * set up by CheckStartConditions() itself are not restored.
+ */
+//#define DIRECT_HANDOFF
+
+
+/* Accept DNLOAD blocks smaller than a page. Blocks are combined in the write
+ * buffer by byte address and each page is erased and written once. The block
+ * size is taken from block 0, all other blocks except the last must match it.
+ */
+//#define SUBPAGE_DNLOAD
+
+
+/* Accept an optional image header (see DFU_ImageHeader_t in dfu.h) as block 0.
+ * Images larger than the memory are rejected before anything is erased, blocks
+ * past the end of the image are refused and the whole image is checked with the
+ * hardware CRC during manifestation. Over USB_HID the header is padded to fill the
+ * first flash page of the stream.
+ */
+//#define IMAGE_HEADER
+
+
+/* Check the application with the hardware CRC before starting it. The length and
+ * CRC of the last image that passed verification are kept in the last EEPROM page,
+ * which is not written by EEPROM downloads. Requires IMAGE_HEADER, and images
+ * without a header (or programmed by other means) will not be started.
+ */
+//#define BOOT_VALIDATION
+
+
+/* Resume interrupted flash downloads. Progress is saved to the second to last
+ * EEPROM page every DFU_JOURNAL_INTERVAL pages, which is not written by EEPROM
+ * downloads. The host reads DFU_VREQ_RESUME_INFO, compares the CRC of the pages
+ * already written with its image, then sends DFU_VREQ_RESUME, block 0 and the
+ * remaining blocks.
+ */
+//#define RESUME_SUPPORT
+#define DFU_JOURNAL_INTERVAL	16
+
+
+/* Expose the application table section as DFU alternate 2 ("App table"), so
+ * that tables kept there can be updated without reflashing the application.
+ * The image header is checked against the table, but the boot record and the
+ * resume journal only cover alternate 0. With BOOT_VALIDATION the table must
+ * be outside the image length.
+ */
+//#define APPTABLE_ALT
+
+
+/* Provisioning alternates. USERSIG_ALT adds alternate 3, the user signature
+ * row (one page, read and write). FUSES_ALT adds alternate 4, a read only
+ * DFU_FuseBlock_t (see dfu.h) with the fuses, lock bits and production
+ * signature row. Reading requires UPLOAD_SUPPORT.
+ */
+//#define USERSIG_ALT
+//#define FUSES_ALT
+
+
+/* Container alternate (alternate 5). One download carries several segments,
+ * each a DFU_SegmentHeader_t (see dfu.h) followed by its data, for flash, EEPROM,
+ * the app table or the user signature row. All of them are programmed in one
+ * session and manifested once.
+ */
+//#define CONTAINER_ALT
+
+
+/* DfuSe (DFU 1.1a) addressed downloads on every alternate. Block 0 carries a
+ * command (set address pointer or erase page) and data blocks are written at
+ * the address pointer, so the host only sends the populated regions of a sparse
+ * image. The alternate names become DfuSe memory layouts, which makes dfu-util
+ * -s and .dfuse files work. Element addresses must be page aligned, and the
+ * download must end with a zero length block (dfu-util -s address:leave) so
+ * that manifestation writes the delayed zero page. Not compatible with
+ * BOOT_VALIDATION or CONTAINER_ALT.
+ */
+//#define DFUSE_MODE
+
+
+/* Burst download vendor extension. The host announces a number of blocks with
+ * DFU_VREQ_BURST and then sends them as consecutive DNLOAD requests without
+ * GETSTATUS in between. Failed blocks are reported by DFU_VREQ_BURST_STATUS.
+ */
+//#define BURST_DNLOAD
+
+
+/* Boot mailbox. Instead of "LOAD" the application can write a DFU_Mailbox_t
+ * (see dfu.h) to the start of SRAM, with flags to preselect an alternate and
+ * to skip clock set up. A reset stops the clocks, so to reuse them the
+ * application disables interrupts and USB and jumps to the start of the boot
+ * section instead of resetting. The bootloader checks that the PLL is still
+ * running before it trusts the flag. The linker must place .data after the
+ * mailbox (.data=0x2008 in the project).
+ */
+//#define BOOT_MAILBOX
+
+
+/* Boot section service table. Exports the flash and user signature SPM
+ * routines at a fixed address at the end of the boot section (see
+ * spm_table.h), so the application can program its own flash without
+ * entering the bootloader. The linker places .spmtable at 0x10FF0 (word
+ * address) in the project.
+ */
+//#define SPM_TABLE
+
+
+/* A/B staged updates. The application section below the app table is split
+ * into a primary and a staging slot, and the flash alternate writes to the
+ * staging slot, so the application must fit in half. A verified download
+ * leaves a stage record in EEPROM (see dfu.h), and at the next reset the
+ * image is checked again and copied into the primary slot. An interrupted or
+ * failed download never touches the running image. The application can also
+ * stage an image itself through SPM_TABLE. Requires IMAGE_HEADER.
+ */
+//#define AB_UPDATE
+
+
+/* Update from external SPI flash. The application stores an image in the
+ * same format as an IMAGE_HEADER download (header padded to one flash page,
+ * then the image) and resets. At boot the image is programmed, checked by CRC
+ * and the header is cleared. With AB_UPDATE it goes to the staging slot.
+ * SCK and MOSI are pins 7 and 5 of EXT_FLASH_PORT.
+ */
+//#define EXT_FLASH_UPDATE
+#define EXT_FLASH_SPI			SPIC
+#define EXT_FLASH_PORT			PORTC
+#define EXT_FLASH_CS_bm			PIN4_bm
+#define EXT_FLASH_IMAGE_ADDR	0x000000UL
+
+
+/* Encrypted images. Flash images are AES-128 CTR encrypted with the initial
+ * counter block after the image header (see DFU_EncryptedHeader_t in dfu.h)
+ * and are decrypted page by page with the crypto engine, while the host sends
+ * the next block. Images without a header are refused. The key is stored in
+ * the boot section, set the BLBB lock bits so the application can't read it.
+ * Requires IMAGE_HEADER, UPLOAD_SUPPORT must be disabled.
+ */
+//#define AES_DECRYPT
+#define AES_KEY		{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+					  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }
+
+
+/* Authenticated images. Flash images carry an AES-CMAC tag in a trailer (see
+ * dfu.h), calculated with the crypto engine as the pages are programmed and
+ * checked at manifestation together with the CRC. Images that fail are
+ * treated like a CRC failure. Images from external flash and staged A/B
+ * images are checked before they are installed. Requires IMAGE_HEADER, use a
+ * different key to AES_KEY.
+ */
+//#define IMAGE_AUTH
+#define AUTH_KEY	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+					  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }
+
+
+/* Check the tag at boot as well. The boot record is the validated flag: as
+ * long as the CRC matches an authenticated record the image is started after
+ * the BOOT_VALIDATION CRC check only, otherwise the full CMAC is calculated
+ * once and the record updated. Requires IMAGE_AUTH and BOOT_VALIDATION.
+ */
+//#define IMAGE_AUTH_BOOT
+
+
+/* Streaming CRC-32 of the DNLOAD data, fed to the CRC module as each packet
+ * arrives. The host can send the CRC of the file with DFU_VREQ_STREAM_CRC
+ * before manifestation, and a mismatch is treated like a failed image, or
+ * read the result with DFU_VREQ_STREAM_CRC_STATUS once all blocks are sent.
+ * Repeated or skipped blocks, and DFU_VREQ_RESUME_INFO during the download,
+ * invalidate the stream. Not supported with USB_HID or DFUSE_MODE.
+ */
+//#define STREAM_CRC
+
+
 /* Return true if the DFU bootloader should be started. DFU can be started
  * by some condition (button pressed, flash memory empty etc.) or by the
  * application firmware.
  */
+extern bool dfu_app_valid(void);
+
 static inline bool CheckStartConditions(void)
 {
 	if ((*(uint32_t *)(INTERNAL_SRAM_START) == 0x4c4f4144) ||	// "LOAD"
-		(*(const __flash uint16_t *)(0) == 0xFFFF))				// reset vector blank
+#ifdef BOOT_MAILBOX
+		(*(uint32_t *)(INTERNAL_SRAM_START) == DFU_MAILBOX_MAGIC) ||
+#endif
+		(*(const __flash uint16_t *)(0) == 0xFFFF)				// reset vector blank
+#ifdef BOOT_VALIDATION
+		|| !dfu_app_valid()										// CRC check failed
+#endif
+		)
 	{
 		*(uint32_t *)(INTERNAL_SRAM_START) = 0;					// clear signature
 		return true;
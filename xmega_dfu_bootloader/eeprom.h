@@ -21,6 +21,7 @@
 #define EEP_EnableMapping()			( NVM.CTRLB |= NVM_EEMAPEN_bm )
 #define EEP_DisableMapping()		( NVM.CTRLB &= ~NVM_EEMAPEN_bm )
 
+#ifndef NVM_EXEC	// the host build defines its own
 // Execute NVM command. Timing critical, temporarily suspends interrupts.
 // Atmel did a horrible job with this code, but it works so no point fixing it.
 #define NVM_EXEC()	asm("push r30"      "\n\t"	\
@@ -38,6 +39,7 @@
 						"pop r31"       "\n\t"	\
 						"pop r30"       "\n\t"	\
 					    )
+#endif
 
 
 // Wait for NVM access to finish.
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# configure.sh <in> <out> [+OPTION|-OPTION]...
+#
+# Copy a config header, uncommenting the //#define of each +OPTION and commenting out the
+# #define of each -OPTION. Fails if an option is not found in the header.
+
+in="$1"
+out="$2"
+shift 2
+
+script=""
+for opt in "$@"; do
+	name="${opt#?}"
+	case "$opt" in
+	+*)	pattern="^//#define[[:space:]]+$name([[:space:]]|\$)"
+		script="$script;s,^//(#define[[:space:]]+$name)([[:space:]]|\$),\\1\\2,"
+		;;
+	-*)	pattern="^#define[[:space:]]+$name([[:space:]]|\$)"
+		script="$script;s,^(#define[[:space:]]+$name)([[:space:]]|\$),//\\1\\2,"
+		;;
+	*)	echo "$0: $opt: expected +OPTION or -OPTION" >&2
+		exit 1
+		;;
+	esac
+	if ! grep -Eq "$pattern" "$in"; then
+		echo "$0: $opt: no matching #define in $in" >&2
+		exit 1
+	fi
+done
+
+sed -E "${script#;}" "$in" > "$out.tmp" && mv "$out.tmp" "$out"
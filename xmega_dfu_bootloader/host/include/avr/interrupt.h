@@ -0,0 +1,19 @@
+/*
+ * avr/interrupt.h
+ *
+ * Host build: interrupt handlers are ordinary functions, called by the USB model when a
+ * transaction completes. They never preempt other code.
+ */
+
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#define ISR(vector)		void vector(void)
+#define sei()			do {} while (0)
+#define cli()			do {} while (0)
+
+void USB_BUSEVENT_vect(void);
+void USB_TRNCOMPL_vect(void);
+
+
+#endif // HOST_AVR_INTERRUPT_H
@@ -0,0 +1,420 @@
+/*
+ * avr/io.h
+ *
+ * Host build: the parts of the ATxmega128A3U device header that the bootloader uses. USB is
+ * plain memory driven by the USB model, NVM, CRC and CCP go through accessors into the
+ * peripheral model (see model.h), so that busy flags change and writes take effect.
+ *
+ * Endpoint DATAPTR and EPPTR are 32 bits wide here, the host build is linked without PIE so
+ * static buffers have 32 bit addresses.
+ */
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define __flash		// constants are ordinary host memory, see pgm_read_byte_far()
+
+typedef volatile uint8_t register8_t;
+typedef volatile uint16_t register16_t;
+typedef volatile uint32_t register32_t;
+typedef volatile uint16_t model_reg_t;		// low byte is the register, bit 8 is cleared by a write
+
+
+/**************************************************************************************************
+** Memories
+*/
+#define APP_SECTION_START			0x00000
+#define APP_SECTION_SIZE			131072
+#define APP_SECTION_PAGE_SIZE		512
+#define APP_SECTION_END				0x1FFFF
+#define APPTABLE_SECTION_START		0x1E000
+#define APPTABLE_SECTION_SIZE		8192
+#define APPTABLE_SECTION_PAGE_SIZE	512
+#define BOOT_SECTION_START			0x20000
+#define BOOT_SECTION_SIZE			8192
+#define BOOT_SECTION_PAGE_SIZE		512
+#define FLASH_END					0x21FFF
+
+#define EEPROM_SIZE					2048
+#define EEPROM_PAGE_SIZE			32
+#define USER_SIGNATURES_SIZE		512
+#define USER_SIGNATURES_PAGE_SIZE	512
+#define PROD_SIGNATURES_SIZE		64
+#define FUSE_SIZE					6
+#define LOCKBIT_SIZE				1
+
+extern uint8_t model_sram[];
+extern uint8_t model_eeprom[];
+#define INTERNAL_SRAM_START			((uintptr_t)model_sram)
+#define INTERNAL_SRAM_SIZE			8192
+#define MAPPED_EEPROM_START			((uintptr_t)model_eeprom)
+
+
+/**************************************************************************************************
+** CPU
+*/
+extern register8_t SREG, RAMPZ, RAMPD, RAMPX, RAMPY, EIND;
+extern model_reg_t *model_ccp(void);
+#define CCP		(*model_ccp())
+
+#define CCP_SPM_gc		0x9D
+#define CCP_IOREG_gc	0xD8
+
+
+/**************************************************************************************************
+** USB
+*/
+typedef struct USB_EP_struct {
+	register8_t STATUS;
+	register8_t CTRL;
+	register16_t CNT;
+	register32_t DATAPTR;
+	register16_t AUXDATA;
+} USB_EP_t;
+
+typedef struct USB_struct {
+	register8_t CTRLA;
+	register8_t CTRLB;
+	register8_t STATUS;
+	register8_t ADDR;
+	register8_t FIFOWP;
+	register8_t FIFORP;
+	register32_t EPPTR;
+	register8_t INTCTRLA;
+	register8_t INTCTRLB;
+	register8_t INTFLAGSACLR;
+	register8_t INTFLAGSASET;
+	register8_t INTFLAGSBCLR;
+	register8_t INTFLAGSBSET;
+	register8_t CAL0;
+	register8_t CAL1;
+} USB_t;
+
+extern USB_t USB;
+
+#define USB_ENABLE_bm				0x80
+#define USB_SPEED_bm				0x40
+#define USB_FIFOEN_bm				0x20
+#define USB_MAXEP_gm				0x0F
+#define USB_PULLRST_bm				0x10
+#define USB_RWAKEUP_bm				0x04
+#define USB_GNACK_bm				0x02
+#define USB_ATTACH_bm				0x01
+#define USB_SOFIE_bm				0x80
+#define USB_BUSEVIE_bm				0x40
+#define USB_BUSERRIE_bm				0x20
+#define USB_STALLIE_bm				0x10
+#define USB_INTLVL_gm				0x03
+#define USB_INTLVL_LO_gc			0x01
+#define USB_INTLVL_MED_gc			0x02
+#define USB_INTLVL_HI_gc			0x03
+#define USB_TRNIE_bm				0x02
+#define USB_SETUPIE_bm				0x01
+#define USB_SOFIF_bm				0x80
+#define USB_SUSPENDIF_bm			0x40
+#define USB_RESUMEIF_bm				0x20
+#define USB_RSTIF_bm				0x10
+#define USB_CRCIF_bm				0x08
+#define USB_UNFIF_bm				0x04
+#define USB_OVFIF_bm				0x02
+#define USB_STALLIF_bm				0x01
+#define USB_TRNIF_bm				0x02
+#define USB_SETUPIF_bm				0x01
+
+#define USB_EP_STALLF_bm			0x80
+#define USB_EP_CRC_bm				0x80
+#define USB_EP_UNF_bm				0x40
+#define USB_EP_OVF_bm				0x40
+#define USB_EP_TRNCOMPL0_bm			0x20
+#define USB_EP_TRNCOMPL1_bm			0x10
+#define USB_EP_SETUP_bm				0x10
+#define USB_EP_BANK_bm				0x08
+#define USB_EP_BUSNACK1_bm			0x04
+#define USB_EP_BUSNACK0_bm			0x02
+#define USB_EP_TOGGLE_bm			0x01
+
+#define USB_EP_TYPE_gm				0xC0
+#define USB_EP_TYPE_DISABLE_gc		0x00
+#define USB_EP_TYPE_CONTROL_gc		0x40
+#define USB_EP_TYPE_BULK_gc			0x80
+#define USB_EP_TYPE_ISOCHRONOUS_gc	0xC0
+#define USB_EP_MULTIPKT_bm			0x20
+#define USB_EP_PINGPONG_bm			0x10
+#define USB_EP_INTDSBL_bm			0x08
+#define USB_EP_STALL_bm				0x04
+#define USB_EP_BUFSIZE_gm			0x07
+#define USB_EP_BUFSIZE_8_gc			0x00
+#define USB_EP_BUFSIZE_16_gc		0x01
+#define USB_EP_BUFSIZE_32_gc		0x02
+#define USB_EP_BUFSIZE_64_gc		0x03
+#define USB_EP_BUFSIZE_128_gc		0x04
+#define USB_EP_BUFSIZE_256_gc		0x05
+#define USB_EP_BUFSIZE_512_gc		0x06
+#define USB_EP_BUFSIZE_1023_gc		0x07
+
+// LAC/LAS/XCH/LAT on the endpoint STATUS registers, see usb_xmega_internal.h
+extern unsigned char __lac(unsigned char msk, unsigned char *addr);
+extern unsigned char __las(unsigned char msk, unsigned char *addr);
+extern unsigned char __xch(unsigned char msk, unsigned char *addr);
+extern unsigned char __lat(unsigned char msk, unsigned char *addr);
+
+
+/**************************************************************************************************
+** NVM controller
+*/
+typedef struct NVM_struct {
+	register8_t ADDR0;
+	register8_t ADDR1;
+	register8_t ADDR2;
+	model_reg_t DATA0;
+	register8_t DATA1;
+	register8_t DATA2;
+	register8_t CMD;
+	model_reg_t CTRLA;
+	register8_t CTRLB;
+	register8_t INTCTRL;
+	register8_t STATUS;
+	register8_t LOCKBITS;
+} NVM_t;
+
+extern NVM_t *model_nvm(void);
+#define NVM		(*model_nvm())
+
+#define NVM_CMDEX_bm				0x01
+#define NVM_EEMAPEN_bm				0x08
+#define NVM_FPRM_bm					0x04
+#define NVM_EPRM_bm					0x02
+#define NVM_SPMLOCK_bm				0x01
+#define NVM_NVMBUSY_bm				0x80
+#define NVM_FBUSY_bm				0x40
+#define NVM_EELOAD_bm				0x02
+#define NVM_FLOAD_bm				0x01
+
+#define NVM_CMD_NO_OPERATION_gc				0x00
+#define NVM_CMD_READ_USER_SIG_ROW_gc		0x01
+#define NVM_CMD_READ_CALIB_ROW_gc			0x02
+#define NVM_CMD_READ_EEPROM_gc				0x06
+#define NVM_CMD_READ_FUSES_gc				0x07
+#define NVM_CMD_WRITE_LOCK_BITS_gc			0x08
+#define NVM_CMD_ERASE_USER_SIG_ROW_gc		0x18
+#define NVM_CMD_WRITE_USER_SIG_ROW_gc		0x1A
+#define NVM_CMD_ERASE_APP_gc				0x20
+#define NVM_CMD_ERASE_APP_PAGE_gc			0x22
+#define NVM_CMD_LOAD_FLASH_BUFFER_gc		0x23
+#define NVM_CMD_WRITE_APP_PAGE_gc			0x24
+#define NVM_CMD_ERASE_WRITE_APP_PAGE_gc		0x25
+#define NVM_CMD_ERASE_FLASH_BUFFER_gc		0x26
+#define NVM_CMD_ERASE_BOOT_PAGE_gc			0x2A
+#define NVM_CMD_WRITE_BOOT_PAGE_gc			0x2C
+#define NVM_CMD_ERASE_WRITE_BOOT_PAGE_gc	0x2D
+#define NVM_CMD_ERASE_EEPROM_gc				0x30
+#define NVM_CMD_ERASE_EEPROM_PAGE_gc		0x32
+#define NVM_CMD_LOAD_EEPROM_BUFFER_gc		0x33
+#define NVM_CMD_WRITE_EEPROM_PAGE_gc		0x34
+#define NVM_CMD_ERASE_WRITE_EEPROM_PAGE_gc	0x35
+#define NVM_CMD_ERASE_EEPROM_BUFFER_gc		0x36
+#define NVM_CMD_APP_CRC_gc					0x38
+#define NVM_CMD_BOOT_CRC_gc					0x39
+#define NVM_CMD_FLASH_RANGE_CRC_gc			0x3A
+
+typedef struct NVM_PROD_SIGNATURES_struct {
+	uint8_t RCOSC2M;
+	uint8_t RCOSC2MA;
+	uint8_t RCOSC32K;
+	uint8_t RCOSC32M;
+	uint8_t RCOSC32MA;
+	uint8_t reserved_0x05[3];
+	uint8_t LOTNUM0;
+	uint8_t LOTNUM1;
+	uint8_t LOTNUM2;
+	uint8_t LOTNUM3;
+	uint8_t LOTNUM4;
+	uint8_t LOTNUM5;
+	uint8_t reserved_0x0E[2];
+	uint8_t WAFNUM;
+	uint8_t reserved_0x11;
+	uint8_t COORDX0;
+	uint8_t COORDX1;
+	uint8_t COORDY0;
+	uint8_t COORDY1;
+	uint8_t reserved_0x16[4];
+	uint8_t USBCAL0;
+	uint8_t USBCAL1;
+	uint8_t USBRCOSC;
+	uint8_t USBRCOSCA;
+	uint8_t reserved_0x1E[34];
+} NVM_PROD_SIGNATURES_t;
+
+
+/**************************************************************************************************
+** CRC module
+*/
+typedef struct CRC_struct {
+	model_reg_t CTRL;
+	model_reg_t STATUS;
+	model_reg_t DATAIN;
+	register8_t CHECKSUM0;
+	register8_t CHECKSUM1;
+	register8_t CHECKSUM2;
+	register8_t CHECKSUM3;
+} CRC_t;
+
+extern CRC_t *model_crc(void);
+#define CRC		(*model_crc())
+
+#define CRC_RESET_gm				0xC0
+#define CRC_RESET_NO_gc				0x00
+#define CRC_RESET_RESET0_gc			0x80
+#define CRC_RESET_RESET1_gc			0xC0
+#define CRC_CRC32_bm				0x20
+#define CRC_SOURCE_gm				0x0F
+#define CRC_SOURCE_DISABLE_gc		0x00
+#define CRC_SOURCE_IO_gc			0x01
+#define CRC_SOURCE_FLASH_gc			0x02
+#define CRC_ZERO_bm					0x02
+#define CRC_BUSY_bm					0x01
+
+
+/**************************************************************************************************
+** Clocks, reset, watchdog, interrupt controller. Plain memory, the harness does not run
+** usb_configure_clock().
+*/
+typedef struct OSC_struct {
+	register8_t CTRL;
+	register8_t STATUS;
+	register8_t XOSCCTRL;
+	register8_t XOSCFAIL;
+	register8_t RC32KCAL;
+	register8_t PLLCTRL;
+	register8_t DFLLCTRL;
+} OSC_t;
+
+typedef struct CLK_struct {
+	register8_t CTRL;
+	register8_t PSCTRL;
+	register8_t LOCK;
+	register8_t RTCCTRL;
+	register8_t USBCTRL;
+} CLK_t;
+
+typedef struct DFLL_struct {
+	register8_t CTRL;
+	register8_t CALA;
+	register8_t CALB;
+	register8_t COMP0;
+	register8_t COMP1;
+	register8_t COMP2;
+} DFLL_t;
+
+typedef struct PMIC_struct {
+	register8_t STATUS;
+	register8_t INTPRI;
+	register8_t CTRL;
+} PMIC_t;
+
+typedef struct RST_struct {
+	register8_t STATUS;
+	register8_t CTRL;
+} RST_t;
+
+typedef struct WDT_struct {
+	register8_t CTRL;
+	register8_t WINCTRL;
+	register8_t STATUS;
+} WDT_t;
+
+extern OSC_t OSC;
+extern CLK_t CLK;
+extern DFLL_t DFLLRC32M, DFLLRC2M;
+extern PMIC_t PMIC;
+extern RST_t RST;
+extern WDT_t WDT;
+
+#define OSC_RC2MEN_bm				0x01
+#define OSC_RC32MEN_bm				0x02
+#define OSC_RC32KEN_bm				0x04
+#define OSC_XOSCEN_bm				0x08
+#define OSC_PLLEN_bm				0x10
+#define OSC_RC2MRDY_bm				0x01
+#define OSC_RC32MRDY_bm				0x02
+#define OSC_RC32KRDY_bm				0x04
+#define OSC_XOSCRDY_bm				0x08
+#define OSC_PLLRDY_bm				0x10
+#define OSC_FRQRANGE_12TO16_gc		0xC0
+#define OSC_XOSCSEL_XTAL_16KCLK_gc	0x0B
+#define OSC_PLLSRC_RC2M_gc			0x00
+#define OSC_PLLSRC_RC32M_gc			0x80
+#define OSC_PLLSRC_XOSC_gc			0xC0
+#define OSC_RC32MCREF_USBSOF_gc		0x04
+#define DFLL_ENABLE_bm				0x01
+#define CLK_SCLKSEL_gm				0x07
+#define CLK_SCLKSEL_RC2M_gc			0x00
+#define CLK_SCLKSEL_RC32M_gc		0x01
+#define CLK_SCLKSEL_PLL_gc			0x04
+#define CLK_PSADIV_1_gc				0x00
+#define CLK_PSADIV_2_gc				0x04
+#define CLK_PSBCDIV_1_1_gc			0x00
+#define CLK_USBPSDIV_1_gc			0x00
+#define CLK_USBSRC_gm				0x06
+#define CLK_USBSRC_PLL_gc			0x00
+#define CLK_USBSRC_RC32M_gc			0x02
+#define CLK_USBSEN_bm				0x01
+#define PMIC_IVSEL_bm				0x40
+#define PMIC_HILVLEN_bm				0x04
+#define PMIC_MEDLVLEN_bm			0x02
+#define PMIC_LOLVLEN_bm				0x01
+#define RST_SWRST_bm				0x01
+#define WDT_PER_8KCLK_gc			0x28
+#define WDT_WPER_128CLK_gc			0x10
+#define WDT_ENABLE_bm				0x02
+#define WDT_CEN_bm					0x01
+#define WDT_WCEN_bm					0x01
+#define WDT_SYNCBUSY_bm				0x01
+
+
+/**************************************************************************************************
+** Ports and SPI, for the external SPI flash driver
+*/
+typedef struct PORT_struct {
+	register8_t DIR;
+	register8_t DIRSET;
+	register8_t DIRCLR;
+	register8_t DIRTGL;
+	register8_t OUT;
+	register8_t OUTSET;
+	register8_t OUTCLR;
+	register8_t OUTTGL;
+	register8_t IN;
+} PORT_t;
+
+typedef struct SPI_struct {
+	register8_t CTRL;
+	register8_t INTCTRL;
+	register8_t STATUS;
+	register8_t DATA;
+} SPI_t;
+
+extern PORT_t PORTC, PORTD;
+extern SPI_t SPIC, SPID;
+
+#define SPI_CLK2X_bm				0x80
+#define SPI_ENABLE_bm				0x40
+#define SPI_MASTER_bm				0x10
+#define SPI_MODE_0_gc				0x00
+#define SPI_PRESCALER_DIV4_gc		0x00
+#define SPI_IF_bm					0x80
+#define PIN4_bm						0x10
+#define PIN5_bm						0x20
+#define PIN7_bm						0x80
+
+
+/**************************************************************************************************
+** Host build of the NVM command execution in eeprom.h
+*/
+#define NVM_EXEC()	do { CCP = CCP_IOREG_gc; NVM.CTRLA = NVM_CMDEX_bm; } while (0)
+
+
+#endif // HOST_AVR_IO_H
@@ -0,0 +1,61 @@
+/*
+ * avr/pgmspace.h
+ *
+ * Host build: far flash reads. Addresses inside the device flash go to the NVM model, which
+ * checks for reads of the application section while it is being programmed. Anything above is
+ * a host address returned by pgm_get_far_address(), i.e. a constant of the bootloader itself.
+ * The host build is linked without PIE, so these fit in 32 bits and are above the flash.
+ */
+
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+
+#define PROGMEM
+#define PSTR(s)		(s)
+
+extern uint8_t model_lpm(uint32_t address);
+
+#define pgm_get_far_address(var)	((uint32_t)(uintptr_t)&(var))
+
+static inline uint8_t pgm_read_byte_far(uint32_t address)
+{
+	if (address <= FLASH_END)
+		return model_lpm(address);
+	return *(const uint8_t *)(uintptr_t)address;
+}
+
+static inline uint16_t pgm_read_word_far(uint32_t address)
+{
+	return pgm_read_byte_far(address) | ((uint16_t)pgm_read_byte_far(address + 1) << 8);
+}
+
+static inline uint32_t pgm_read_dword_far(uint32_t address)
+{
+	return pgm_read_word_far(address) | ((uint32_t)pgm_read_word_far(address + 2) << 16);
+}
+
+static inline void *pgm_read_ptr_far(uint32_t address)
+{
+	if (address <= FLASH_END)
+		return NULL;			// no code in the device flash
+	return *(void * const *)(uintptr_t)address;
+}
+
+static inline void *memcpy_PF(void *dest, uint32_t src, size_t len)
+{
+	uint8_t *d = dest;
+	while (len--)
+		*d++ = pgm_read_byte_far(src++);
+	return dest;
+}
+
+#define pgm_read_byte(address)		pgm_read_byte_far((uint32_t)(uintptr_t)(address))
+#define pgm_read_word(address)		pgm_read_word_far((uint32_t)(uintptr_t)(address))
+#define memcpy_P(dest, src, len)	memcpy_PF(dest, (uint32_t)(uintptr_t)(src), len)
+
+
+#endif // HOST_AVR_PGMSPACE_H
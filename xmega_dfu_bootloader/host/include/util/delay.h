@@ -0,0 +1,14 @@
+/*
+ * util/delay.h
+ *
+ * Host build: delays are not modelled.
+ */
+
+#ifndef HOST_UTIL_DELAY_H
+#define HOST_UTIL_DELAY_H
+
+#define _delay_ms(ms)	do {} while (0)
+#define _delay_us(us)	do {} while (0)
+
+
+#endif // HOST_UTIL_DELAY_H
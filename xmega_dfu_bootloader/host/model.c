@@ -0,0 +1,461 @@
+/*
+ * model.c
+ *
+ * NVM controller, CRC module and configuration change protection. Registers that act when they
+ * are written (model_reg_t) carry a marker in bit 8, which a write from the firmware clears.
+ * Every access through NVM, CRC or CCP calls model_tick() first, which applies the write made by
+ * the previous access, so writes take effect one cycle later, in program order.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "model.h"
+
+#define MODEL_WRITTEN(reg)	(((reg) & 0x100) == 0)
+#define MODEL_ARM(reg)		((reg) = ((reg) & 0xFF) | 0x100)
+
+#define CCP_WINDOW			4		// cycles, as on the device
+
+uint8_t model_flash[MODEL_FLASH_SIZE];
+uint8_t model_eeprom[EEPROM_SIZE];
+uint8_t model_usersig[USER_SIGNATURES_SIZE];
+uint8_t model_prodsig[PROD_SIGNATURES_SIZE];
+uint8_t model_fuses[FUSE_SIZE];
+uint8_t model_sram[INTERNAL_SRAM_SIZE];
+
+model_stats_t model_stats;
+uint32_t model_flash_worn_page = 0xFFFFFFFF;
+uint64_t model_cpu_ps = 0;
+uint64_t model_bus_ps = 0;
+
+// plain registers
+register8_t SREG, RAMPZ, RAMPD, RAMPX, RAMPY, EIND;
+OSC_t OSC;
+CLK_t CLK;
+DFLL_t DFLLRC32M, DFLLRC2M;
+PMIC_t PMIC;
+RST_t RST;
+WDT_t WDT;
+PORT_t PORTC, PORTD;
+SPI_t SPIC, SPID;
+
+static NVM_t nvm;
+static CRC_t crc;
+static model_reg_t ccp;
+
+static uint64_t ccp_cycle;				// cycle of the last CCP write
+static uint8_t ccp_key;
+static uint64_t cycle;
+
+static uint64_t nvm_busy_until;
+static bool nvm_flash_op;				// the busy operation is on the application section
+
+static uint16_t flash_buffer[APP_SECTION_PAGE_SIZE / 2];
+static bool flash_loaded[APP_SECTION_PAGE_SIZE / 2];
+static uint8_t eeprom_buffer[EEPROM_PAGE_SIZE];
+static bool eeprom_loaded[EEPROM_PAGE_SIZE];
+
+static uint32_t crc_value;
+
+
+/**************************************************************************************************
+* Report something the device would not do the way the firmware expects
+*/
+void model_violation(const char *what)
+{
+	model_stats.violations++;
+	fprintf(stderr, "model: %s (NVM.CMD 0x%02X, t=%llu ns)\n", what, nvm.CMD,
+			(unsigned long long)(model_cpu_ps / 1000));
+}
+
+/**************************************************************************************************
+* Erased device with a made up production signature row
+*/
+void model_reset(void)
+{
+	memset(model_flash, 0xFF, sizeof(model_flash));
+	memset(model_eeprom, 0xFF, sizeof(model_eeprom));
+	memset(model_usersig, 0xFF, sizeof(model_usersig));
+	memset(model_fuses, 0xFF, sizeof(model_fuses));
+	memset(model_sram, 0, sizeof(model_sram));
+	for (uint8_t i = 0; i < sizeof(model_prodsig); i++)
+		model_prodsig[i] = 0x40 + i;
+	memset(&model_stats, 0, sizeof(model_stats));
+	model_flash_worn_page = 0xFFFFFFFF;
+
+	memset(&nvm, 0, sizeof(nvm));
+	memset(&crc, 0, sizeof(crc));
+	MODEL_ARM(nvm.DATA0);
+	MODEL_ARM(nvm.CTRLA);
+	MODEL_ARM(crc.CTRL);
+	MODEL_ARM(crc.STATUS);
+	MODEL_ARM(crc.DATAIN);
+	ccp = 0;
+	MODEL_ARM(ccp);
+	ccp_key = 0;
+	cycle = 0;
+	model_cpu_ps = 0;
+	model_bus_ps = 0;
+	nvm_busy_until = 0;
+	nvm_flash_op = false;
+	memset(flash_loaded, 0, sizeof(flash_loaded));
+	memset(eeprom_loaded, 0, sizeof(eeprom_loaded));
+}
+
+bool model_nvm_busy(void)
+{
+	return model_cpu_ps < nvm_busy_until;
+}
+
+static void nvm_start(uint64_t duration, bool flash)
+{
+	nvm_busy_until = model_cpu_ps + duration;
+	nvm_flash_op = flash;
+}
+
+static bool ccp_open(uint8_t key)
+{
+	return (ccp_key == key) && (cycle - ccp_cycle <= CCP_WINDOW);
+}
+
+/**************************************************************************************************
+* CRC-32 as used by the CRC module in CRC32 mode (IEEE 802.3, reflected)
+*/
+static void crc_feed(uint8_t b)
+{
+	crc_value ^= b;
+	for (uint8_t i = 0; i < 8; i++)
+		crc_value = (crc_value >> 1) ^ (0xEDB88320UL & -(crc_value & 1));
+}
+
+static void crc_result(void)
+{
+	uint32_t out = ~crc_value;
+	crc.CHECKSUM0 = out;
+	crc.CHECKSUM1 = out >> 8;
+	crc.CHECKSUM2 = out >> 16;
+	crc.CHECKSUM3 = out >> 24;
+	crc.STATUS = (crc.STATUS & ~CRC_BUSY_bm) | 0x100;
+}
+
+static void crc_flash(uint32_t start, uint32_t end)
+{
+	model_stats.flash_crcs++;
+	if ((crc.CTRL & CRC_SOURCE_gm) != CRC_SOURCE_FLASH_gc)
+	{
+		model_violation("flash CRC without the CRC module set to the flash source");
+		return;
+	}
+	if ((end >= MODEL_FLASH_SIZE) || (end < start))
+	{
+		model_violation("flash CRC range outside the flash");
+		return;
+	}
+	for (uint32_t a = start; a <= end; a++)
+		crc_feed(model_flash[a]);
+	crc_result();
+}
+
+/**************************************************************************************************
+* NVM command execution (CMDEX)
+*/
+static void nvm_cmdex(void)
+{
+	if (!ccp_open(CCP_IOREG_gc))
+	{
+		model_violation("CMDEX without CCP");
+		return;
+	}
+	if (model_nvm_busy() && (nvm.CMD != NVM_CMD_READ_FUSES_gc))
+	{
+		model_violation("NVM command while busy");
+		return;
+	}
+
+	uint32_t address = nvm.ADDR0 | ((uint32_t)nvm.ADDR1 << 8) | ((uint32_t)nvm.ADDR2 << 16);
+	uint16_t page = (address % EEPROM_SIZE) & ~(EEPROM_PAGE_SIZE - 1);
+	switch (nvm.CMD)
+	{
+		case NVM_CMD_READ_FUSES_gc:
+			nvm.DATA0 = model_fuses[address % FUSE_SIZE] | 0x100;
+			break;
+
+		case NVM_CMD_READ_EEPROM_gc:
+			nvm.DATA0 = model_eeprom[address % EEPROM_SIZE] | 0x100;
+			break;
+
+		// only locations loaded in the page buffer are erased and written
+		case NVM_CMD_ERASE_EEPROM_PAGE_gc:
+		case NVM_CMD_WRITE_EEPROM_PAGE_gc:
+		case NVM_CMD_ERASE_WRITE_EEPROM_PAGE_gc: {
+			bool erase = (nvm.CMD != NVM_CMD_WRITE_EEPROM_PAGE_gc);
+			bool write = (nvm.CMD != NVM_CMD_ERASE_EEPROM_PAGE_gc);
+			for (uint8_t i = 0; i < EEPROM_PAGE_SIZE; i++)
+			{
+				if (!eeprom_loaded[i])
+					continue;
+				if (erase)
+					model_eeprom[page + i] = 0xFF;
+				if (write)
+					model_eeprom[page + i] &= eeprom_buffer[i];
+			}
+			model_stats.eeprom_erases += erase;
+			model_stats.eeprom_writes += write;
+			nvm_start((erase ? MODEL_EEPROM_ERASE_PS : 0) + (write ? MODEL_EEPROM_WRITE_PS : 0), false);
+			if (write)
+				memset(eeprom_loaded, 0, sizeof(eeprom_loaded));
+			break;
+		}
+
+		case NVM_CMD_ERASE_EEPROM_BUFFER_gc:
+			memset(eeprom_loaded, 0, sizeof(eeprom_loaded));
+			break;
+
+		case NVM_CMD_ERASE_FLASH_BUFFER_gc:
+			memset(flash_loaded, 0, sizeof(flash_loaded));
+			break;
+
+		case NVM_CMD_FLASH_RANGE_CRC_gc: {
+			uint32_t end = (nvm.DATA0 & 0xFF) | ((uint32_t)nvm.DATA1 << 8) | ((uint32_t)nvm.DATA2 << 16);
+			crc_flash(address, end);
+			break;
+		}
+
+		case NVM_CMD_APP_CRC_gc:
+			crc_flash(APP_SECTION_START, APP_SECTION_END);
+			break;
+
+		case NVM_CMD_BOOT_CRC_gc:
+			crc_flash(BOOT_SECTION_START, FLASH_END);
+			break;
+
+		default:
+			model_violation("unsupported CMDEX command");
+			break;
+	}
+}
+
+/**************************************************************************************************
+* A data write while the command is LOAD_EEPROM_BUFFER loads the EEPROM page buffer
+*/
+static void nvm_data0(void)
+{
+	if (nvm.CMD != NVM_CMD_LOAD_EEPROM_BUFFER_gc)
+		return;
+	if (model_nvm_busy())
+		model_violation("EEPROM page buffer load while busy");
+	uint8_t i = nvm.ADDR0 % EEPROM_PAGE_SIZE;
+	if (eeprom_loaded[i])
+		model_violation("EEPROM page buffer location loaded twice");
+	eeprom_buffer[i] = nvm.DATA0;
+	eeprom_loaded[i] = true;
+}
+
+static void crc_ctrl(void)
+{
+	if (crc.CTRL & CRC_RESET_gm)
+	{
+		crc_value = ((crc.CTRL & CRC_RESET_gm) == CRC_RESET_RESET1_gc) ? 0xFFFFFFFFUL : 0;
+		crc.CTRL &= ~CRC_RESET_gm;		// self clearing
+		return;
+	}
+	if ((crc.CTRL & CRC_SOURCE_gm) != CRC_SOURCE_DISABLE_gc)
+	{
+		if (!(crc.CTRL & CRC_CRC32_bm))
+			model_violation("CRC module in CRC16 mode");
+		crc.STATUS |= CRC_BUSY_bm;
+	}
+}
+
+/**************************************************************************************************
+* Apply the last register write and advance the clock by one cycle
+*/
+void model_tick(void)
+{
+	if (MODEL_WRITTEN(ccp))
+	{
+		ccp_key = ccp & 0xFF;
+		ccp_cycle = cycle;
+		MODEL_ARM(ccp);
+	}
+	if (MODEL_WRITTEN(nvm.DATA0))
+	{
+		nvm_data0();
+		MODEL_ARM(nvm.DATA0);
+	}
+	if (MODEL_WRITTEN(nvm.CTRLA))
+	{
+		if (nvm.CTRLA & NVM_CMDEX_bm)
+			nvm_cmdex();
+		nvm.CTRLA = 0x100;				// CMDEX is cleared by hardware
+	}
+	if (MODEL_WRITTEN(crc.CTRL))
+	{
+		crc_ctrl();
+		MODEL_ARM(crc.CTRL);
+	}
+	if (MODEL_WRITTEN(crc.DATAIN))
+	{
+		if (((crc.CTRL & CRC_SOURCE_gm) == CRC_SOURCE_IO_gc) && (crc.STATUS & CRC_BUSY_bm))
+			crc_feed(crc.DATAIN);
+		else
+			model_violation("CRC data written with the I/O source off");
+		MODEL_ARM(crc.DATAIN);
+	}
+	if (MODEL_WRITTEN(crc.STATUS))
+	{
+		// writing BUSY ends the I/O stream and makes the checksum available
+		if ((crc.STATUS & CRC_BUSY_bm) && ((crc.CTRL & CRC_SOURCE_gm) == CRC_SOURCE_IO_gc))
+			crc_result();
+		MODEL_ARM(crc.STATUS);
+	}
+
+	cycle++;
+	model_cpu_ps += MODEL_CPU_CYCLE_PS;
+	if (model_nvm_busy())
+		nvm.STATUS = NVM_NVMBUSY_bm | (nvm_flash_op ? NVM_FBUSY_bm : 0);
+	else
+		nvm.STATUS = 0;
+}
+
+/**************************************************************************************************
+* Apply a pending write, called when firmware code returns to the harness
+*/
+void model_sync(void)
+{
+	model_tick();
+}
+
+NVM_t *model_nvm(void)
+{
+	model_tick();
+	return &nvm;
+}
+
+CRC_t *model_crc(void)
+{
+	model_tick();
+	return &crc;
+}
+
+model_reg_t *model_ccp(void)
+{
+	model_tick();
+	return &ccp;
+}
+
+/**************************************************************************************************
+* LPM/ELPM. Reads the calibration or user signature row when the command selects it.
+*/
+uint8_t model_lpm(uint32_t address)
+{
+	model_tick();
+	switch (nvm.CMD)
+	{
+		case NVM_CMD_READ_CALIB_ROW_gc:
+			return model_prodsig[address % PROD_SIGNATURES_SIZE];
+		case NVM_CMD_READ_USER_SIG_ROW_gc:
+			return model_usersig[address % USER_SIGNATURES_SIZE];
+	}
+	if (address >= MODEL_FLASH_SIZE)
+	{
+		model_violation("flash read outside the flash");
+		return 0xFF;
+	}
+	if (model_nvm_busy() && nvm_flash_op && (address < BOOT_SECTION_START))
+	{
+		model_violation("application section read while it is being programmed");
+		return 0xFF;
+	}
+	return model_flash[address];
+}
+
+/**************************************************************************************************
+* SPM. address is RAMPZ:Z, data is R1:R0.
+*/
+void model_spm(uint32_t address, uint16_t data)
+{
+	model_tick();
+	if (!ccp_open(CCP_SPM_gc))
+	{
+		model_violation("SPM without CCP");
+		return;
+	}
+	if (model_nvm_busy())
+	{
+		model_violation("SPM while busy");
+		return;
+	}
+
+	uint32_t page = address & ~(uint32_t)(APP_SECTION_PAGE_SIZE - 1);
+	switch (nvm.CMD)
+	{
+		case NVM_CMD_LOAD_FLASH_BUFFER_gc: {
+			uint16_t word = (address % APP_SECTION_PAGE_SIZE) / 2;
+			if (flash_loaded[word])
+				model_violation("flash page buffer word loaded twice");
+			flash_buffer[word] = data;
+			flash_loaded[word] = true;
+			return;
+		}
+
+		case NVM_CMD_ERASE_APP_PAGE_gc:
+		case NVM_CMD_WRITE_APP_PAGE_gc:
+		case NVM_CMD_ERASE_WRITE_APP_PAGE_gc: {
+			if (page >= BOOT_SECTION_START)
+			{
+				model_violation("application page command outside the application section");
+				return;
+			}
+			bool erase = (nvm.CMD != NVM_CMD_WRITE_APP_PAGE_gc);
+			bool write = (nvm.CMD != NVM_CMD_ERASE_APP_PAGE_gc);
+			if (erase)
+			{
+				if (page != model_flash_worn_page)
+					memset(&model_flash[page], 0xFF, APP_SECTION_PAGE_SIZE);
+				model_stats.flash_erases++;
+			}
+			if (write)
+			{
+				for (uint16_t i = 0; i < APP_SECTION_PAGE_SIZE / 2; i++)
+				{
+					uint16_t w = flash_loaded[i] ? flash_buffer[i] : 0xFFFF;
+					model_flash[page + (i * 2)] &= w;		// programming only clears bits
+					model_flash[page + (i * 2) + 1] &= w >> 8;
+				}
+				memset(flash_loaded, 0, sizeof(flash_loaded));	// buffer is erased after a write
+				model_stats.flash_writes++;
+			}
+			nvm_start((erase ? MODEL_FLASH_ERASE_PS : 0) + (write ? MODEL_FLASH_WRITE_PS : 0), true);
+			return;
+		}
+
+		case NVM_CMD_ERASE_APP_gc:
+			memset(model_flash, 0xFF, BOOT_SECTION_START);
+			model_stats.flash_erases += APP_SECTION_SIZE / APP_SECTION_PAGE_SIZE;
+			nvm_start(MODEL_FLASH_ERASE_PS, true);
+			return;
+
+		case NVM_CMD_ERASE_USER_SIG_ROW_gc:
+			memset(model_usersig, 0xFF, sizeof(model_usersig));
+			model_stats.usersig_erases++;
+			nvm_start(MODEL_FLASH_ERASE_PS, false);
+			return;
+
+		case NVM_CMD_WRITE_USER_SIG_ROW_gc:
+			for (uint16_t i = 0; i < USER_SIGNATURES_SIZE / 2; i++)
+			{
+				uint16_t w = flash_loaded[i] ? flash_buffer[i] : 0xFFFF;
+				model_usersig[i * 2] &= w;
+				model_usersig[(i * 2) + 1] &= w >> 8;
+			}
+			memset(flash_loaded, 0, sizeof(flash_loaded));
+			model_stats.usersig_writes++;
+			nvm_start(MODEL_FLASH_WRITE_PS, false);
+			return;
+
+		default:
+			model_violation("unsupported SPM command");
+			return;
+	}
+}
@@ -0,0 +1,92 @@
+/*
+ * model.h
+ *
+ * Register level model of the ATxmega128A3U peripherals that the bootloader uses, for the host
+ * build. NVM, CRC and CCP are accessed through functions (see avr/io.h) so that the model sees
+ * every access: each one advances the CPU clock by one cycle and applies the previous register
+ * write. The USB endpoint table is plain memory, as on the device, and the USB model plays the
+ * part of the controller and of the host.
+ *
+ * Time is kept in picoseconds on two clocks, the CPU and the bus. NVM operations keep the
+ * controller busy for the nominal times below, and the firmware waits for them by polling
+ * NVM.STATUS as it does on the device. The code between register accesses takes no time, so
+ * timings are only good for comparing NVM and bus bound changes against each other.
+ */
+
+#ifndef MODEL_H_
+#define MODEL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <avr/io.h>
+
+
+// nominal timings, adjust to the datasheet of the part being modelled
+#define MODEL_CPU_CYCLE_PS			41667ULL		// 24MHz, USB_USE_PLL
+#define MODEL_BUS_BIT_PS			83333ULL		// full speed
+#define MODEL_FLASH_ERASE_PS		4000000000ULL	// 4ms
+#define MODEL_FLASH_WRITE_PS		4000000000ULL
+#define MODEL_EEPROM_ERASE_PS		4000000000ULL
+#define MODEL_EEPROM_WRITE_PS		4000000000ULL
+#define MODEL_AES_CYCLES			375				// one block in the crypto engine
+
+#define MODEL_FLASH_SIZE			(FLASH_END + 1)
+
+extern uint8_t model_flash[MODEL_FLASH_SIZE];
+extern uint8_t model_eeprom[EEPROM_SIZE];
+extern uint8_t model_usersig[USER_SIGNATURES_SIZE];
+extern uint8_t model_prodsig[PROD_SIGNATURES_SIZE];
+extern uint8_t model_fuses[FUSE_SIZE];
+
+typedef struct {
+	uint32_t flash_erases;
+	uint32_t flash_writes;
+	uint32_t eeprom_erases;
+	uint32_t eeprom_writes;
+	uint32_t usersig_erases;
+	uint32_t usersig_writes;
+	uint32_t flash_crcs;
+	uint32_t aes_blocks;
+	uint32_t violations;		// anything the device would not do as the firmware expects
+} model_stats_t;
+
+extern model_stats_t model_stats;
+extern uint32_t model_flash_worn_page;	// address of a flash page that no longer erases, for write failures
+extern uint64_t model_cpu_ps;
+extern uint64_t model_bus_ps;
+
+
+/**************************************************************************************************
+** NVM, CRC and CCP (model.c)
+*/
+void		model_reset(void);
+void		model_tick(void);
+void		model_sync(void);
+void		model_violation(const char *what);
+void		model_spm(uint32_t address, uint16_t data);
+uint8_t		model_lpm(uint32_t address);
+bool		model_nvm_busy(void);
+
+
+/**************************************************************************************************
+** USB controller and host (usb_model.c)
+*/
+#define USBH_STALL			-1
+#define USBH_NAK			-2
+#define USBH_TIMEOUT		-3		// wrong address, controller disabled or detached
+
+void		usbh_reset(void);
+int			usbh_setup(const void *setup);
+int			usbh_out(uint8_t ep, const void *data, uint16_t len);
+int			usbh_in(uint8_t ep, void *data, uint16_t len);
+int			usbh_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+						 uint16_t wLength, void *data);
+
+
+/**************************************************************************************************
+** External SPI flash (spi_flash.c)
+*/
+extern const char *model_spi_flash_file;	// file holding the flash contents, NULL for no chip
+
+
+#endif /* MODEL_H_ */
@@ -0,0 +1,138 @@
+/*
+ * sp_driver.c
+ *
+ * Host build of the sp_driver.S routines that the bootloader calls, written against the NVM
+ * model the same way as the assembler: NVM command, CCP, SPM. Routines that are commented out
+ * in sp_driver.S (SP_EraseWriteApplicationPage, SP_LoadFlashWord, SP_ReadWord...) are left out
+ * here too, so that the host build fails to link where the device build would.
+ */
+
+#include "sp_driver.h"
+#include "model.h"
+
+static void sp_common_spm(uint8_t cmd, uint32_t address, uint16_t data)
+{
+	NVM.CMD = cmd;
+	CCP = CCP_SPM_gc;
+	model_spm(address, data);
+}
+
+static uint32_t sp_common_cmd(uint8_t cmd)
+{
+	NVM.CMD = cmd;
+	CCP = CCP_IOREG_gc;
+	NVM.CTRLA = NVM_CMDEX_bm;
+	uint32_t data = NVM.DATA0 & 0xFF;
+	data |= (uint32_t)NVM.DATA1 << 8;
+	data |= (uint32_t)NVM.DATA2 << 16;
+	return data;
+}
+
+uint8_t SP_ReadByte(uint32_t address)
+{
+	return model_lpm(address);
+}
+
+uint8_t SP_ReadCalibrationByte(uint8_t index)
+{
+	NVM.CMD = NVM_CMD_READ_CALIB_ROW_gc;
+	return model_lpm(index);			// leaves the command set, as the assembler does
+}
+
+uint8_t SP_ReadUserSignatureByte(uint16_t index)
+{
+	NVM.CMD = NVM_CMD_READ_USER_SIG_ROW_gc;
+	return model_lpm(index);
+}
+
+uint8_t SP_ReadFuseByte(uint8_t index)
+{
+	NVM.ADDR0 = index;
+	NVM.ADDR1 = 0;
+	NVM.ADDR2 = 0;
+	return sp_common_cmd(NVM_CMD_READ_FUSES_gc);
+}
+
+void SP_EraseUserSignatureRow(void)
+{
+	sp_common_spm(NVM_CMD_ERASE_USER_SIG_ROW_gc, 0, 0);
+}
+
+void SP_WriteUserSignatureRow(void)
+{
+	sp_common_spm(NVM_CMD_WRITE_USER_SIG_ROW_gc, 0, 0);
+}
+
+void SP_EraseApplicationSection(void)
+{
+	sp_common_spm(NVM_CMD_ERASE_APP_gc, 0, 0);
+}
+
+void SP_EraseApplicationPage(uint32_t address)
+{
+	sp_common_spm(NVM_CMD_ERASE_APP_PAGE_gc, address, 0);
+}
+
+void SP_LoadFlashPage(const uint8_t *data)
+{
+	NVM.CMD = NVM_CMD_LOAD_FLASH_BUFFER_gc;
+	for (uint16_t i = 0; i < FLASH_PAGE_SIZE; i += 2)
+	{
+		CCP = CCP_SPM_gc;
+		model_spm(i, data[i] | ((uint16_t)data[i + 1] << 8));
+	}
+}
+
+void SP_ReadFlashPage(uint8_t *data, uint32_t address)
+{
+	NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+	for (uint16_t i = 0; i < FLASH_PAGE_SIZE; i++)
+		*data++ = model_lpm(address++);
+}
+
+void SP_ReadFlash(uint8_t *data, uint32_t address, uint16_t length)
+{
+	NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+	while (length--)
+		*data++ = model_lpm(address++);
+}
+
+uint8_t SP_CompareFlashPage(const uint8_t *data, uint32_t address)
+{
+	NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+	uint8_t diff = 0;
+	uint8_t blank = 0xFF;
+	for (uint16_t i = 0; i < FLASH_PAGE_SIZE; i += 8)
+	{
+		for (uint8_t j = 0; j < 8; j++)
+		{
+			uint8_t b = model_lpm(address++);
+			blank &= b;
+			diff |= b ^ *data++;
+		}
+		if ((blank != 0xFF) && diff)
+			return SP_PAGE_DIFFERENT;
+	}
+	return diff ? SP_PAGE_BLANK : SP_PAGE_EQUAL;
+}
+
+void SP_WriteApplicationPage(uint32_t address)
+{
+	sp_common_spm(NVM_CMD_WRITE_APP_PAGE_gc, address, 0);
+}
+
+uint32_t SP_ApplicationCRC(void)
+{
+	return sp_common_cmd(NVM_CMD_APP_CRC_gc);
+}
+
+uint32_t SP_BootCRC(void)
+{
+	return sp_common_cmd(NVM_CMD_BOOT_CRC_gc);
+}
+
+void SP_WaitForSPM(void)
+{
+	while (NVM.STATUS & NVM_NVMBUSY_bm);
+	NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+}
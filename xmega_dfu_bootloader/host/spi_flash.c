@@ -0,0 +1,111 @@
+/*
+ * spi_flash.c
+ *
+ * Host build of the external SPI flash driver, backed by a file that stands in for the chip.
+ * The tests stage an image in the file and point model_spi_flash_file at it. Bytes past the end
+ * of the file read as erased. Programming only clears bits and wraps within a 256 byte page, as
+ * on a 25 series part, and the file is updated in place.
+ *
+ * Each byte costs 8 SPI clocks at half the CPU clock, and a page program the nominal time below,
+ * so reading the next page overlaps the flash page write the same way it does on the device.
+ */
+
+#include <stdio.h>
+#include "model.h"
+#include "spi_flash.h"
+#include "dfu_config.h"
+
+#ifdef EXT_FLASH_UPDATE
+
+#define SPI_FLASH_PAGE_SIZE		256
+#define SPI_FLASH_BYTE_PS		(16 * MODEL_CPU_CYCLE_PS)
+#define SPI_FLASH_PROGRAM_PS	700000000ULL	// 0.7ms
+
+const char *model_spi_flash_file = NULL;
+
+static FILE *flash_file = NULL;
+static bool selected = false;
+static uint32_t read_address;
+
+
+/**************************************************************************************************
+* Byte at address, 0xFF past the end of the file
+*/
+static uint8_t spi_flash_byte(uint32_t address)
+{
+	if ((flash_file == NULL) || (fseek(flash_file, address, SEEK_SET) != 0))
+		return 0xFF;
+	int c = fgetc(flash_file);
+	return (c == EOF) ? 0xFF : c;
+}
+
+void spi_flash_init(void)
+{
+	if (flash_file != NULL)
+		model_violation("SPI flash initialised twice");
+	if (model_spi_flash_file != NULL)
+		flash_file = fopen(model_spi_flash_file, "r+b");
+	selected = false;
+}
+
+void spi_flash_deinit(void)
+{
+	if (selected)
+		model_violation("SPI flash released while selected");
+	if (flash_file != NULL)
+		fclose(flash_file);
+	flash_file = NULL;
+}
+
+/**************************************************************************************************
+* Streamed read
+*/
+void spi_flash_read_begin(uint32_t address)
+{
+	if (selected)
+		model_violation("SPI flash command while selected");
+	selected = true;
+	read_address = address;
+	model_cpu_ps += 4 * SPI_FLASH_BYTE_PS;		// command and address
+}
+
+void spi_flash_read(uint8_t *dest, uint16_t len)
+{
+	if (!selected)
+		model_violation("SPI flash read without a read command");
+	model_cpu_ps += len * SPI_FLASH_BYTE_PS;
+	while (len--)
+		*dest++ = spi_flash_byte(read_address++);
+}
+
+void spi_flash_read_end(void)
+{
+	selected = false;
+}
+
+/**************************************************************************************************
+* Program up to one page and wait for completion
+*/
+void spi_flash_program(uint32_t address, const uint8_t *data, uint8_t len)
+{
+	if (selected)
+		model_violation("SPI flash command while selected");
+	model_cpu_ps += (1 + 4 + len + 2) * SPI_FLASH_BYTE_PS + SPI_FLASH_PROGRAM_PS;
+	if (flash_file == NULL)
+		return;
+
+	uint32_t page = address & ~(uint32_t)(SPI_FLASH_PAGE_SIZE - 1);
+	while (len--)
+	{
+		uint8_t b = spi_flash_byte(address) & *data++;
+		fseek(flash_file, 0, SEEK_END);
+		for (long end = ftell(flash_file); end < (long)address; end++)
+			fputc(0xFF, flash_file);		// erased up to the byte being programmed
+		fseek(flash_file, address, SEEK_SET);
+		fputc(b, flash_file);
+		address = page | ((address + 1) & (SPI_FLASH_PAGE_SIZE - 1));
+	}
+	fflush(flash_file);
+}
+
+#endif // EXT_FLASH_UPDATE
@@ -0,0 +1,1046 @@
+/*
+ * test_dfu.c
+ *
+ * Host tests of the bootloader. The host side of the USB model enumerates the device and runs
+ * DFU sessions against it, then the tests check the modelled memories. Each test runs in its
+ * own process, so it starts from reset with the firmware's static variables initialised.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "model.h"
+#include "usb.h"
+#include "dfu.h"
+#include "dfu_config.h"
+#include "sp_driver.h"
+#include "aes.h"
+
+#define CHECK(cond)		do { if (!(cond)) { \
+							fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+							exit(1); } } while (0)
+
+#if defined(AES_DECRYPT) || defined(IMAGE_AUTH)
+	#define SECURE_IMAGES		// flash images need a header and are encrypted or carry a tag
+#endif
+
+#define DEVICE_ADDRESS		1
+#define BLOCK_SIZE			APP_SECTION_PAGE_SIZE	// wTransferSize
+
+volatile bool reset_flag = false;	// main.c is not part of the host build
+
+
+/**************************************************************************************************
+* Host side helpers
+*/
+static void device_boot(void)
+{
+	model_reset();
+	usb_init();
+	usb_attach();
+	usbh_reset();
+
+	uint8_t desc[18];
+	CHECK(usbh_control(0x80, USB_REQ_GetDescriptor, USB_DTYPE_Device << 8, 0, sizeof(desc), desc) == sizeof(desc));
+	CHECK(usbh_control(0x00, USB_REQ_SetAddress, DEVICE_ADDRESS, 0, 0, NULL) == 0);
+	CHECK(usbh_control(0x00, USB_REQ_SetConfiguration, 1, 0, 0, NULL) == 0);
+}
+
+static void fill_random(uint8_t *data, uint32_t len, unsigned seed)
+{
+	srand(seed);
+	while (len--)
+		*data++ = rand();
+}
+
+#if defined(IMAGE_HEADER) || defined(EXT_FLASH_UPDATE)
+// CRC-32 as calculated by the CRC module
+static uint32_t crc32(const uint8_t *data, uint32_t len)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	while (len--)
+	{
+		crc ^= *data++;
+		for (uint8_t i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xEDB88320UL & -(crc & 1));
+	}
+	return ~crc;
+}
+#endif
+
+#if defined(IMAGE_HEADER) && !defined(SECURE_IMAGES)
+// header block followed by the image, returns the length of the stream
+static uint32_t header_image(uint8_t *stream, const uint8_t *image, uint32_t len, uint32_t crc)
+{
+	DFU_ImageHeader_t header = { .magic = DFU_IMAGE_MAGIC, .length = len, .crc = crc };
+	memset(stream, 0xFF, BLOCK_SIZE);
+	memcpy(stream, &header, sizeof(header));
+	memcpy(stream + BLOCK_SIZE, image, len);
+	return BLOCK_SIZE + len;
+}
+#endif
+
+#ifdef USB_DFU_MODE
+static int dfu_dnload(uint16_t block, const void *data, uint16_t len)
+{
+	return usbh_control(0x21, DFU_DNLOAD, block, DFU_INTERFACE, len, (void *)data);
+}
+
+#ifdef UPLOAD_SUPPORT
+static int dfu_upload(uint16_t block, void *data, uint16_t len)
+{
+	return usbh_control(0xA1, DFU_UPLOAD, block, DFU_INTERFACE, len, data);
+}
+#endif
+
+static DFU_StatusResponse dfu_getstatus(void)
+{
+	DFU_StatusResponse st;
+	memset(&st, 0xEE, sizeof(st));
+	CHECK(usbh_control(0xA1, DFU_GETSTATUS, 0, DFU_INTERFACE, sizeof(st), &st) == sizeof(st));
+	return st;
+}
+
+static void dfu_set_alternate(uint8_t alt)
+{
+	CHECK(usbh_control(0x01, USB_REQ_SetInterface, alt, DFU_INTERFACE, 0, NULL) == 0);
+}
+
+// download an image in blocks as dfu-util does and manifest it, returns the final status
+static DFU_StatusResponse dfu_download(const uint8_t *image, uint32_t len, uint16_t block_size)
+{
+	DFU_StatusResponse st;
+	uint16_t block = 0;
+	for (uint32_t offset = 0; offset < len; offset += block_size)
+	{
+		uint16_t n = (len - offset < block_size) ? len - offset : block_size;
+		CHECK(dfu_dnload(block++, image + offset, n) == n);
+		st = dfu_getstatus();
+		CHECK(st.bStatus == DFU_STATUS_OK);
+		CHECK((st.bState == DFU_STATE_dfuDNLOAD_IDLE) || (st.bState == DFU_STATE_dfuDNBUSY));
+	}
+	CHECK(dfu_dnload(block, NULL, 0) == 0);
+	return dfu_getstatus();
+}
+#endif
+
+#ifdef USB_HID
+static int hid_out(uint8_t command, uint8_t sequence, const void *data, uint8_t len)
+{
+	HID_DFU_Report_t rep;
+	memset(&rep, 0, sizeof(rep));
+	rep.bCommand = command;
+	rep.bSequence = sequence;
+	rep.bLength = len;
+	memcpy(rep.data, data, len);
+	return usbh_out(0x01, &rep, sizeof(rep));
+}
+
+static bool hid_in(HID_DFU_Response_t *res)
+{
+	int r = usbh_in(0x81, res, sizeof(*res));
+	if (r == USBH_NAK)
+		return false;
+	CHECK(r == sizeof(*res));
+	return true;
+}
+
+// send a report, collecting responses while the device NAKs it, then wait for its response
+static HID_DFU_Response_t hid_command(uint8_t command, uint8_t sequence, const void *data, uint8_t len)
+{
+	HID_DFU_Response_t res;
+	int r;
+	while ((r = hid_out(command, sequence, data, len)) == USBH_NAK)
+		CHECK(hid_in(&res));
+	CHECK(r == sizeof(HID_DFU_Report_t));
+	do
+		CHECK(hid_in(&res));
+	while ((res.bCommand != command) || (res.bSequence != sequence));
+	return res;
+}
+#endif
+
+
+/**************************************************************************************************
+* Tests
+*/
+static void test_enumerate(void)
+{
+	device_boot();
+
+	uint8_t desc[18];
+	CHECK(usbh_control(0x80, USB_REQ_GetDescriptor, USB_DTYPE_Device << 8, 0, sizeof(desc), desc) == sizeof(desc));
+	CHECK(desc[1] == USB_DTYPE_Device);
+	CHECK((desc[8] | (desc[9] << 8)) == USB_VID);
+	CHECK((desc[10] | (desc[11] << 8)) == USB_PID);
+
+	uint8_t config[255];
+	int len = usbh_control(0x80, USB_REQ_GetDescriptor, USB_DTYPE_Configuration << 8, 0, sizeof(config), config);
+	CHECK(len > 9);
+	CHECK(len == (config[2] | (config[3] << 8)));
+	bool dfu_interface = false;
+	for (int i = 0; i < len; i += config[i])
+	{
+		CHECK(config[i] != 0);
+#ifdef USB_HID
+		if ((config[i + 1] == USB_DTYPE_Interface) && (config[i + 5] == 0x03))		// HID class
+#else
+		if ((config[i + 1] == USB_DTYPE_Interface) && (config[i + 5] == DFU_INTERFACE_CLASS))
+#endif
+			dfu_interface = true;
+	}
+	CHECK(dfu_interface);
+}
+
+#ifdef USB_DFU_MODE
+#ifndef SECURE_IMAGES
+static void test_download(void)
+{
+	static uint8_t image[4 * BLOCK_SIZE + 100];
+	fill_random(image, sizeof(image), 1);
+
+	device_boot();
+	DFU_StatusResponse st = dfu_download(image, sizeof(image), BLOCK_SIZE);
+	CHECK(st.bStatus == DFU_STATUS_OK);
+	CHECK(st.bState == DFU_STATE_dfuMANIFEST_WAIT_RST);
+	CHECK(reset_flag);
+	CHECK(memcmp(model_flash, image, sizeof(image)) == 0);
+	CHECK(model_stats.flash_writes == 5);
+}
+#endif
+
+#ifdef UPLOAD_SUPPORT
+static void test_upload(void)
+{
+	device_boot();
+	fill_random(model_flash, APP_SECTION_SIZE, 2);
+
+	uint8_t block[BLOCK_SIZE];
+	for (uint16_t i = 0; i < 3; i++)
+	{
+		CHECK(dfu_upload(i, block, sizeof(block)) == sizeof(block));
+		CHECK(memcmp(block, &model_flash[i * BLOCK_SIZE], sizeof(block)) == 0);
+	}
+}
+#endif
+
+#ifndef SECURE_IMAGES
+// the same image again only writes what has to change
+static void test_redownload(void)
+{
+	static uint8_t image[4 * BLOCK_SIZE];
+	fill_random(image, sizeof(image), 3);
+
+	device_boot();
+	memcpy(model_flash, image, sizeof(image));
+	DFU_StatusResponse st = dfu_download(image, sizeof(image), BLOCK_SIZE);
+	CHECK(st.bStatus == DFU_STATUS_OK);
+	CHECK(memcmp(model_flash, image, sizeof(image)) == 0);
+#ifdef DELAYED_ZERO_PAGE
+	CHECK(model_stats.flash_erases == 1);	// page 0 is erased until manifestation
+	CHECK(model_stats.flash_writes == 1);
+#else
+	CHECK(model_stats.flash_erases == 0);
+	CHECK(model_stats.flash_writes == 0);
+#endif
+}
+#endif
+
+static void test_eeprom(void)
+{
+	static uint8_t image[BLOCK_SIZE];
+	fill_random(image, sizeof(image), 4);
+
+	device_boot();
+	dfu_set_alternate(DFU_ALT_EEPROM);
+	DFU_StatusResponse st = dfu_download(image, sizeof(image), BLOCK_SIZE);
+	CHECK(st.bStatus == DFU_STATUS_OK);
+	CHECK(memcmp(model_eeprom, image, sizeof(image)) == 0);
+	CHECK(model_eeprom[sizeof(image)] == 0xFF);
+	CHECK(model_stats.flash_writes == 0);
+}
+
+// blocks past the end of the memory are refused in the data stage
+static void test_range(void)
+{
+	static uint8_t block[BLOCK_SIZE];
+	memset(block, 0x55, sizeof(block));
+
+	device_boot();
+	CHECK(dfu_dnload(APP_SECTION_SIZE / BLOCK_SIZE, block, sizeof(block)) == USBH_STALL);
+	DFU_StatusResponse st = dfu_getstatus();
+	CHECK(st.bStatus == DFU_STATUS_errADDRESS);
+	CHECK(st.bState == DFU_STATE_dfuERROR);
+	CHECK(model_stats.flash_writes == 0);
+
+	CHECK(usbh_control(0x21, DFU_CLRSTATUS, 0, DFU_INTERFACE, 0, NULL) == 0);
+	dfu_set_alternate(DFU_ALT_EEPROM);
+	CHECK(dfu_dnload(EEPROM_SIZE / BLOCK_SIZE, block, sizeof(block)) == USBH_STALL);
+	CHECK(dfu_getstatus().bStatus == DFU_STATUS_errADDRESS);
+	CHECK(model_stats.eeprom_writes == 0);
+}
+
+#ifdef SUBPAGE_DNLOAD
+// blocks smaller than a page are combined, and all but the last must be the size of block 0
+static void test_subpage(void)
+{
+	static uint8_t image[1300];
+	fill_random(image, sizeof(image), 9);
+
+	device_boot();
+	DFU_StatusResponse st = dfu_download(image, sizeof(image), 200);
+	CHECK(st.bStatus == DFU_STATUS_OK);
+	CHECK(memcmp(model_flash, image, sizeof(image)) == 0);
+	CHECK(model_flash[sizeof(image)] == 0xFF);
+	CHECK(model_stats.flash_writes == 3);
+
+	CHECK(usbh_control(0x21, DFU_ABORT, 0, DFU_INTERFACE, 0, NULL) == 0);
+	CHECK(dfu_dnload(0, image, 200) == 200);
+	CHECK(dfu_getstatus().bStatus == DFU_STATUS_OK);
+	CHECK(dfu_dnload(1, image, 300) == USBH_STALL);
+	st = dfu_getstatus();
+	CHECK(st.bStatus == DFU_STATUS_errADDRESS);
+	CHECK(st.bState == DFU_STATE_dfuERROR);
+}
+#endif
+
+#if defined(IMAGE_HEADER) && !defined(SECURE_IMAGES)
+static void test_header(void)
+{
+	static uint8_t image[1300];
+	static uint8_t stream[BLOCK_SIZE + sizeof(image)];
+	fill_random(image, sizeof(image), 10);
+
+	device_boot();
+	uint32_t len = header_image(stream, image, sizeof(image), crc32(image, sizeof(image)));
+	DFU_StatusResponse st = dfu_download(stream, len, BLOCK_SIZE);
+	CHECK(st.bStatus == DFU_STATUS_OK);
+	CHECK(st.bState == DFU_STATE_dfuMANIFEST_WAIT_RST);
+	CHECK(memcmp(model_flash, image, sizeof(image)) == 0);
+	CHECK(model_stats.flash_crcs == 1);
+}
+
+static void test_header_crc(void)
+{
+	static uint8_t image[1300];
+	static uint8_t stream[BLOCK_SIZE + sizeof(image)];
+	fill_random(image, sizeof(image), 11);
+
+	device_boot();
+	uint32_t len = header_image(stream, image, sizeof(image), crc32(image, sizeof(image)) ^ 1);
+	DFU_StatusResponse st = dfu_download(stream, len, BLOCK_SIZE);
+	CHECK(st.bStatus == DFU_STATUS_errVERIFY);
+	CHECK(st.bState == DFU_STATE_dfuERROR);
+	CHECK(!reset_flag);
+	CHECK(model_flash[0] == 0xFF);		// can't be started
+}
+
+// blocks past the length in the header are refused, and the next session forgets the header
+static void test_header_length(void)
+{
+	static uint8_t image[2 * BLOCK_SIZE];
+	static uint8_t stream[BLOCK_SIZE + sizeof(image)];
+	fill_random(image, sizeof(image), 12);
+
+	device_boot();
+	header_image(stream, image, BLOCK_SIZE, crc32(image, BLOCK_SIZE));
+	CHECK(dfu_dnload(0, stream, BLOCK_SIZE) == BLOCK_SIZE);
+	CHECK(dfu_getstatus().bStatus == DFU_STATUS_OK);
+	CHECK(dfu_dnload(1, image, BLOCK_SIZE) == BLOCK_SIZE);
+	CHECK(dfu_getstatus().bStatus == DFU_STATUS_OK);
+	CHECK(dfu_dnload(2, image + BLOCK_SIZE, BLOCK_SIZE) == USBH_STALL);
+	DFU_StatusResponse st = dfu_getstatus();
+	CHECK(st.bStatus == DFU_STATUS_errADDRESS);
+	CHECK(st.bState == DFU_STATE_dfuERROR);
+
+	CHECK(usbh_control(0x21, DFU_ABORT, 0, DFU_INTERFACE, 0, NULL) == 0);
+	st = dfu_download(image, sizeof(image), BLOCK_SIZE);
+	CHECK(st.bStatus == DFU_STATUS_OK);
+	CHECK(memcmp(model_flash, image, sizeof(image)) == 0);
+}
+
+#ifdef BOOT_VALIDATION
+// the boot record is cleared as soon as a new download starts, and rewritten once it verifies
+static void test_boot_record(void)
+{
+	static uint8_t image[1300];
+	static uint8_t stream[BLOCK_SIZE + sizeof(image)];
+	fill_random(image, sizeof(image), 13);
+
+	device_boot();
+	CHECK(!dfu_app_valid());
+	uint32_t len = header_image(stream, image, sizeof(image), crc32(image, sizeof(image)));
+	CHECK(dfu_download(stream, len, BLOCK_SIZE).bStatus == DFU_STATUS_OK);
+	CHECK(dfu_app_valid());
+
+	CHECK(usbh_control(0x21, DFU_ABORT, 0, DFU_INTERFACE, 0, NULL) == 0);
+	CHECK(dfu_dnload(0, stream, BLOCK_SIZE) == BLOCK_SIZE);
+	CHECK(dfu_getstatus().bStatus == DFU_STATUS_OK);
+	CHECK(!dfu_app_valid());
+	CHECK(model_eeprom[DFU_BOOT_RECORD_ADDR] == 0xFF);
+}
+#endif
+#endif
+
+#ifdef SECURE_IMAGES
+static void check_block(const uint8_t *block, const char *hex)
+{
+	for (uint8_t i = 0; i < AES_BLOCK_SIZE; i++)
+	{
+		unsigned b;
+		CHECK(sscanf(hex + (i * 2), "%2x", &b) == 1);
+		CHECK(block[i] == b);
+	}
+}
+
+static void hex_block(uint8_t *block, const char *hex)
+{
+	for (uint8_t i = 0; i < AES_BLOCK_SIZE; i++)
+	{
+		unsigned b;
+		CHECK(sscanf(hex + (i * 2), "%2x", &b) == 1);
+		block[i] = b;
+	}
+}
+
+// known answers of the AES driver, FIPS-197 appendix C.1 and SP 800-38A F.1.1
+static void test_aes_block(void)
+{
+	static uint8_t key[AES_BLOCK_SIZE];		// far address, must not be on the stack
+	uint8_t block[AES_BLOCK_SIZE];
+	model_reset();
+	hex_block(key, "000102030405060708090a0b0c0d0e0f");
+	hex_block(block, "00112233445566778899aabbccddeeff");
+	aes_encrypt(block, pgm_get_far_address(key));
+	check_block(block, "69c4e0d86a7b0430d8cdb78070b4c55a");
+
+	hex_block(key, "2b7e151628aed2a6abf7158809cf4f3c");
+	hex_block(block, "6bc1bee22e409f96e93d7e117393172a");
+	aes_encrypt(block, pgm_get_far_address(key));
+	check_block(block, "3ad77bb40d7a3660a89ecaf32466ef97");
+	CHECK(model_stats.aes_blocks == 2);
+}
+
+#ifdef AES_DECRYPT
+static const uint8_t image_key[AES_BLOCK_SIZE] = AES_KEY;
+
+// CTR as described in dfu.h, the block index is added to the last 4 bytes of the counter
+static void ctr_crypt(uint8_t *data, uint32_t len, const uint8_t *key, const uint8_t *iv)
+{
+	uint32_t start = ((uint32_t)iv[12] << 24) | ((uint32_t)iv[13] << 16) | ((uint32_t)iv[14] << 8) | iv[15];
+	for (uint32_t block = 0; block * AES_BLOCK_SIZE < len; block++)
+	{
+		uint8_t ks[AES_BLOCK_SIZE];
+		uint32_t ctr = start + block;
+		memcpy(ks, iv, 12);
+		ks[12] = ctr >> 24;
+		ks[13] = ctr >> 16;
+		ks[14] = ctr >> 8;
+		ks[15] = ctr;
+		aes_encrypt(ks, pgm_get_far_address(*key));
+		for (uint8_t i = 0; (i < AES_BLOCK_SIZE) && (block * AES_BLOCK_SIZE + i < len); i++)
+			data[block * AES_BLOCK_SIZE + i] ^= ks[i];
+	}
+}
+
+// the reference CTR against SP 800-38A F.5.1, whose counter only changes in the last 4 bytes
+static void test_aes_ctr(void)
+{
+	static const char *const plain[4] = {
+		"6bc1bee22e409f96e93d7e117393172a", "ae2d8a571e03ac9c9eb76fac45af8e51",
+		"30c81c46a35ce411e5fbc1191a0a52ef", "f69f2445df4f9b17ad2b417be66c3710" };
+	static const char *const cipher[4] = {
+		"874d6191b620e3261bef6864990db6ce", "9806f66b7970fdff8617187bb9fffdff",
+		"5ae4df3edbd5d35e5b4f09020db03eab", "1e031dda2fbe03d1792170a0f3009cee" };
+	static uint8_t key[AES_BLOCK_SIZE];
+	uint8_t iv[AES_BLOCK_SIZE], data[4 * AES_BLOCK_SIZE];
+	model_reset();
+	hex_block(key, "2b7e151628aed2a6abf7158809cf4f3c");
+	hex_block(iv, "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+	for (uint8_t i = 0; i < 4; i++)
+		hex_block(&data[i * AES_BLOCK_SIZE], plain[i]);
+	ctr_crypt(data, sizeof(data), key, iv);
+	for (uint8_t i = 0; i < 4; i++)
+		check_block(&data[i * AES_BLOCK_SIZE], cipher[i]);
+}
+#endif
+
+#ifdef IMAGE_AUTH
+static const uint8_t image_auth_key[AES_BLOCK_SIZE] = AUTH_KEY;
+
+// AES-CMAC (RFC 4493) of a message that is a non-zero multiple of 16 bytes
+static void cmac(uint8_t *tag, const uint8_t *data, uint32_t len, const uint8_t *key)
+{
+	uint8_t k1[AES_BLOCK_SIZE];
+	memset(k1, 0, sizeof(k1));
+	aes_encrypt(k1, pgm_get_far_address(*key));
+	uint8_t msb = k1[0] & 0x80;
+	for (uint8_t i = 0; i < AES_BLOCK_SIZE - 1; i++)
+		k1[i] = (k1[i] << 1) | (k1[i + 1] >> 7);
+	k1[AES_BLOCK_SIZE - 1] = (k1[AES_BLOCK_SIZE - 1] << 1) ^ (msb ? 0x87 : 0);
+
+	memset(tag, 0, AES_BLOCK_SIZE);
+	for (uint32_t offset = 0; offset < len; offset += AES_BLOCK_SIZE)
+	{
+		for (uint8_t i = 0; i < AES_BLOCK_SIZE; i++)
+			tag[i] ^= data[offset + i] ^ ((offset + AES_BLOCK_SIZE == len) ? k1[i] : 0);
+		aes_encrypt(tag, pgm_get_far_address(*key));
+	}
+}
+
+// the reference CMAC against RFC 4493 examples 2 and 4
+static void test_aes_cmac(void)
+{
+	static const char *const message[4] = {
+		"6bc1bee22e409f96e93d7e117393172a", "ae2d8a571e03ac9c9eb76fac45af8e51",
+		"30c81c46a35ce411e5fbc1191a0a52ef", "f69f2445df4f9b17ad2b417be66c3710" };
+	static uint8_t key[AES_BLOCK_SIZE];
+	uint8_t data[4 * AES_BLOCK_SIZE], tag[AES_BLOCK_SIZE];
+	model_reset();
+	hex_block(key, "2b7e151628aed2a6abf7158809cf4f3c");
+	for (uint8_t i = 0; i < 4; i++)
+		hex_block(&data[i * AES_BLOCK_SIZE], message[i]);
+	cmac(tag, data, AES_BLOCK_SIZE, key);
+	check_block(tag, "070a16b46b4d4144f79bdd9dd04a287c");
+	cmac(tag, data, sizeof(data), key);
+	check_block(tag, "51f0bebf7e3b9d92fc49741779363cfe");
+}
+#endif
+
+// header block followed by the image, its tag with IMAGE_AUTH, and encrypted with AES_DECRYPT
+static uint32_t secure_image(uint8_t *stream, const uint8_t *image, uint32_t len, uint32_t iv_seed)
+{
+	DFU_ImageHeader_t header = { .magic = DFU_IMAGE_MAGIC, .length = len, .crc = crc32(image, len) };
+	memset(stream, 0xFF, BLOCK_SIZE);
+	memcpy(stream, &header, sizeof(header));
+	uint8_t *body = stream + BLOCK_SIZE;
+	memcpy(body, image, len);
+#ifdef IMAGE_AUTH
+	cmac(body + len, image, len, image_auth_key);
+	len += AES_BLOCK_SIZE;
+#endif
+#ifdef AES_DECRYPT
+	DFU_EncryptedHeader_t *eh = (DFU_EncryptedHeader_t *)stream;
+	fill_random(eh->iv, sizeof(eh->iv), iv_seed);
+	ctr_crypt(body, len, image_key, eh->iv);
+#endif
+	return BLOCK_SIZE + len;
+}
+
+// 64k image decrypted and/or authenticated as it is programmed, timed on the model's clocks
+static void test_secure_download(void)
+{
+	static uint8_t image[65536];
+	static uint8_t stream[BLOCK_SIZE + sizeof(image) + AES_BLOCK_SIZE];
+	fill_random(image, sizeof(image), 21);
+
+	device_boot();
+	uint32_t len = secure_image(stream, image, sizeof(image), 22);
+	uint64_t start = (model_cpu_ps > model_bus_ps) ? model_cpu_ps : model_bus_ps;
+	uint32_t aes_start = model_stats.aes_blocks;		// the host side encrypts on the same driver
+	DFU_StatusResponse st = dfu_download(stream, len, BLOCK_SIZE);
+	uint64_t end = (model_cpu_ps > model_bus_ps) ? model_cpu_ps : model_bus_ps;
+	uint32_t aes_blocks = model_stats.aes_blocks - aes_start;
+	CHECK(st.bStatus == DFU_STATUS_OK);
+	CHECK(st.bState == DFU_STATE_dfuMANIFEST_WAIT_RST);
+	CHECK(memcmp(model_flash, image, sizeof(image)) == 0);
+#ifdef BOOT_VALIDATION
+	CHECK(dfu_app_valid());
+#endif
+
+	double seconds = (end - start) / 1e12;
+	printf("    64k download: %.1f ms model time, %.1f kB/s, %u AES blocks\n", seconds * 1e3,
+		   sizeof(image) / 1024.0 / seconds, (unsigned)aes_blocks);
+}
+
+// a plaintext image, or one with a changed byte, doesn't verify and can't be started
+static void test_secure_tamper(void)
+{
+	static uint8_t image[1312];
+	static uint8_t stream[BLOCK_SIZE + sizeof(image) + AES_BLOCK_SIZE];
+	fill_random(image, sizeof(image), 23);
+
+	device_boot();
+	DFU_StatusResponse st;
+	CHECK(dfu_dnload(0, image, BLOCK_SIZE) == BLOCK_SIZE);
+	st = dfu_getstatus();
+	CHECK(st.bStatus == DFU_STATUS_errFILE);
+	CHECK(st.bState == DFU_STATE_dfuERROR);
+	CHECK(model_stats.flash_writes == 0);
+
+	CHECK(usbh_control(0x21, DFU_ABORT, 0, DFU_INTERFACE, 0, NULL) == 0);
+	uint32_t len = secure_image(stream, image, sizeof(image), 24);
+	stream[BLOCK_SIZE + 700] ^= 0x01;
+	st = dfu_download(stream, len, BLOCK_SIZE);
+	CHECK(st.bStatus == DFU_STATUS_errVERIFY);
+	CHECK(st.bState == DFU_STATE_dfuERROR);
+	CHECK(!reset_flag);
+	CHECK(model_flash[0] == 0xFF);
+}
+#endif
+
+#ifdef RESUME_SUPPORT
+static void dnload_blocks(const uint8_t *image, uint16_t first, uint16_t last)
+{
+	for (uint16_t i = first; i <= last; i++)
+	{
+		CHECK(dfu_dnload(i, image + (uint32_t)i * BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+		CHECK(dfu_getstatus().bStatus == DFU_STATUS_OK);
+	}
+}
+
+static uint16_t resume_next_page(void)
+{
+	DFU_ResumeInfo_t ri;
+	CHECK(usbh_control(0xC1, DFU_VREQ_RESUME_INFO, 0, DFU_INTERFACE, sizeof(ri), &ri) == sizeof(ri));
+	return ri.wNextPage;
+}
+
+// an interrupted download continues from the journal after DFU_VREQ_RESUME, and a download
+// without it starts the journal again at block 0
+static void test_resume(void)
+{
+	static uint8_t image[40 * BLOCK_SIZE];
+	fill_random(image, sizeof(image), 14);
+
+	device_boot();
+	dnload_blocks(image, 0, 35);
+	CHECK(resume_next_page() == 32);
+
+	CHECK(usbh_control(0x21, DFU_ABORT, 0, DFU_INTERFACE, 0, NULL) == 0);
+	dnload_blocks(image, 0, 20);
+	CHECK(resume_next_page() == 16);
+	dnload_blocks(image, 21, 35);
+	CHECK(resume_next_page() == 32);
+
+	CHECK(usbh_control(0x21, DFU_ABORT, 0, DFU_INTERFACE, 0, NULL) == 0);
+	CHECK(usbh_control(0x41, DFU_VREQ_RESUME, 0, DFU_INTERFACE, 0, NULL) == 0);
+	dnload_blocks(image, 0, 0);
+	dnload_blocks(image, 32, 39);
+	CHECK(resume_next_page() == 32);		// saved every DFU_JOURNAL_INTERVAL pages
+	CHECK(dfu_dnload(40, NULL, 0) == 0);
+	DFU_StatusResponse st = dfu_getstatus();
+	CHECK(st.bStatus == DFU_STATUS_OK);
+	CHECK(memcmp(model_flash, image, sizeof(image)) == 0);
+}
+#endif
+
+#ifdef BURST_DNLOAD
+static DFU_BurstStatus_t burst_status(void)
+{
+	DFU_BurstStatus_t bs;
+	CHECK(usbh_control(0xC1, DFU_VREQ_BURST_STATUS, 0, DFU_INTERFACE, sizeof(bs), &bs) == sizeof(bs));
+	return bs;
+}
+
+// blocks without GETSTATUS in between, read back straight after the last one
+static void test_burst(void)
+{
+	static uint8_t image[8 * BLOCK_SIZE];
+	fill_random(image, sizeof(image), 15);
+
+	device_boot();
+	CHECK(usbh_control(0x41, DFU_VREQ_BURST, 8, DFU_INTERFACE, 0, NULL) == 0);
+	for (uint16_t i = 0; i < 8; i++)
+		CHECK(dfu_dnload(i, image + i * BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+
+	// without VERIFY_WRITES the last page is still being written when the upload starts
+	uint8_t block[BLOCK_SIZE];
+	for (uint16_t i = 0; i < 8; i++)
+	{
+		CHECK(dfu_upload(i, block, sizeof(block)) == sizeof(block));
+		if (i != 0)		// held back by DELAYED_ZERO_PAGE
+			CHECK(memcmp(block, image + i * BLOCK_SIZE, sizeof(block)) == 0);
+	}
+	CHECK(model_stats.violations == 0);
+
+	DFU_BurstStatus_t bs = burst_status();
+	CHECK(bs.bStatus == DFU_STATUS_OK);
+	CHECK(bs.wBlocksDone == 8);
+	CHECK(bs.wFirstFailed == 0xFFFF);
+
+	CHECK(memcmp(model_flash + BLOCK_SIZE, image + BLOCK_SIZE, sizeof(image) - BLOCK_SIZE) == 0);
+}
+
+#ifdef VERIFY_WRITES
+// a failed block is recorded and the rest of the burst is still written
+static void test_burst_failure(void)
+{
+	static uint8_t image[8 * BLOCK_SIZE];
+	fill_random(image, sizeof(image), 16);
+
+	device_boot();
+	fill_random(&model_flash[3 * BLOCK_SIZE], BLOCK_SIZE, 17);
+	model_flash_worn_page = 3 * BLOCK_SIZE;
+	CHECK(usbh_control(0x41, DFU_VREQ_BURST, 8, DFU_INTERFACE, 0, NULL) == 0);
+	for (uint16_t i = 0; i < 8; i++)
+		CHECK(dfu_dnload(i, image + i * BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+
+	DFU_BurstStatus_t bs = burst_status();
+	CHECK(bs.bStatus == DFU_STATUS_errWRITE);
+	CHECK(bs.bState == DFU_STATE_dfuERROR);
+	CHECK(bs.wBlocksDone == 8);
+	CHECK(bs.wFirstFailed == 3);
+	CHECK(bs.bFirstFailedStatus == DFU_STATUS_errWRITE);
+	CHECK(bs.bmFailed[0] == (1 << 3));
+	CHECK(memcmp(model_flash + 4 * BLOCK_SIZE, image + 4 * BLOCK_SIZE, 4 * BLOCK_SIZE) == 0);
+	DFU_StatusResponse st = dfu_getstatus();
+	CHECK(st.bStatus == DFU_STATUS_errWRITE);
+	CHECK(st.bState == DFU_STATE_dfuERROR);
+}
+#endif
+#endif
+
+#ifdef CONTAINER_ALT
+static uint32_t container_segment(uint8_t *stream, uint8_t memory, uint32_t offset, const uint8_t *data, uint32_t len)
+{
+	DFU_SegmentHeader_t segment = { .magic = DFU_SEGMENT_MAGIC, .memory = memory, .offset = offset, .length = len };
+	memcpy(stream, &segment, sizeof(segment));
+	memcpy(stream + sizeof(segment), data, len);
+	return sizeof(segment) + len;
+}
+
+// flash and EEPROM segments in one stream of several blocks, headers not aligned to blocks
+static void test_container(void)
+{
+	static uint8_t flash[1300];
+	static uint8_t eeprom[600];
+	static uint8_t stream[sizeof(flash) + sizeof(eeprom) + 2 * sizeof(DFU_SegmentHeader_t)];
+	fill_random(flash, sizeof(flash), 6);
+	fill_random(eeprom, sizeof(eeprom), 7);
+	uint32_t len = container_segment(stream, DFU_ALT_FLASH, 0, flash, sizeof(flash));
+	len += container_segment(stream + len, DFU_ALT_EEPROM, BLOCK_SIZE, eeprom, sizeof(eeprom));
+
+	device_boot();
+	dfu_set_alternate(DFU_ALT_CONTAINER);
+	DFU_StatusResponse st = dfu_download(stream, len, BLOCK_SIZE);
+	CHECK(st.bStatus == DFU_STATUS_OK);
+	CHECK(memcmp(model_flash, flash, sizeof(flash)) == 0);
+	CHECK(model_flash[sizeof(flash)] == 0xFF);
+	CHECK(memcmp(&model_eeprom[BLOCK_SIZE], eeprom, sizeof(eeprom)) == 0);
+	CHECK(model_eeprom[0] == 0xFF);
+
+	// a second session starts with a fresh segment header
+	CHECK(usbh_control(0x21, DFU_ABORT, 0, DFU_INTERFACE, 0, NULL) == 0);
+	fill_random(flash, sizeof(flash), 8);
+	len = container_segment(stream, DFU_ALT_FLASH, 0, flash, sizeof(flash));
+	st = dfu_download(stream, len, BLOCK_SIZE);
+	CHECK(st.bStatus == DFU_STATUS_OK);
+	CHECK(memcmp(model_flash, flash, sizeof(flash)) == 0);
+}
+
+// a stream that ends inside a segment is not manifested, and the held back page 0 is not written
+static void test_container_truncated(void)
+{
+	static uint8_t flash[1300];
+	static uint8_t stream[sizeof(flash) + sizeof(DFU_SegmentHeader_t)];
+	static uint8_t erased[APP_SECTION_PAGE_SIZE];
+	fill_random(flash, sizeof(flash), 15);
+	memset(erased, 0xFF, sizeof(erased));
+	uint32_t len = container_segment(stream, DFU_ALT_FLASH, 0, flash, sizeof(flash));
+
+	device_boot();
+	memset(model_flash, 0x5A, APP_SECTION_PAGE_SIZE);	// previous application
+	dfu_set_alternate(DFU_ALT_CONTAINER);
+	DFU_StatusResponse st = dfu_download(stream, len - 200, BLOCK_SIZE);
+	CHECK(st.bStatus == DFU_STATUS_errNOTDONE);
+	CHECK(st.bState == DFU_STATE_dfuERROR);
+	CHECK(memcmp(model_flash, erased, sizeof(erased)) == 0);
+}
+#endif
+
+#ifndef SECURE_IMAGES
+// download time of a 64k image, measured on the model's clocks
+static void test_throughput(void)
+{
+	static uint8_t image[65536];
+	fill_random(image, sizeof(image), 5);
+
+	device_boot();
+	uint64_t start = (model_cpu_ps > model_bus_ps) ? model_cpu_ps : model_bus_ps;
+	DFU_StatusResponse st = dfu_download(image, sizeof(image), BLOCK_SIZE);
+	CHECK(st.bStatus == DFU_STATUS_OK);
+	CHECK(memcmp(model_flash, image, sizeof(image)) == 0);
+	uint64_t end = (model_cpu_ps > model_bus_ps) ? model_cpu_ps : model_bus_ps;
+
+	double seconds = (end - start) / 1e12;
+	printf("    64k download: %.1f ms model time, %.1f kB/s\n", seconds * 1e3, sizeof(image) / 1024.0 / seconds);
+}
+#endif
+#endif
+
+#ifdef EXT_FLASH_UPDATE
+static char ext_file[] = "/tmp/test_dfu_spi_XXXXXX";
+
+static void ext_remove(void)
+{
+	unlink(ext_file);
+}
+
+// stage an image in the SPI flash file as the application would, header padded to one page
+static void ext_stage(const uint8_t *image, uint32_t len, uint32_t crc)
+{
+	int fd = mkstemp(ext_file);
+	CHECK(fd >= 0);
+	atexit(ext_remove);
+	FILE *f = fdopen(fd, "wb");
+	CHECK(f != NULL);
+	DFU_ImageHeader_t header = { .magic = DFU_IMAGE_MAGIC, .length = len, .crc = crc };
+	uint8_t page[APP_SECTION_PAGE_SIZE];
+	memset(page, 0xFF, sizeof(page));
+	memcpy(page, &header, sizeof(header));
+	CHECK(fwrite(page, sizeof(page), 1, f) == 1);
+	CHECK((len == 0) || (fwrite(image, len, 1, f) == 1));
+	CHECK(fclose(f) == 0);
+	model_spi_flash_file = ext_file;
+}
+
+static uint32_t ext_magic(void)
+{
+	uint32_t magic;
+	FILE *f = fopen(ext_file, "rb");
+	CHECK(f != NULL);
+	CHECK(fread(&magic, sizeof(magic), 1, f) == 1);
+	fclose(f);
+	return magic;
+}
+
+// a staged image is installed once, and its header cleared
+static void test_ext_install(void)
+{
+	static uint8_t image[65536];
+	fill_random(image, sizeof(image), 19);
+
+	model_reset();
+	ext_stage(image, sizeof(image), crc32(image, sizeof(image)));
+	uint64_t start = model_cpu_ps;
+	dfu_ext_install();
+	SP_WaitForSPM();
+	double seconds = (model_cpu_ps - start) / 1e12;
+	printf("    64k install: %.1f ms model time\n", seconds * 1e3);
+	CHECK(memcmp(model_flash, image, sizeof(image)) == 0);
+	CHECK(ext_magic() == 0);
+	CHECK(dfu_app_valid());
+
+	uint32_t erases = model_stats.flash_erases;
+	dfu_ext_install();
+	CHECK(model_stats.flash_erases == erases);
+}
+
+// an image that fails its CRC can't be started and isn't tried again
+static void test_ext_crc(void)
+{
+	static uint8_t image[1300];
+	fill_random(image, sizeof(image), 20);
+
+	model_reset();
+	ext_stage(image, sizeof(image), crc32(image, sizeof(image)) ^ 1);
+	dfu_ext_install();
+	SP_WaitForSPM();
+	CHECK(model_flash[0] == 0xFF);
+	CHECK(ext_magic() == 0);
+	CHECK(!dfu_app_valid());
+}
+
+// nothing staged, or no chip fitted
+static void test_ext_blank(void)
+{
+	model_reset();
+	dfu_ext_install();
+	ext_stage(NULL, 0, 0);
+	dfu_ext_install();
+	CHECK(model_stats.flash_erases == 0);
+	CHECK(ext_magic() == DFU_IMAGE_MAGIC);
+}
+#endif
+
+#ifdef USB_HID
+// reports sent while the last response has not been collected are held back, not lost
+static void test_hid_flow(void)
+{
+	device_boot();
+	uint8_t alt = DFU_ALT_FLASH;
+	CHECK(hid_out(HID_DFU_CMD_START, 1, &alt, 1) == sizeof(HID_DFU_Report_t));
+	CHECK(hid_out(HID_DFU_CMD_GETSTATUS, 2, NULL, 0) == sizeof(HID_DFU_Report_t));
+	CHECK(hid_out(HID_DFU_CMD_GETSTATUS, 3, NULL, 0) == USBH_NAK);
+
+	HID_DFU_Response_t res;
+	CHECK(hid_in(&res));
+	CHECK((res.bCommand == HID_DFU_CMD_START) && (res.bSequence == 1));
+	CHECK(hid_in(&res));
+	CHECK((res.bCommand == HID_DFU_CMD_GETSTATUS) && (res.bSequence == 2));
+	CHECK(!hid_in(&res));
+
+	CHECK(hid_out(HID_DFU_CMD_GETSTATUS, 3, NULL, 0) == sizeof(HID_DFU_Report_t));
+	CHECK(hid_in(&res));
+	CHECK((res.bSequence == 3) && (res.bStatus == DFU_STATUS_OK) && (res.bState == DFU_STATE_dfuIDLE));
+}
+
+// flash download with the data streamed without waiting for the page acknowledgements, returns
+// the response to HID_DFU_CMD_MANIFEST
+static HID_DFU_Response_t hid_download(const uint8_t *image, uint32_t len)
+{
+	uint8_t sequence = 1;
+	uint8_t alt = DFU_ALT_FLASH;
+	HID_DFU_Response_t res = hid_command(HID_DFU_CMD_START, sequence, &alt, 1);
+	CHECK(res.bStatus == DFU_STATUS_OK);
+	for (uint32_t offset = 0; offset < len; offset += HID_DFU_PAYLOAD_SIZE)
+	{
+		uint8_t n = (len - offset < HID_DFU_PAYLOAD_SIZE) ? len - offset : HID_DFU_PAYLOAD_SIZE;
+		int r;
+		sequence++;
+		while ((r = hid_out(HID_DFU_CMD_DATA, sequence, image + offset, n)) == USBH_NAK)
+		{
+			CHECK(hid_in(&res));
+			CHECK(res.bStatus == DFU_STATUS_OK);
+		}
+		CHECK(r == sizeof(HID_DFU_Report_t));
+	}
+	return hid_command(HID_DFU_CMD_MANIFEST, ++sequence, NULL, 0);
+}
+
+static void test_hid_download(void)
+{
+	static uint8_t image[4 * BLOCK_SIZE + 100];
+	fill_random(image, sizeof(image), 18);
+
+	device_boot();
+	HID_DFU_Response_t res = hid_download(image, sizeof(image));
+	CHECK(res.bStatus == DFU_STATUS_OK);
+	CHECK(res.bState == DFU_STATE_dfuMANIFEST_WAIT_RST);
+	CHECK(reset_flag);
+	CHECK(memcmp(model_flash, image, sizeof(image)) == 0);
+}
+
+#ifdef BOOT_VALIDATION
+// a header in the first page is checked at manifestation, and starting a new flash download
+// clears the boot record
+static void test_hid_boot_record(void)
+{
+	static uint8_t image[1300];
+	static uint8_t stream[BLOCK_SIZE + sizeof(image)];
+	fill_random(image, sizeof(image), 19);
+	uint32_t crc = crc32(image, sizeof(image));
+
+	device_boot();
+	uint32_t len = header_image(stream, image, sizeof(image), crc ^ 1);
+	HID_DFU_Response_t res = hid_download(stream, len);
+	CHECK(res.bStatus == DFU_STATUS_errVERIFY);
+	CHECK(!dfu_app_valid());
+
+	CHECK(hid_command(HID_DFU_CMD_ABORT, res.bSequence + 1, NULL, 0).bStatus == DFU_STATUS_OK);
+	len = header_image(stream, image, sizeof(image), crc);
+	res = hid_download(stream, len);
+	CHECK(res.bStatus == DFU_STATUS_OK);
+	CHECK(memcmp(model_flash, image, sizeof(image)) == 0);
+	CHECK(model_flash[sizeof(image)] == 0xFF);
+	CHECK(dfu_app_valid());
+
+	uint8_t alt = DFU_ALT_FLASH;
+	CHECK(hid_command(HID_DFU_CMD_START, 1, &alt, 1).bStatus == DFU_STATUS_OK);
+	CHECK(!dfu_app_valid());
+	CHECK(model_eeprom[DFU_BOOT_RECORD_ADDR] == 0xFF);
+}
+#endif
+#endif
+
+
+/**************************************************************************************************
+* Run each test in a child process
+*/
+typedef struct {
+	const char	*name;
+	void		(*fn)(void);
+} test_t;
+
+static const test_t tests[] = {
+	{ "enumerate",		test_enumerate },
+#ifdef USB_DFU_MODE
+#ifndef SECURE_IMAGES
+	{ "download",		test_download },
+	{ "redownload",		test_redownload },
+#endif
+#ifdef UPLOAD_SUPPORT
+	{ "upload",			test_upload },
+#endif
+	{ "eeprom",			test_eeprom },
+	{ "range",			test_range },
+#ifdef SUBPAGE_DNLOAD
+	{ "subpage",		test_subpage },
+#endif
+#if defined(IMAGE_HEADER) && !defined(SECURE_IMAGES)
+	{ "header",			test_header },
+	{ "header_crc",		test_header_crc },
+	{ "header_length",	test_header_length },
+#ifdef BOOT_VALIDATION
+	{ "boot_record",	test_boot_record },
+#endif
+#endif
+#ifdef SECURE_IMAGES
+	{ "aes_block",		test_aes_block },
+#ifdef AES_DECRYPT
+	{ "aes_ctr",		test_aes_ctr },
+#endif
+#ifdef IMAGE_AUTH
+	{ "aes_cmac",		test_aes_cmac },
+#endif
+	{ "secure_download",	test_secure_download },
+	{ "secure_tamper",	test_secure_tamper },
+#endif
+#ifdef RESUME_SUPPORT
+	{ "resume",			test_resume },
+#endif
+#ifdef BURST_DNLOAD
+	{ "burst",			test_burst },
+#ifdef VERIFY_WRITES
+	{ "burst_failure",	test_burst_failure },
+#endif
+#endif
+#ifdef CONTAINER_ALT
+	{ "container",		test_container },
+	{ "container_truncated",	test_container_truncated },
+#endif
+#ifndef SECURE_IMAGES
+	{ "throughput",		test_throughput },
+#endif
+#endif
+#ifdef EXT_FLASH_UPDATE
+	{ "ext_install",	test_ext_install },
+	{ "ext_crc",		test_ext_crc },
+	{ "ext_blank",		test_ext_blank },
+#endif
+#ifdef USB_HID
+	{ "hid_flow",		test_hid_flow },
+	{ "hid_download",	test_hid_download },
+#ifdef BOOT_VALIDATION
+	{ "hid_boot_record",	test_hid_boot_record },
+#endif
+#endif
+};
+
+int main(void)
+{
+	int failed = 0;
+	for (unsigned i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+	{
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			alarm(10);		// a firmware loop waiting for the host never returns
+			tests[i].fn();
+			CHECK(model_stats.violations == 0);
+			fflush(stdout);
+			_exit(0);
+		}
+		int wstatus;
+		bool ok = (pid > 0) && (waitpid(pid, &wstatus, 0) == pid) &&
+				  WIFEXITED(wstatus) && (WEXITSTATUS(wstatus) == 0);
+		printf("%-20s %s\n", tests[i].name, ok ? "ok" : "FAIL");
+		if (!ok)
+			failed++;
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,317 @@
+/*
+ * usb_model.c
+ *
+ * The USB controller side of the endpoint table and a host that sends transactions to it. The
+ * controller works on the table that USB.EPPTR points at, as on the device, and calls the
+ * interrupt handlers when a transaction completes.
+ *
+ * Each transaction starts when the bus is free and the endpoint has been armed, i.e. when the
+ * firmware cleared BUSNACK0. That stands in for the host retrying NAKed transactions, without
+ * the retry interval. Frame scheduling and host software latency are not modelled. A
+ * transaction costs 8 bits per data byte plus 105 bits for the token, CRC, handshake and gaps,
+ * without bit stuffing.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <avr/interrupt.h>
+#include "model.h"
+
+#define EP0_PACKET_SIZE		64
+#define MAX_ENDPOINTS		16
+
+static uint8_t device_address = 0;
+static uint64_t arm_ps[MAX_ENDPOINTS * 2];	// when each endpoint last had BUSNACK0 cleared
+
+USB_t USB;
+
+
+/**************************************************************************************************
+* XMEGA read-modify-write instructions on the endpoint STATUS registers
+*/
+static void usb_armed(unsigned char *addr)
+{
+	uintptr_t table = USB.EPPTR;
+	uintptr_t offset = (uintptr_t)addr - table;
+	if (((uintptr_t)addr >= table) && (offset < sizeof(arm_ps) / sizeof(arm_ps[0]) * sizeof(USB_EP_t)))
+		arm_ps[offset / sizeof(USB_EP_t)] = model_cpu_ps;
+}
+
+unsigned char __lac(unsigned char msk, unsigned char *addr)
+{
+	unsigned char old = *addr;
+	*addr = old & ~msk;
+	if ((old & msk) & USB_EP_BUSNACK0_bm)
+		usb_armed(addr);
+	return old;
+}
+
+unsigned char __las(unsigned char msk, unsigned char *addr)
+{
+	unsigned char old = *addr;
+	*addr = old | msk;
+	return old;
+}
+
+unsigned char __xch(unsigned char msk, unsigned char *addr)
+{
+	unsigned char old = *addr;
+	*addr = msk;
+	if ((old & USB_EP_BUSNACK0_bm) && !(msk & USB_EP_BUSNACK0_bm))
+		usb_armed(addr);
+	return old;
+}
+
+unsigned char __lat(unsigned char msk, unsigned char *addr)
+{
+	unsigned char old = *addr;
+	*addr = old ^ msk;
+	if ((old & msk) & USB_EP_BUSNACK0_bm)
+		usb_armed(addr);
+	return old;
+}
+
+
+/**************************************************************************************************
+* Controller
+*/
+static USB_EP_t *usb_ep(uint8_t ep)
+{
+	USB_EP_t *table = (USB_EP_t *)(uintptr_t)USB.EPPTR;
+	return &table[((ep & 0x0F) * 2) + !!(ep & 0x80)];
+}
+
+static uint8_t *usb_ep_data(USB_EP_t *e)
+{
+	return (uint8_t *)(uintptr_t)e->DATAPTR;
+}
+
+static bool usb_online(uint8_t ep)
+{
+	return (USB.CTRLA & USB_ENABLE_bm) && (USB.CTRLB & USB_ATTACH_bm) &&
+		   ((ep & 0x0F) <= (USB.CTRLA & USB_MAXEP_gm)) && (USB.EPPTR != 0);
+}
+
+// start a transaction of len data bytes, returns false if the device does not answer
+static bool usb_transaction(uint8_t ep, uint16_t len)
+{
+	if (!usb_online(ep))
+		return false;
+	uint64_t start = model_bus_ps;
+	uint8_t index = ((ep & 0x0F) * 2) + !!(ep & 0x80);
+	if (arm_ps[index] > start)
+		start = arm_ps[index];
+	model_bus_ps = start + ((8ULL * len) + 105) * MODEL_BUS_BIT_PS;
+	return true;
+}
+
+// a NAKed or stalled attempt only costs the token and handshake
+static void usb_refused(void)
+{
+	model_bus_ps += 105 * MODEL_BUS_BIT_PS;
+}
+
+static void usb_interrupt(USB_EP_t *e, uint8_t flag)
+{
+	if ((e->CTRL & USB_EP_INTDSBL_bm) || !(USB.INTCTRLB & flag))
+		return;
+	USB.INTFLAGSBSET |= flag;
+	USB.INTFLAGSBCLR |= flag;
+	if (model_cpu_ps < model_bus_ps)
+		model_cpu_ps = model_bus_ps;
+	USB_TRNCOMPL_vect();
+	model_sync();
+	USB.INTFLAGSBSET = 0;
+	USB.INTFLAGSBCLR = 0;
+}
+
+/**************************************************************************************************
+* Bus reset. The device answers on address 0 afterwards.
+*/
+void usbh_reset(void)
+{
+	device_address = 0;
+	model_bus_ps += 10000000000ULL;		// 10ms
+	if (model_cpu_ps < model_bus_ps)
+		model_cpu_ps = model_bus_ps;
+	USB.INTFLAGSASET |= USB_RSTIF_bm;
+	USB.INTFLAGSACLR |= USB_RSTIF_bm;
+	if (USB.INTCTRLA & USB_BUSEVIE_bm)
+	{
+		USB_BUSEVENT_vect();
+		model_sync();
+	}
+	USB.INTFLAGSASET = 0;
+	USB.INTFLAGSACLR = 0;
+}
+
+/**************************************************************************************************
+* SETUP transaction on endpoint 0. Always accepted, clears a stall on both directions and
+* cancels a pending IN response.
+*/
+int usbh_setup(const void *setup)
+{
+	if ((device_address != (USB.ADDR & 0x7F)) || !usb_transaction(0x00, 8))
+		return USBH_TIMEOUT;
+
+	USB_EP_t *out = usb_ep(0x00);
+	USB_EP_t *in = usb_ep(0x80);
+	memcpy(usb_ep_data(out), setup, 8);
+	out->CNT = 8;
+	out->STATUS |= USB_EP_SETUP_bm | USB_EP_TRNCOMPL0_bm | USB_EP_BUSNACK0_bm;
+	out->CTRL &= ~USB_EP_STALL_bm;
+	in->CTRL &= ~USB_EP_STALL_bm;
+	in->STATUS |= USB_EP_BUSNACK0_bm;
+	usb_interrupt(out, USB_SETUPIE_bm);
+	return 8;
+}
+
+/**************************************************************************************************
+* OUT transaction. Returns the number of bytes accepted, USBH_NAK or USBH_STALL.
+*/
+int usbh_out(uint8_t ep, const void *data, uint16_t len)
+{
+	if (device_address != (USB.ADDR & 0x7F))
+		return USBH_TIMEOUT;
+	USB_EP_t *e = usb_ep(ep & 0x0F);
+	if (e->CTRL & USB_EP_STALL_bm)
+	{
+		usb_refused();
+		e->STATUS |= USB_EP_STALLF_bm;
+		return USBH_STALL;
+	}
+	if (e->STATUS & USB_EP_BUSNACK0_bm)
+	{
+		usb_refused();
+		return USBH_NAK;
+	}
+	if (!usb_transaction(ep & 0x0F, len))
+		return USBH_TIMEOUT;
+
+	uint16_t size = 8 << (e->CTRL & USB_EP_BUFSIZE_gm);
+	if (len > size)
+	{
+		model_violation("OUT packet larger than the endpoint buffer");
+		len = size;
+	}
+	memcpy(usb_ep_data(e), data, len);
+	e->CNT = len;
+	e->STATUS |= USB_EP_TRNCOMPL0_bm | USB_EP_BUSNACK0_bm;
+	e->STATUS ^= USB_EP_TOGGLE_bm;
+	usb_interrupt(e, USB_TRNIE_bm);
+	return len;
+}
+
+/**************************************************************************************************
+* IN transaction. Returns the number of bytes received, USBH_NAK or USBH_STALL. Endpoints in
+* multi-packet mode send up to one packet of the transfer per transaction.
+*/
+int usbh_in(uint8_t ep, void *data, uint16_t len)
+{
+	if (device_address != (USB.ADDR & 0x7F))
+		return USBH_TIMEOUT;
+	USB_EP_t *e = usb_ep(ep | 0x80);
+	if (e->CTRL & USB_EP_STALL_bm)
+	{
+		usb_refused();
+		e->STATUS |= USB_EP_STALLF_bm;
+		return USBH_STALL;
+	}
+	if (e->STATUS & USB_EP_BUSNACK0_bm)
+	{
+		usb_refused();
+		return USBH_NAK;
+	}
+
+	uint16_t size = 8 << (e->CTRL & USB_EP_BUFSIZE_gm);
+	uint16_t n;
+	bool done = true;
+	if (e->CTRL & USB_EP_MULTIPKT_bm)
+	{
+		uint16_t total = e->CNT & 0x3FF;
+		bool azlp = e->CNT & 0x8000;
+		n = total - e->AUXDATA;
+		if (n > size)
+			n = size;
+		if (!usb_transaction(ep | 0x80, n))
+			return USBH_TIMEOUT;
+		memcpy(data, usb_ep_data(e) + e->AUXDATA, (n < len) ? n : len);
+		e->AUXDATA += n;
+		// a full last packet is followed by a zero length packet if AZLP is set
+		done = (n < size) || ((e->AUXDATA >= total) && !azlp);
+	}
+	else
+	{
+		n = e->CNT & 0x3FF;
+		if (!usb_transaction(ep | 0x80, n))
+			return USBH_TIMEOUT;
+		memcpy(data, usb_ep_data(e), (n < len) ? n : len);
+	}
+
+	if (done)
+	{
+		e->STATUS |= USB_EP_TRNCOMPL0_bm | USB_EP_BUSNACK0_bm;
+		usb_interrupt(e, USB_TRNIE_bm);
+	}
+	return n;
+}
+
+/**************************************************************************************************
+* Control transfer on endpoint 0. Returns the length of the data stage, or USBH_STALL, USBH_NAK
+* or USBH_TIMEOUT if the device refused a stage.
+*/
+int usbh_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+				 uint16_t wLength, void *data)
+{
+	uint8_t setup[8] = {
+		bmRequestType, bRequest, wValue & 0xFF, wValue >> 8,
+		wIndex & 0xFF, wIndex >> 8, wLength & 0xFF, wLength >> 8
+	};
+	int r = usbh_setup(setup);
+	if (r < 0)
+		return r;
+
+	uint8_t *p = data;
+	uint16_t done = 0;
+	if (bmRequestType & 0x80)
+	{
+		while (done < wLength)
+		{
+			uint8_t packet[EP0_PACKET_SIZE];
+			r = usbh_in(0x80, packet, sizeof(packet));
+			if (r < 0)
+				return r;
+			uint16_t n = r;
+			if (n > wLength - done)
+				n = wLength - done;
+			memcpy(p + done, packet, n);
+			done += n;
+			if (r < EP0_PACKET_SIZE)
+				break;
+		}
+		uint8_t zlp[1];
+		r = usbh_out(0x00, zlp, 0);			// status
+	}
+	else
+	{
+		while (done < wLength)
+		{
+			uint16_t n = wLength - done;
+			if (n > EP0_PACKET_SIZE)
+				n = EP0_PACKET_SIZE;
+			r = usbh_out(0x00, p + done, n);
+			if (r < 0)
+				return r;
+			done += n;
+		}
+		uint8_t zlp[EP0_PACKET_SIZE];
+		r = usbh_in(0x80, zlp, sizeof(zlp));	// status
+	}
+	if (r < 0)
+		return r;
+
+	// SET_ADDRESS takes effect after the status stage
+	if ((bmRequestType == 0x00) && (bRequest == 5))
+		device_address = wValue & 0x7F;
+	return done;
+}
@@ -0,0 +1,74 @@
+/*
+ * xmega.c
+ *
+ * Host build of the usb/xmega.S routines, against the NVM model.
+ */
+
+#include <avr/io.h>
+#include "xmega.h"
+#include "model.h"
+
+void CCPWrite(volatile uint8_t *address, uint8_t value)
+{
+	CCP = CCP_IOREG_gc;
+	*address = value;
+}
+
+static uint8_t common_lpm(uint8_t cmd, uint16_t index)
+{
+	NVM.CMD = cmd;
+	uint8_t value = model_lpm(index);
+	NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+	return value;
+}
+
+uint8_t NVM_read_production_signature_byte(uint8_t index)
+{
+	return common_lpm(NVM_CMD_READ_CALIB_ROW_gc, index);
+}
+
+uint8_t NVM_read_user_signature_byte(uint16_t index)
+{
+	return common_lpm(NVM_CMD_READ_USER_SIG_ROW_gc, index);
+}
+
+static uint32_t execute_nvm_command(uint8_t cmd)
+{
+	NVM.CMD = cmd;
+	CCP = CCP_IOREG_gc;
+	NVM.CTRLA = NVM_CMDEX_bm;
+	uint32_t data = NVM.DATA0 & 0xFF;
+	data |= (uint32_t)NVM.DATA1 << 8;
+	data |= (uint32_t)NVM.DATA2 << 16;
+	NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+	return data;
+}
+
+uint8_t NVM_read_fuse_byte(uint8_t index)
+{
+	NVM.ADDR0 = index;
+	NVM.ADDR1 = 0;
+	NVM.ADDR2 = 0;
+	return execute_nvm_command(NVM_CMD_READ_FUSES_gc);
+}
+
+uint32_t NVM_application_crc(void)
+{
+	return execute_nvm_command(NVM_CMD_APP_CRC_gc);
+}
+
+uint32_t NVM_boot_crc(void)
+{
+	return execute_nvm_command(NVM_CMD_BOOT_CRC_gc);
+}
+
+uint32_t NVM_flash_range_crc(uint32_t start, uint32_t end)
+{
+	NVM.ADDR0 = start;
+	NVM.ADDR1 = start >> 8;
+	NVM.ADDR2 = start >> 16;
+	NVM.DATA0 = end & 0xFF;
+	NVM.DATA1 = end >> 8;
+	NVM.DATA2 = end >> 16;
+	return execute_nvm_command(NVM_CMD_FLASH_RANGE_CRC_gc);
+}
@@ -6,8 +6,9 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
-#include <util/delay.h>
 #include "usb.h"
+#include <util/delay.h>	// after usb.h, F_CPU depends on the clock profile
+#include "dfu.h"
 #include "dfu_config.h"
 
 typedef void (*AppPtr)(void) __attribute__ ((noreturn));
@@ -16,23 +17,67 @@ extern void CCPWrite(volatile uint8_t *address, uint8_t value);
 
 volatile bool reset_flag = false;
 
+/**************************************************************************************************
+* Exit bootloader
+*/
+static void __attribute__ ((noreturn)) start_application(void)
+{
+	AppPtr application_vector = (AppPtr)0x000000;
+	CCP = CCP_IOREG_gc;		// unlock IVSEL
+	PMIC.CTRL = 0;			// disable interrupts, set vector table to app section
+	EIND = 0;				// indirect jumps go to lower 128k of app section
+	RAMPZ = 0;				// LPM uses lower 64k of flash
+	application_vector();
+}
+
+/**************************************************************************************************
+* Check that the application really left the USB clock and the PLL running, as it claimed in the
+* boot mailbox, from the same clock profile. After a reset they are back on the 2MHz RC oscillator.
+*/
+#ifdef BOOT_MAILBOX
+#ifdef USB_USE_RC32
+#define USB_PROFILE_USBSRC	CLK_USBSRC_RC32M_gc
+#else
+#define USB_PROFILE_USBSRC	CLK_USBSRC_PLL_gc
+#endif
+
+static bool clocks_configured(void)
+{
+	return ((CLK.CTRL & CLK_SCLKSEL_gm) == CLK_SCLKSEL_PLL_gc) &&
+		   (OSC.STATUS & OSC_PLLRDY_bm) &&
+		   ((CLK.USBCTRL & (CLK_USBSRC_gm | CLK_USBSEN_bm)) == (USB_PROFILE_USBSRC | CLK_USBSEN_bm));
+}
+#endif
+
 int main(void)
 {
+#ifdef BOOT_MAILBOX
+	DFU_Mailbox_t mailbox = *(DFU_Mailbox_t *)(INTERNAL_SRAM_START);
+	if (mailbox.magic != DFU_MAILBOX_MAGIC)
+		mailbox.flags = 0;
+#endif
+
+#ifdef EXT_FLASH_UPDATE
+	dfu_ext_install();		// image staged in external flash
+#endif
+#ifdef AB_UPDATE
+	dfu_ab_install();		// copy a staged image to the primary slot
+#endif
+
 	if (!CheckStartConditions())
-	{
-		// exit bootloader
-		AppPtr application_vector = (AppPtr)0x000000;
-		CCP = CCP_IOREG_gc;		// unlock IVSEL
-		PMIC.CTRL = 0;			// disable interrupts, set vector table to app section
-		EIND = 0;				// indirect jumps go to lower 128k of app section
-		RAMPZ = 0;				// LPM uses lower 64k of flash
-		application_vector();
-	}
+		start_application();
 
 	CCPWrite(&PMIC.CTRL, PMIC_IVSEL_bm);
 
+#ifdef BOOT_MAILBOX
+	if (!(mailbox.flags & DFU_MAILBOX_CLOCKS_bm) || !clocks_configured())
+#endif
 	usb_configure_clock();
 	usb_init();
+#ifdef BOOT_MAILBOX
+	if (mailbox.flags & DFU_MAILBOX_ALT_bm)
+		dfu_set_alternative(mailbox.alternative);
+#endif
 	PMIC.CTRL |= PMIC_LOLVLEN_bm | PMIC_MEDLVLEN_bm | PMIC_HILVLEN_bm;
 	sei();
 	usb_attach();
@@ -41,6 +86,16 @@ int main(void)
 	_delay_ms(25);
 	usb_detach();
 	_delay_ms(100);
+
+#ifdef DIRECT_HANDOFF
+	cli();
+	usb_deinit();
+	NVM.CTRLB = 0;			// EEPROM mapping off
+	NVM.CMD = 0;
+	if (!CheckStartConditions())
+		start_application();
+#endif
+
 	for(;;)
 		CCPWrite(&RST.CTRL, RST_SWRST_bm);
 }
@@ -70,6 +70,11 @@
 	#define FLASH_PAGE_SIZE		APP_SECTION_PAGE_SIZE
 #endif /*FLASH_PAGE_SIZE*/
 
+/* SP_CompareFlashPage results. */
+#define SP_PAGE_EQUAL		0
+#define SP_PAGE_BLANK		1
+#define SP_PAGE_DIFFERENT	2
+
 /* Define the Start of the application table if not defined in the header files. */
 #ifndef APPTABLE_SECTION_START
 	#error  APPTABLE_SECTION_START must be defined if not defined in header files.
@@ -226,7 +231,27 @@ void SP_LoadFlashPage(const uint8_t * data);
  *	\param data      Pointer to where to store the data.
  *	\param address   Address to page to read from flash.
  */
-void SP_ReadFlashPage(const uint8_t * data, uint32_t address);
+void SP_ReadFlashPage(uint8_t * data, uint32_t address);
+
+/*! \brief Read any number of bytes from Flash into SRAM buffer.
+ *
+ *	\param data      Pointer to where to store the data.
+ *	\param address   Flash byte address to read from.
+ *	\param length    Number of bytes to read.
+ */
+void SP_ReadFlash(uint8_t * data, uint32_t address, uint16_t length);
+
+/*! \brief Compare entire Flash page with SRAM buffer.
+ *
+ *  This function compares a flash page with the buffer and checks whether the
+ *  page is erased in the same pass, stopping early once it is neither.
+ *
+ *	\param data      Pointer to the data to compare with.
+ *	\param address   Address to page to compare.
+ *
+ *	\return SP_PAGE_EQUAL, SP_PAGE_BLANK or SP_PAGE_DIFFERENT.
+ */
+uint8_t SP_CompareFlashPage(const uint8_t * data, uint32_t address);
 
 /*! \brief Flush Flash page buffer.
  *
@@ -0,0 +1,103 @@
+/* spi_flash.c
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * External SPI flash driver for updates staged by the application
+ */
+
+#include <avr/io.h>
+#include "spi_flash.h"
+#include "dfu_config.h"
+
+#ifdef EXT_FLASH_UPDATE
+
+#define SPI_FLASH_MOSI_bm	PIN5_bm		// fixed SPI pins on the port
+#define SPI_FLASH_SCK_bm	PIN7_bm
+
+#define spi_flash_select()		(EXT_FLASH_PORT.OUTCLR = EXT_FLASH_CS_bm)
+#define spi_flash_deselect()	(EXT_FLASH_PORT.OUTSET = EXT_FLASH_CS_bm)
+
+
+/**************************************************************************************************
+* Exchange one byte
+*/
+static uint8_t spi_flash_transfer(uint8_t data)
+{
+	EXT_FLASH_SPI.DATA = data;
+	while (!(EXT_FLASH_SPI.STATUS & SPI_IF_bm));
+	return EXT_FLASH_SPI.DATA;
+}
+
+/**************************************************************************************************
+* Send a command with a 24 bit address, leaving the chip selected
+*/
+static void spi_flash_command(uint8_t cmd, uint32_t address)
+{
+	spi_flash_select();
+	spi_flash_transfer(cmd);
+	spi_flash_transfer(address >> 16);
+	spi_flash_transfer(address >> 8);
+	spi_flash_transfer(address);
+}
+
+/**************************************************************************************************
+* Set up the SPI master. Runs at half the CPU clock.
+*/
+void spi_flash_init(void)
+{
+	EXT_FLASH_PORT.OUTSET = EXT_FLASH_CS_bm;
+	EXT_FLASH_PORT.DIRSET = EXT_FLASH_CS_bm | SPI_FLASH_MOSI_bm | SPI_FLASH_SCK_bm;
+	EXT_FLASH_SPI.CTRL = SPI_ENABLE_bm | SPI_MASTER_bm | SPI_MODE_0_gc | SPI_CLK2X_bm | SPI_PRESCALER_DIV4_gc;
+}
+
+/**************************************************************************************************
+* Return the SPI and pins to their reset state for the application
+*/
+void spi_flash_deinit(void)
+{
+	EXT_FLASH_SPI.CTRL = 0;
+	EXT_FLASH_PORT.DIRCLR = EXT_FLASH_CS_bm | SPI_FLASH_MOSI_bm | SPI_FLASH_SCK_bm;
+	EXT_FLASH_PORT.OUTCLR = EXT_FLASH_CS_bm;
+}
+
+/**************************************************************************************************
+* Streamed read
+*/
+void spi_flash_read_begin(uint32_t address)
+{
+	spi_flash_command(SPI_FLASH_CMD_READ, address);
+}
+
+void spi_flash_read(uint8_t *dest, uint16_t len)
+{
+	while (len--)
+		*dest++ = spi_flash_transfer(0xFF);
+}
+
+void spi_flash_read_end(void)
+{
+	spi_flash_deselect();
+}
+
+/**************************************************************************************************
+* Program up to one page and wait for completion. Bits can only be cleared, which is enough to
+* invalidate a header without erasing a sector.
+*/
+void spi_flash_program(uint32_t address, const uint8_t *data, uint8_t len)
+{
+	spi_flash_select();
+	spi_flash_transfer(SPI_FLASH_CMD_WRITE_ENABLE);
+	spi_flash_deselect();
+
+	spi_flash_command(SPI_FLASH_CMD_PAGE_PROGRAM, address);
+	while (len--)
+		spi_flash_transfer(*data++);
+	spi_flash_deselect();
+
+	spi_flash_select();
+	spi_flash_transfer(SPI_FLASH_CMD_READ_STATUS);
+	while (spi_flash_transfer(0xFF) & SPI_FLASH_STATUS_BUSY_bm);
+	spi_flash_deselect();
+}
+
+#endif // EXT_FLASH_UPDATE
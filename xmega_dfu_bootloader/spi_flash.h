@@ -0,0 +1,31 @@
+/*
+ * spi_flash.h
+ *
+ * External SPI flash (EXT_FLASH_UPDATE). 25 series command set, the port and
+ * chip select are configured in dfu_config.h. Reads are streamed, the chip
+ * stays selected between spi_flash_read_begin() and spi_flash_read_end() so
+ * page programming can be overlapped with reading the next page.
+ */
+
+
+#ifndef SPI_FLASH_H
+#define SPI_FLASH_H
+
+#include <stdint.h>
+
+#define SPI_FLASH_CMD_READ			0x03
+#define SPI_FLASH_CMD_PAGE_PROGRAM	0x02
+#define SPI_FLASH_CMD_WRITE_ENABLE	0x06
+#define SPI_FLASH_CMD_READ_STATUS	0x05
+#define SPI_FLASH_STATUS_BUSY_bm	(1<<0)
+
+
+extern void spi_flash_init(void);
+extern void spi_flash_deinit(void);
+extern void spi_flash_read_begin(uint32_t address);
+extern void spi_flash_read(uint8_t *dest, uint16_t len);
+extern void spi_flash_read_end(void);
+extern void spi_flash_program(uint32_t address, const uint8_t *data, uint8_t len);
+
+
+#endif // SPI_FLASH_H
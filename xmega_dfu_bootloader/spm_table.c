@@ -0,0 +1,37 @@
+/* spm_table.c
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * Boot section service table, see spm_table.h for the layout
+ */
+
+#include <avr/io.h>
+#include "spm_table.h"
+#include "dfu_config.h"
+
+#ifdef SPM_TABLE
+
+#define SPM_STR(x)		#x
+#define SPM_XSTR(x)		SPM_STR(x)
+
+/**************************************************************************************************
+* Fixed address jump table. The .spmtable section is placed by the linker settings, the order of
+* the entries must match the SPM_ENTRY_ offsets.
+*/
+__attribute__((naked, used, section(".spmtable")))
+void spm_table(void)
+{
+	asm volatile(
+		"jmp	SP_LoadFlashPage			\n\t"
+		"jmp	SP_EraseApplicationPage		\n\t"
+		"jmp	SP_WriteApplicationPage		\n\t"
+		"jmp	SP_WaitForSPM				\n\t"
+		"jmp	SP_EraseUserSignatureRow	\n\t"
+		"jmp	SP_WriteUserSignatureRow	\n\t"
+		".long	" SPM_XSTR(SPM_TABLE_MAGIC) "		\n\t"
+		".word	" SPM_XSTR(SPM_TABLE_VERSION) "		\n\t"
+		".word	0xFFFF						\n\t"
+	);
+}
+
+#endif // SPM_TABLE
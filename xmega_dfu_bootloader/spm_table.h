@@ -0,0 +1,98 @@
+/*
+ * spm_table.h
+ *
+ * Boot section service table. SPM only works from the boot section, so the
+ * bootloader exports its NVM routines at a fixed address at the end of the boot
+ * section. The application includes this file to call them while it keeps
+ * running, e.g. to receive an update in the background or to program its own
+ * data tables.
+ *
+ * The layout is a stable ABI. New entries are only ever added to the free slot
+ * and SPM_TABLE_VERSION is bumped, existing entries never move.
+ */
+
+
+#ifndef SPM_TABLE_H
+#define SPM_TABLE_H
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <stdbool.h>
+
+
+/**************************************************************************************************
+** Table layout
+*/
+
+// byte address of the table, last 32 bytes of the boot section. Must match the .spmtable section
+// start in the project linker settings (word address 0x10FF0 on 128k parts).
+#define SPM_TABLE_ADDR				(BOOT_SECTION_START + BOOT_SECTION_SIZE - 32)
+
+// each entry is a 4 byte JMP
+#define SPM_ENTRY_LOAD_FLASH_PAGE		0x00	// void (const uint8_t *data), fills the page buffer
+#define SPM_ENTRY_ERASE_APP_PAGE		0x04	// void (uint32_t address)
+#define SPM_ENTRY_WRITE_APP_PAGE		0x08	// void (uint32_t address)
+#define SPM_ENTRY_WAIT_FOR_SPM			0x0C	// void (void)
+#define SPM_ENTRY_ERASE_USERSIG			0x10	// void (void)
+#define SPM_ENTRY_WRITE_USERSIG			0x14	// void (void)
+#define SPM_ENTRY_MAGIC					0x18	// uint32_t SPM_TABLE_MAGIC
+#define SPM_ENTRY_VERSION				0x1C	// uint16_t SPM_TABLE_VERSION
+#define SPM_ENTRY_FREE					0x1E	// reserved
+
+#define SPM_TABLE_MAGIC				0x544D5053	// "SPMT"
+#define SPM_TABLE_VERSION			1
+
+
+/**************************************************************************************************
+** Application side wrappers
+**
+** The table is above 128k, out of reach of GCC's 16 bit function pointers, so the entries are
+** called with an absolute CALL. The routines follow the GCC ABI and only use call clobbered
+** registers. The usual rules from sp_driver.h apply: no NVM access from interrupt handlers,
+** never erase or write the pages that are executing, and wait for SPM to finish before the next
+** command. Interrupts vectored to the application section stall while an application page is
+** being erased or written.
+*/
+
+#define SPM_CALL_CLOBBERS	"r0", "r18", "r19", "r20", "r21", "r26", "r27", "r30", "r31", "memory"
+
+static inline bool spm_table_present(void)
+{
+	return (pgm_read_dword_far(SPM_TABLE_ADDR + SPM_ENTRY_MAGIC) == SPM_TABLE_MAGIC) &&
+		   (pgm_read_word_far(SPM_TABLE_ADDR + SPM_ENTRY_VERSION) >= SPM_TABLE_VERSION);
+}
+
+static inline void spm_load_flash_page(const uint8_t *data)
+{
+	register const uint8_t *r24 asm("r24") = data;
+	asm volatile("call %[entry]"
+				 : "+r" (r24)
+				 : [entry] "i" (SPM_TABLE_ADDR + SPM_ENTRY_LOAD_FLASH_PAGE)
+				 : "r22", "r23", SPM_CALL_CLOBBERS);
+}
+
+static inline void spm_call_address(uint32_t entry, uint32_t address)
+{
+	register uint32_t r22 asm("r22") = address;
+	asm volatile("call %[entry]"
+				 : "+r" (r22)
+				 : [entry] "i" (entry)
+				 : SPM_CALL_CLOBBERS);
+}
+
+static inline void spm_call_void(uint32_t entry)
+{
+	asm volatile("call %[entry]"
+				 :
+				 : [entry] "i" (entry)
+				 : "r22", "r23", "r24", "r25", SPM_CALL_CLOBBERS);
+}
+
+#define spm_erase_application_page(address)	spm_call_address(SPM_TABLE_ADDR + SPM_ENTRY_ERASE_APP_PAGE, address)
+#define spm_write_application_page(address)	spm_call_address(SPM_TABLE_ADDR + SPM_ENTRY_WRITE_APP_PAGE, address)
+#define spm_wait_for_spm()					spm_call_void(SPM_TABLE_ADDR + SPM_ENTRY_WAIT_FOR_SPM)
+#define spm_erase_user_signature_row()		spm_call_void(SPM_TABLE_ADDR + SPM_ENTRY_ERASE_USERSIG)
+#define spm_write_user_signature_row()		spm_call_void(SPM_TABLE_ADDR + SPM_ENTRY_WRITE_USERSIG)
+
+
+#endif // SPM_TABLE_H
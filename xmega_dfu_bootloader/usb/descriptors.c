@@ -7,15 +7,13 @@
 
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
-#include <util/delay.h>
 #include <string.h>
 #include <stddef.h>
-#define HID_DECLARE_REPORT_DESCRIPTOR
 #include "usb.h"
 #include "usb_xmega.h"
 #include "dfu.h"
 #include "xmega.h"
-#undef HID_DECLARE_REPORT_DESCRIPTOR
+#include "dfu_config.h"
 
 #ifdef USB_HID
 USB_ENDPOINTS(1);
@@ -25,106 +23,51 @@ USB_ENDPOINTS(2);
 
 
 /**************************************************************************************************
-* USB Device descriptor
+* USB configuration descriptor
 */
-const __flash USB_DeviceDescriptor_t device_descriptor = {
-	.bLength				= sizeof(USB_DeviceDescriptor_t),
-	.bDescriptorType		= USB_DTYPE_Device,
-
-	.bcdUSB                 = 0x0200,
-#ifdef USB_HID
-	.bDeviceClass           = USB_CSCP_NoDeviceClass,
+#ifdef DFUSE_MODE
+#define DFU_BCD_VERSION		0x011A		// DfuSe
 #else
-	.bDeviceClass           = USB_CSCP_VendorSpecificClass,
+#define DFU_BCD_VERSION		0x0101
 #endif
-	.bDeviceSubClass        = USB_CSCP_NoDeviceSubclass,
-	.bDeviceProtocol        = USB_CSCP_NoDeviceProtocol,
 
-	.bMaxPacketSize0        = USB_EP0_MAX_PACKET_SIZE,
-	.idVendor               = USB_VID,
-	.idProduct              = USB_PID,
-	.bcdDevice              = (USB_VERSION_MAJOR << 8) | (USB_VERSION_MINOR),
-
-	.iManufacturer          = 0x01,
-	.iProduct               = 0x02,
-#ifdef USB_SERIAL_NUMBER
-	.iSerialNumber          = 0x03,
+#ifdef MANIFEST_TOLERANT
+#define DFU_ATTR_MANIFEST	DFU_ATTR_MANIFEST_TOLERANT_bm
 #else
-	.iSerialNumber          = 0x00,
+#define DFU_ATTR_MANIFEST	0
 #endif
 
-	.bNumConfigurations     = 1
-};
-
-
-/**************************************************************************************************
-* USB configuration descriptor
-*/
 typedef struct {
 	USB_ConfigurationDescriptor_t	Config;
+#ifdef USB_HID
+	USB_InterfaceDescriptor_t		HID_intf;
+	USB_HIDDescriptor_t				HIDDescriptor;
+	USB_EndpointDescriptor_t		HID_ep_in;
+	USB_EndpointDescriptor_t		HID_ep_out;
+#else
 	USB_InterfaceDescriptor_t		DFU_intf_flash;
 	DFU_FunctionalDescriptor_t		DFU_desc_flash;
 	USB_InterfaceDescriptor_t		DFU_intf_eeprom;
 	DFU_FunctionalDescriptor_t		DFU_desc_eeprom;
+#ifdef APPTABLE_ALT
+	USB_InterfaceDescriptor_t		DFU_intf_apptable;
+	DFU_FunctionalDescriptor_t		DFU_desc_apptable;
+#endif
+#ifdef USERSIG_ALT
+	USB_InterfaceDescriptor_t		DFU_intf_usersig;
+	DFU_FunctionalDescriptor_t		DFU_desc_usersig;
+#endif
+#ifdef FUSES_ALT
+	USB_InterfaceDescriptor_t		DFU_intf_fuses;
+	DFU_FunctionalDescriptor_t		DFU_desc_fuses;
+#endif
+#ifdef CONTAINER_ALT
+	USB_InterfaceDescriptor_t		DFU_intf_container;
+	DFU_FunctionalDescriptor_t		DFU_desc_container;
+#endif
+#endif
 } ConfigDesc_t;
 
-_Static_assert(sizeof(ConfigDesc_t) <= USB_EP0_BUFFER_SIZE, "Configuration descriptor exceeds EP0 buffer size");
-
-
-/**************************************************************************************************
-* USB configuration descriptor
-*/
-const __flash ConfigDesc_t configuration_descriptor = {
-	.Config = {
-		.bLength = sizeof(USB_ConfigurationDescriptor_t),
-		.bDescriptorType = USB_DTYPE_Configuration,
-		.wTotalLength  = sizeof(ConfigDesc_t),
-		.bNumInterfaces = 1,
-		.bConfigurationValue = 1,
-		.iConfiguration = 0,
-		.bmAttributes = USB_CONFIG_ATTR_BUSPOWERED,
-		.bMaxPower = USB_CONFIG_POWER_MA(100)
-	},
-	.DFU_intf_flash = {
-		.bLength = sizeof(USB_InterfaceDescriptor_t),
-		.bDescriptorType = USB_DTYPE_Interface,
-		.bInterfaceNumber = 0,
-		.bAlternateSetting = 0,
-		.bNumEndpoints = 0,
-		.bInterfaceClass = DFU_INTERFACE_CLASS,
-		.bInterfaceSubClass = DFU_INTERFACE_SUBCLASS,
-		.bInterfaceProtocol = DFU_INTERFACE_PROTOCOL_DFUMODE,
-		.iInterface = 0x10
-	},
-	.DFU_desc_flash = {
-		.bLength = sizeof(DFU_FunctionalDescriptor_t),
-		.bDescriptorType = DFU_DESCRIPTOR_TYPE,
-		.bmAttributes = (DFU_ATTR_CANDOWNLOAD_bm | DFU_ATTR_WILLDETACH_bm),
-		.wDetachTimeout = 0,
-		.wTransferSize = APP_SECTION_PAGE_SIZE,
-		.bcdDFUVersion = 0x0101
-	},
-	.DFU_intf_eeprom = {
-		.bLength = sizeof(USB_InterfaceDescriptor_t),
-		.bDescriptorType = USB_DTYPE_Interface,
-		.bInterfaceNumber = 0,
-		.bAlternateSetting = 1,
-		.bNumEndpoints = 0,
-		.bInterfaceClass = DFU_INTERFACE_CLASS,
-		.bInterfaceSubClass = DFU_INTERFACE_SUBCLASS,
-		.bInterfaceProtocol = DFU_INTERFACE_PROTOCOL_DFUMODE,
-		.iInterface = 0x11
-	},
-	.DFU_desc_eeprom = {
-		.bLength = sizeof(DFU_FunctionalDescriptor_t),
-		.bDescriptorType = DFU_DESCRIPTOR_TYPE,
-		.bmAttributes = (DFU_ATTR_CANDOWNLOAD_bm | DFU_ATTR_WILLDETACH_bm),
-		.wDetachTimeout = 0,
-		.wTransferSize = APP_SECTION_PAGE_SIZE,
-		.bcdDFUVersion = 0x0101
-	},
-};
-
 
 /**************************************************************************************************
  *	USB strings
@@ -132,54 +75,350 @@ const __flash ConfigDesc_t configuration_descriptor = {
 #define	CONCAT(a, b)	a##b
 #define	USTRING(s)		CONCAT(u, s)
 
-const __flash USB_StringDescriptor_t language_string = {
-	.bLength = USB_STRING_LEN(1),
-	.bDescriptorType = USB_DTYPE_String,
-	.bString = {USB_LANGUAGE_EN_US},
-};
+#define USB_STRING_T(s)		struct {								\
+								uint8_t bLength;					\
+								uint8_t bDescriptorType;			\
+								__CHAR16_TYPE__ bString[sizeof(s) - 1];	\
+							} __attribute__ ((packed))
+#define USB_STRING(s)		{										\
+								.bLength = USB_STRING_LEN(s),		\
+								.bDescriptorType = USB_DTYPE_String,	\
+								.bString = USTRING(s)				\
+							}
 
-const __flash USB_StringDescriptor_t manufacturer_string = {
-	.bLength = USB_STRING_LEN(USB_STRING_MANUFACTURER),
-	.bDescriptorType = USB_DTYPE_String,
-	.bString = USTRING(USB_STRING_MANUFACTURER)
-};
+#define HID_REPORT_DESCRIPTOR_SIZE	sizeof((const uint8_t[])USB_HID_REPORT_DESCRIPTOR)
 
-const __flash USB_StringDescriptor_t product_string = {
-	.bLength = USB_STRING_LEN(USB_STRING_PRODUCT),
-	.bDescriptorType = USB_DTYPE_String,
-	.bString = USTRING(USB_STRING_PRODUCT)
-};
 
-_Static_assert(sizeof(language_string) <= USB_EP0_BUFFER_SIZE, "Language string exceeds EP0 buffer size");
-_Static_assert(sizeof(manufacturer_string) <= USB_EP0_BUFFER_SIZE, "Language string exceeds EP0 buffer size");
-_Static_assert(sizeof(product_string) <= USB_EP0_BUFFER_SIZE, "Language string exceeds EP0 buffer size");
+/**************************************************************************************************
+ *	All fixed descriptors, packed into one block of flash. usb_descriptor_index[] gives the offset
+ *	and size of each, so a GET_DESCRIPTOR request is one table lookup and one copy.
+ */
+typedef struct {
+	USB_DeviceDescriptor_t			device;
+	ConfigDesc_t					configuration;
+#ifdef USB_HID
+	uint8_t							hid_report[HID_REPORT_DESCRIPTOR_SIZE];
+#endif
+	struct {
+		uint8_t						bLength;
+		uint8_t						bDescriptorType;
+		__CHAR16_TYPE__				bString[1];
+	} __attribute__ ((packed))		language;
+	USB_STRING_T(USB_STRING_MANUFACTURER)	manufacturer;
+	USB_STRING_T(USB_STRING_PRODUCT)		product;
+#ifdef USB_DFU_MODE
+	USB_STRING_T("Flash")			dfu_flash;
+	USB_STRING_T("EEPROM")			dfu_eeprom;
+#ifdef APPTABLE_ALT
+	USB_STRING_T("App table")		dfu_apptable;
+#endif
+#ifdef USERSIG_ALT
+	USB_STRING_T("User signature")	dfu_usersig;
+#endif
+#ifdef FUSES_ALT
+	USB_STRING_T("Fuses")			dfu_fuses;
+#endif
+#ifdef CONTAINER_ALT
+	USB_STRING_T("Container")		dfu_container;
+#endif
+#endif
+#ifdef USB_WCID
+	USB_STRING_T("MSFT100?")		msft;
+#endif
+} __attribute__ ((packed)) USB_Descriptors_t;
+
+const __flash USB_Descriptors_t usb_descriptors = {
+	.device = {
+		.bLength				= sizeof(USB_DeviceDescriptor_t),
+		.bDescriptorType		= USB_DTYPE_Device,
+
+		.bcdUSB                 = 0x0200,
+#ifdef USB_HID
+		.bDeviceClass           = USB_CSCP_NoDeviceClass,
+#else
+		.bDeviceClass           = USB_CSCP_VendorSpecificClass,
+#endif
+		.bDeviceSubClass        = USB_CSCP_NoDeviceSubclass,
+		.bDeviceProtocol        = USB_CSCP_NoDeviceProtocol,
+
+		.bMaxPacketSize0        = USB_EP0_MAX_PACKET_SIZE,
+		.idVendor               = USB_VID,
+		.idProduct              = USB_PID,
+		.bcdDevice              = (USB_VERSION_MAJOR << 8) | (USB_VERSION_MINOR),
 
-const __flash USB_StringDescriptor_t dfu_flash_string = {
-	.bLength = USB_STRING_LEN("Flash"),
-	.bDescriptorType = USB_DTYPE_String,
-	.bString = u"Flash"
+		.iManufacturer          = 0x01,
+		.iProduct               = 0x02,
+#ifdef USB_SERIAL_NUMBER
+		.iSerialNumber          = 0x03,
+#else
+		.iSerialNumber          = 0x00,
+#endif
+
+		.bNumConfigurations     = 1
+	},
+
+	.configuration = {
+		.Config = {
+			.bLength = sizeof(USB_ConfigurationDescriptor_t),
+			.bDescriptorType = USB_DTYPE_Configuration,
+			.wTotalLength = sizeof(ConfigDesc_t),
+			.bNumInterfaces = 1,
+			.bConfigurationValue = 1,
+			.iConfiguration = 0,
+			.bmAttributes = USB_CONFIG_ATTR_BUSPOWERED,
+			.bMaxPower = USB_CONFIG_POWER_MA(100)
+		},
+#ifdef USB_HID
+		.HID_intf = {
+			.bLength = sizeof(USB_InterfaceDescriptor_t),
+			.bDescriptorType = USB_DTYPE_Interface,
+			.bInterfaceNumber = 0,
+			.bAlternateSetting = 0,
+			.bNumEndpoints = 2,
+			.bInterfaceClass = USB_CSCP_HIDClass,
+			.bInterfaceSubClass = USB_CSCP_HIDNoSubclass,
+			.bInterfaceProtocol = USB_CSCP_HIDNoProtocol,
+			.iInterface = 0
+		},
+		.HIDDescriptor = {
+			.bLength = sizeof(USB_HIDDescriptor_t),
+			.bDescriptorType = USB_DTYPE_HID,
+			.bcdHID = 0x0111,
+			.bCountryCode = 0,
+			.bNumDescriptors = 1,
+			.bReportDescriptorType = USB_DTYPE_Report,
+			.wDescriptorLength = HID_REPORT_DESCRIPTOR_SIZE
+		},
+		.HID_ep_in = {
+			.bLength = sizeof(USB_EndpointDescriptor_t),
+			.bDescriptorType = USB_DTYPE_Endpoint,
+			.bEndpointAddress = 0x81,
+			.bmAttributes = USB_EP_TYPE_INTERRUPT,
+			.wMaxPacketSize = USB_HID_REPORT_SIZE,
+			.bInterval = USB_HID_POLL_RATE_MS
+		},
+		.HID_ep_out = {
+			.bLength = sizeof(USB_EndpointDescriptor_t),
+			.bDescriptorType = USB_DTYPE_Endpoint,
+			.bEndpointAddress = 0x01,
+			.bmAttributes = USB_EP_TYPE_INTERRUPT,
+			.wMaxPacketSize = USB_HID_REPORT_SIZE,
+			.bInterval = USB_HID_POLL_RATE_MS
+		},
+#else
+		.DFU_intf_flash = {
+			.bLength = sizeof(USB_InterfaceDescriptor_t),
+			.bDescriptorType = USB_DTYPE_Interface,
+			.bInterfaceNumber = 0,
+			.bAlternateSetting = DFU_ALT_FLASH,
+			.bNumEndpoints = 0,
+			.bInterfaceClass = DFU_INTERFACE_CLASS,
+			.bInterfaceSubClass = DFU_INTERFACE_SUBCLASS,
+			.bInterfaceProtocol = DFU_INTERFACE_PROTOCOL_DFUMODE,
+			.iInterface = 0x10
+		},
+		.DFU_desc_flash = {
+			.bLength = sizeof(DFU_FunctionalDescriptor_t),
+			.bDescriptorType = DFU_DESCRIPTOR_TYPE,
+			.bmAttributes = (DFU_ATTR_CANDOWNLOAD_bm | DFU_ATTR_WILLDETACH_bm | DFU_ATTR_MANIFEST),
+			.wDetachTimeout = 0,
+			.wTransferSize = APP_SECTION_PAGE_SIZE,
+			.bcdDFUVersion = DFU_BCD_VERSION
+		},
+		.DFU_intf_eeprom = {
+			.bLength = sizeof(USB_InterfaceDescriptor_t),
+			.bDescriptorType = USB_DTYPE_Interface,
+			.bInterfaceNumber = 0,
+			.bAlternateSetting = DFU_ALT_EEPROM,
+			.bNumEndpoints = 0,
+			.bInterfaceClass = DFU_INTERFACE_CLASS,
+			.bInterfaceSubClass = DFU_INTERFACE_SUBCLASS,
+			.bInterfaceProtocol = DFU_INTERFACE_PROTOCOL_DFUMODE,
+			.iInterface = 0x11
+		},
+		.DFU_desc_eeprom = {
+			.bLength = sizeof(DFU_FunctionalDescriptor_t),
+			.bDescriptorType = DFU_DESCRIPTOR_TYPE,
+			.bmAttributes = (DFU_ATTR_CANDOWNLOAD_bm | DFU_ATTR_WILLDETACH_bm | DFU_ATTR_MANIFEST),
+			.wDetachTimeout = 0,
+			.wTransferSize = APP_SECTION_PAGE_SIZE,
+			.bcdDFUVersion = DFU_BCD_VERSION
+		},
+#ifdef APPTABLE_ALT
+		.DFU_intf_apptable = {
+			.bLength = sizeof(USB_InterfaceDescriptor_t),
+			.bDescriptorType = USB_DTYPE_Interface,
+			.bInterfaceNumber = 0,
+			.bAlternateSetting = DFU_ALT_APPTABLE,
+			.bNumEndpoints = 0,
+			.bInterfaceClass = DFU_INTERFACE_CLASS,
+			.bInterfaceSubClass = DFU_INTERFACE_SUBCLASS,
+			.bInterfaceProtocol = DFU_INTERFACE_PROTOCOL_DFUMODE,
+			.iInterface = 0x12
+		},
+		.DFU_desc_apptable = {
+			.bLength = sizeof(DFU_FunctionalDescriptor_t),
+			.bDescriptorType = DFU_DESCRIPTOR_TYPE,
+			.bmAttributes = (DFU_ATTR_CANDOWNLOAD_bm | DFU_ATTR_WILLDETACH_bm | DFU_ATTR_MANIFEST),
+			.wDetachTimeout = 0,
+			.wTransferSize = APP_SECTION_PAGE_SIZE,
+			.bcdDFUVersion = DFU_BCD_VERSION
+		},
+#endif
+#ifdef USERSIG_ALT
+		.DFU_intf_usersig = {
+			.bLength = sizeof(USB_InterfaceDescriptor_t),
+			.bDescriptorType = USB_DTYPE_Interface,
+			.bInterfaceNumber = 0,
+			.bAlternateSetting = DFU_ALT_USERSIG,
+			.bNumEndpoints = 0,
+			.bInterfaceClass = DFU_INTERFACE_CLASS,
+			.bInterfaceSubClass = DFU_INTERFACE_SUBCLASS,
+			.bInterfaceProtocol = DFU_INTERFACE_PROTOCOL_DFUMODE,
+			.iInterface = 0x13
+		},
+		.DFU_desc_usersig = {
+			.bLength = sizeof(DFU_FunctionalDescriptor_t),
+			.bDescriptorType = DFU_DESCRIPTOR_TYPE,
+			.bmAttributes = (DFU_ATTR_CANDOWNLOAD_bm | DFU_ATTR_CANUPLOAD_bm | DFU_ATTR_WILLDETACH_bm | DFU_ATTR_MANIFEST),
+			.wDetachTimeout = 0,
+			.wTransferSize = APP_SECTION_PAGE_SIZE,
+			.bcdDFUVersion = DFU_BCD_VERSION
+		},
+#endif
+#ifdef FUSES_ALT
+		.DFU_intf_fuses = {
+			.bLength = sizeof(USB_InterfaceDescriptor_t),
+			.bDescriptorType = USB_DTYPE_Interface,
+			.bInterfaceNumber = 0,
+			.bAlternateSetting = DFU_ALT_FUSES,
+			.bNumEndpoints = 0,
+			.bInterfaceClass = DFU_INTERFACE_CLASS,
+			.bInterfaceSubClass = DFU_INTERFACE_SUBCLASS,
+			.bInterfaceProtocol = DFU_INTERFACE_PROTOCOL_DFUMODE,
+			.iInterface = 0x14
+		},
+		.DFU_desc_fuses = {
+			.bLength = sizeof(DFU_FunctionalDescriptor_t),
+			.bDescriptorType = DFU_DESCRIPTOR_TYPE,
+			.bmAttributes = (DFU_ATTR_CANUPLOAD_bm | DFU_ATTR_WILLDETACH_bm),	// read only
+			.wDetachTimeout = 0,
+			.wTransferSize = APP_SECTION_PAGE_SIZE,
+			.bcdDFUVersion = DFU_BCD_VERSION
+		},
+#endif
+#ifdef CONTAINER_ALT
+		.DFU_intf_container = {
+			.bLength = sizeof(USB_InterfaceDescriptor_t),
+			.bDescriptorType = USB_DTYPE_Interface,
+			.bInterfaceNumber = 0,
+			.bAlternateSetting = DFU_ALT_CONTAINER,
+			.bNumEndpoints = 0,
+			.bInterfaceClass = DFU_INTERFACE_CLASS,
+			.bInterfaceSubClass = DFU_INTERFACE_SUBCLASS,
+			.bInterfaceProtocol = DFU_INTERFACE_PROTOCOL_DFUMODE,
+			.iInterface = 0x15
+		},
+		.DFU_desc_container = {
+			.bLength = sizeof(DFU_FunctionalDescriptor_t),
+			.bDescriptorType = DFU_DESCRIPTOR_TYPE,
+			.bmAttributes = (DFU_ATTR_CANDOWNLOAD_bm | DFU_ATTR_WILLDETACH_bm | DFU_ATTR_MANIFEST),
+			.wDetachTimeout = 0,
+			.wTransferSize = APP_SECTION_PAGE_SIZE,
+			.bcdDFUVersion = DFU_BCD_VERSION
+		},
+#endif
+	#endif
+	},
+
+#ifdef USB_HID
+	.hid_report = USB_HID_REPORT_DESCRIPTOR,
+#endif
+
+	.language = {
+		.bLength = USB_STRING_LEN(1),
+		.bDescriptorType = USB_DTYPE_String,
+		.bString = {USB_LANGUAGE_EN_US},
+	},
+	.manufacturer	= USB_STRING(USB_STRING_MANUFACTURER),
+	.product		= USB_STRING(USB_STRING_PRODUCT),
+#ifdef USB_DFU_MODE
+	.dfu_flash		= USB_STRING("Flash"),
+	.dfu_eeprom		= USB_STRING("EEPROM"),
+#ifdef APPTABLE_ALT
+	.dfu_apptable	= USB_STRING("App table"),
+#endif
+#ifdef USERSIG_ALT
+	.dfu_usersig	= USB_STRING("User signature"),
+#endif
+#ifdef FUSES_ALT
+	.dfu_fuses		= USB_STRING("Fuses"),
+#endif
+#ifdef CONTAINER_ALT
+	.dfu_container	= USB_STRING("Container"),
+#endif
+#endif
+#ifdef USB_WCID
+	.msft = {
+		.bLength = USB_STRING_LEN("MSFT100?"),
+		.bDescriptorType = USB_DTYPE_String,
+		.bString = u"MSFT100" WCID_REQUEST_ID_STR
+	},
+#endif
 };
-_Static_assert(sizeof(dfu_flash_string) <= USB_EP0_BUFFER_SIZE, "DFU flash string exceeds EP0 buffer size");
 
-const __flash USB_StringDescriptor_t dfu_eeprom_string = {
-	.bLength = USB_STRING_LEN("EEPROM"),
-	.bDescriptorType = USB_DTYPE_String,
-	.bString = u"EEPROM"
+
+/**************************************************************************************************
+ *	Descriptor index, searched by type and index
+ */
+typedef struct {
+	uint8_t		type;
+	uint8_t		index;
+	uint16_t	offset;		// in usb_descriptors
+	uint16_t	size;
+} USB_DescriptorIndex_t;
+
+#define USB_DESCRIPTOR(type, index, member)		\
+	{ type, index, offsetof(USB_Descriptors_t, member), sizeof(((USB_Descriptors_t *)0)->member) }
+
+const __flash USB_DescriptorIndex_t usb_descriptor_index[] = {
+	USB_DESCRIPTOR(USB_DTYPE_Device,		0x00,	device),
+	USB_DESCRIPTOR(USB_DTYPE_Configuration,	0x00,	configuration),
+#ifdef USB_HID
+	USB_DESCRIPTOR(USB_DTYPE_HID,			0x00,	configuration.HIDDescriptor),
+	USB_DESCRIPTOR(USB_DTYPE_Report,		0x00,	hid_report),
+#endif
+	USB_DESCRIPTOR(USB_DTYPE_String,		0x00,	language),
+	USB_DESCRIPTOR(USB_DTYPE_String,		0x01,	manufacturer),
+	USB_DESCRIPTOR(USB_DTYPE_String,		0x02,	product),
+#ifdef USB_DFU_MODE
+	USB_DESCRIPTOR(USB_DTYPE_String,		0x10,	dfu_flash),
+	USB_DESCRIPTOR(USB_DTYPE_String,		0x11,	dfu_eeprom),
+#ifdef APPTABLE_ALT
+	USB_DESCRIPTOR(USB_DTYPE_String,		0x12,	dfu_apptable),
+#endif
+#ifdef USERSIG_ALT
+	USB_DESCRIPTOR(USB_DTYPE_String,		0x13,	dfu_usersig),
+#endif
+#ifdef FUSES_ALT
+	USB_DESCRIPTOR(USB_DTYPE_String,		0x14,	dfu_fuses),
+#endif
+#ifdef CONTAINER_ALT
+	USB_DESCRIPTOR(USB_DTYPE_String,		0x15,	dfu_container),
+#endif
+#endif
+#ifdef USB_WCID
+	USB_DESCRIPTOR(USB_DTYPE_String,		0xEE,	msft),
+#endif
 };
-_Static_assert(sizeof(dfu_eeprom_string) <= USB_EP0_BUFFER_SIZE, "DFU eeprom string exceeds EP0 buffer size");
+
+#define USB_DESCRIPTOR_COUNT	(sizeof(usb_descriptor_index) / sizeof(usb_descriptor_index[0]))
 
 
 /**************************************************************************************************
  *	Optional serial number
  */
-#ifdef USB_SERIAL_NUMBER
-/*
-USB_StringDescriptor serial_string = {
-	.bLength = 22*2,
-	.bDescriptorType = USB_DTYPE_String,
-	.bString = u"0123456789ABCDEFGHIJKL"
-};*/
-
+#if defined(USB_SERIAL_NUMBER) || defined(DFUSE_MODE)
 void byte2char16(uint8_t byte, __CHAR16_TYPE__ *c)
 {
 	*c++ = (byte >> 4) < 10 ? (byte >> 4) + '0' : (byte >> 4) + 'A' - 10;
@@ -189,14 +428,22 @@ void byte2char16(uint8_t byte, __CHAR16_TYPE__ *c)
 	//*c++ = 'A' + (byte >> 4);
 	//*c = 'A' + (byte & 0xF);
 }
+#endif
+
+#ifdef USB_SERIAL_NUMBER
+// built once by usb_init_descriptors() and sent straight from RAM
+__attribute__((__aligned__(2))) struct {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	__CHAR16_TYPE__ bString[22];
+} __attribute__ ((packed)) serial_string;
 
 void generate_serial(void)
 {
-	USB_StringDescriptor_t *serial_string = (USB_StringDescriptor_t *)ep0_buf_in;
-	serial_string->bDescriptorType = USB_DTYPE_String;
-	serial_string->bLength = 22*2;
+	serial_string.bDescriptorType = USB_DTYPE_String;
+	serial_string.bLength = sizeof(serial_string);
 
-	__CHAR16_TYPE__ *c = (__CHAR16_TYPE__ *)&serial_string->bString;
+	__CHAR16_TYPE__ *c = serial_string.bString;
 	uint8_t idx = offsetof(NVM_PROD_SIGNATURES_t, LOTNUM0);
 	for (uint8_t i = 0; i < 6; i++)
 	{
@@ -212,8 +459,89 @@ void generate_serial(void)
 		c += 2;
 	}
 }
+#endif
 
-_Static_assert((22*2) <= USB_EP0_BUFFER_SIZE, "Serial number string exceeds EP0 buffer size");
+/**************************************************************************************************
+ *	Build the descriptors that are kept in RAM, called once by usb_init()
+ */
+void usb_init_descriptors(void)
+{
+#ifdef USB_SERIAL_NUMBER
+	generate_serial();
+#endif
+}
+
+
+/**************************************************************************************************
+ *	Optional DfuSe memory layout strings, e.g. "@Flash /0x00000000/256*512Bg". They replace the
+ *	alternate names and are generated from the memory layout, so they always match the part.
+ */
+#ifdef DFUSE_MODE
+__CHAR16_TYPE__ *dfuse_decimal(uint16_t value, __CHAR16_TYPE__ *c)
+{
+	bool leading = true;
+	for (uint16_t div = 10000; div > 1; div /= 10)
+	{
+		uint8_t digit = value / div;
+		value %= div;
+		if (digit || !leading)
+		{
+			*c++ = '0' + digit;
+			leading = false;
+		}
+	}
+	*c++ = '0' + value;
+	return c;
+}
+
+uint16_t dfuse_layout_string(uint8_t alt, uint32_t name_address)
+{
+	uint16_t pages, offset;
+	if (!dfu_memory_layout(alt, &pages, &offset))
+		return 0;
+
+	USB_StringDescriptor_t *layout = (USB_StringDescriptor_t *)ep0_buf_in;
+	__CHAR16_TYPE__ *c = (__CHAR16_TYPE__ *)&layout->bString;
+	*c++ = '@';
+	uint8_t len = pgm_read_byte_far(name_address + offsetof(USB_StringDescriptor_t, bLength));
+	for (uint8_t i = offsetof(USB_StringDescriptor_t, bString); i < len; i += 2)
+		*c++ = pgm_read_word_far(name_address + i);
+	*c++ = ' ';
+
+	uint32_t base = 0;
+	if (DFU_ALT_IS_FLASH(alt))
+		base = APP_SECTION_START + ((uint32_t)offset * APP_SECTION_PAGE_SIZE);
+	*c++ = '/';
+	*c++ = '0';
+	*c++ = 'x';
+	for (int8_t shift = 24; shift >= 0; shift -= 8)
+	{
+		byte2char16(base >> shift, c);
+		c += 2;
+	}
+	*c++ = '/';
+
+	uint16_t size = APP_SECTION_PAGE_SIZE;
+	__CHAR16_TYPE__ attributes = 'f';		// erasable, writeable
+#ifdef UPLOAD_SUPPORT
+	attributes = 'g';						// and readable
+#endif
+	if (pages == 0)							// read only block
+	{
+		pages = 1;
+		size = sizeof(DFU_FuseBlock_t);
+		attributes = 'a';
+	}
+	c = dfuse_decimal(pages, c);
+	*c++ = '*';
+	c = dfuse_decimal(size, c);
+	*c++ = 'B';
+	*c++ = attributes;
+
+	layout->bLength = (uint8_t *)c - ep0_buf_in;
+	layout->bDescriptorType = USB_DTYPE_String;
+	return layout->bLength;
+}
 #endif
 
 
@@ -221,13 +549,6 @@ _Static_assert((22*2) <= USB_EP0_BUFFER_SIZE, "Serial number string exceeds EP0
  *	Optional Microsoft WCID stuff
  */
 #ifdef USB_WCID
-const __flash USB_StringDescriptor_t msft_string = {
-	.bLength = 18,
-	.bDescriptorType = USB_DTYPE_String,
-	.bString = u"MSFT100" WCID_REQUEST_ID_STR
-};
-_Static_assert(sizeof(msft_string) <= USB_EP0_BUFFER_SIZE, "MSFT WCID string exceeds EP0 buffer size");
-
 const __flash USB_MicrosoftCompatibleDescriptor_t msft_compatible = {
 	.dwLength = sizeof(USB_MicrosoftCompatibleDescriptor_t) +
 				1*sizeof(USB_MicrosoftCompatibleDescriptor_Interface_t),
@@ -249,7 +570,6 @@ const __flash USB_MicrosoftCompatibleDescriptor_t msft_compatible = {
 		},
 	}
 };
-_Static_assert(sizeof(msft_compatible) <= USB_EP0_BUFFER_SIZE, "MSFT compatible descriptor exceeds EP0 buffer size");
 
 #ifdef USB_WCID_EXTENDED
 /*
@@ -356,8 +676,6 @@ const __flash USB_MicrosoftExtendedPropertiesDescriptor_t msft_extended = {
 	.dwDataLength2 = 13*2,
 	.data2 = L"Name56789AB\0",
 };
-
-_Static_assert(sizeof(msft_extended) <= USB_EP0_BUFFER_SIZE, "MSFT extended descriptor exceeds EP0 buffer size");
 #endif // USB_WCID_EXTENDED
 
 void handle_msft_compatible(void)
@@ -378,97 +696,60 @@ void handle_msft_compatible(void)
 		address = pgm_get_far_address(msft_compatible);
 		size    = pgm_read_dword_far(address + offsetof(USB_MicrosoftCompatibleDescriptor_t, dwLength));
 	} else {
+		NVM.CMD = cmd_backup;
 		return usb_ep0_stall();
 	}
-	if (size > usb_setup.wLength) {
-		size = usb_setup.wLength;
-	}
-
-	memcpy_PF(ep0_buf_in, address, size);
 	NVM.CMD = cmd_backup;
 
-	usb_ep0_in(size);
+	usb_ep0_in_flash(address, size);	// may be longer than ep0_buf_in
 	usb_ep0_out();
 }
 #endif // USB_WCID
 
 
 /**************************************************************************************************
- *	USB descriptor request handler
+ *	USB descriptor request handler. Sends the descriptor, or stalls if there is no such descriptor.
  */
-uint16_t usb_handle_descriptor_request(uint8_t type, uint8_t index) {
-	uint32_t address = 0;
-	uint16_t size = 0;
+void usb_handle_descriptor_request(uint8_t type, uint8_t index) {
+#ifdef USB_SERIAL_NUMBER
+	if ((type == USB_DTYPE_String) && (index == 0x03))
+	{
+		uint16_t size = sizeof(serial_string);
+		if (size > usb_setup.wLength)
+			size = usb_setup.wLength;
+		return usb_ep_start_in(0x80, (const uint8_t *)&serial_string, size, true);
+	}
+#endif
 
 	uint8_t cmd_backup = NVM.CMD;
 	NVM.CMD = 0;
 
-	switch (type)
+	uint32_t entry = pgm_get_far_address(usb_descriptor_index);
+	for (uint8_t i = 0; i < USB_DESCRIPTOR_COUNT; i++, entry += sizeof(USB_DescriptorIndex_t))
 	{
-		case USB_DTYPE_Device:
-			address = pgm_get_far_address(device_descriptor);
-			size    = sizeof(USB_DeviceDescriptor_t);
-			break;
-		case USB_DTYPE_Configuration:
-			address = pgm_get_far_address(configuration_descriptor);
-			size    = sizeof(ConfigDesc_t);
-			break;
-#ifdef USB_HID
-		case USB_DTYPE_HID:
-			address = pgm_get_far_address(configuration_descriptor.HIDDescriptor);
-			size	= sizeof(USB_HIDDescriptor_t);
-			break;
-		case USB_DTYPE_Report:
-			address = pgm_get_far_address(hid_report_descriptor);
-			size    = sizeof(hid_report_descriptor);
-			break;
-#endif
-		case USB_DTYPE_String:
-			switch (index)
-			{
-				case 0x00:
-					address = pgm_get_far_address(language_string);
-					break;
-				case 0x01:
-					address = pgm_get_far_address(manufacturer_string);
-					break;
-				case 0x02:
-					address = pgm_get_far_address(product_string);
-					break;
-#ifdef USB_SERIAL_NUMBER
-				case 0x03:
-					generate_serial();
-					return sizeof(USB_StringDescriptor_t) + (22*2);
-#endif
-#ifdef USB_DFU_RUNTIME
-				case 0x10:
-					address = pgm_get_far_address(dfu_runtime_string);
-					break;
-#endif
-#ifdef USB_DFU_MODE
-				case 0x10:
-					address = pgm_get_far_address(dfu_flash_string);
-					break;
-				case 0x11:
-					address = pgm_get_far_address(dfu_eeprom_string);
-					break;
-#endif
-#ifdef USB_WCID
-				case 0xEE:
-					address = pgm_get_far_address(msft_string);
-					break;
+		if ((pgm_read_byte_far(entry + offsetof(USB_DescriptorIndex_t, type)) != type) ||
+			(pgm_read_byte_far(entry + offsetof(USB_DescriptorIndex_t, index)) != index))
+			continue;
+
+		uint32_t address = pgm_get_far_address(usb_descriptors) +
+						   pgm_read_word_far(entry + offsetof(USB_DescriptorIndex_t, offset));
+		uint16_t size = pgm_read_word_far(entry + offsetof(USB_DescriptorIndex_t, size));
+#if defined(DFUSE_MODE) && defined(USB_DFU_MODE)
+		if ((type == USB_DTYPE_String) && ((index & 0xF0) == 0x10))
+		{
+			size = dfuse_layout_string(index & 0x0F, address);
+			NVM.CMD = cmd_backup;
+			if (size > usb_setup.wLength)
+				size = usb_setup.wLength;
+			return usb_ep_start_in(0x80, ep0_buf_in, size, true);
+		}
 #endif
-
-				default:
-					return 0;
-			}
-			size = pgm_read_byte_far(address + offsetof(USB_StringDescriptor_t, bLength));
-			break;
+		NVM.CMD = cmd_backup;
+		return usb_ep0_in_flash(address, size);
 	}
 
-	memcpy_PF(ep0_buf_in, address, size);
 	NVM.CMD = cmd_backup;
-	return size;
+	return usb_ep0_stall();
 }
 
 
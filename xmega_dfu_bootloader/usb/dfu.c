@@ -6,9 +6,12 @@
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include "sp_driver.h"
+#include "spi_flash.h"
+#include "aes.h"
 #include "eeprom.h"
 #include "usb.h"
 #include "usb_xmega.h"
+#include "xmega.h"
 #include "dfu.h"
 #include "dfu_config.h"
 
@@ -19,71 +22,1174 @@ uint8_t	status = DFU_STATUS_OK;
 uint16_t write_head = 0;
 uint8_t write_buffer[APP_SECTION_PAGE_SIZE];
 uint8_t alternative = 0;
+uint8_t memory = DFU_ALT_FLASH;		// memory being written, differs from alternative in containers
 uint16_t max_page = APP_SECTION_SIZE/APP_SECTION_PAGE_SIZE;
+uint16_t page_offset = 0;			// first flash page of the current alternate
 
 #ifdef DELAYED_ZERO_PAGE
 	uint8_t zero_buffer[APP_SECTION_PAGE_SIZE];
+	bool zero_pending = false;
 #endif
 
+#ifdef CONTAINER_ALT
+	DFU_SegmentHeader_t segment;
+	uint8_t segment_fill = 0;			// bytes of the segment header received
+	uint32_t segment_remaining = 0;		// bytes of segment data still to come
+	uint16_t segment_page = 0;
+	uint16_t block_head = 0;
+#endif
+
+#ifdef IMAGE_HEADER
+	DFU_ImageHeader_t image_header;
+	uint8_t image_offset = 0;			// 1 if block 0 was a header
+#endif
+
+#ifdef AES_DECRYPT
+	const __flash uint8_t aes_key[DFU_AES_BLOCK_SIZE] = AES_KEY;
+	uint8_t aes_iv[DFU_AES_BLOCK_SIZE];
+#endif
+
+#ifdef IMAGE_AUTH
+	const __flash uint8_t auth_key[DFU_AES_BLOCK_SIZE] = AUTH_KEY;
+	uint8_t cmac_state[DFU_AES_BLOCK_SIZE];
+	uint8_t cmac_k1[DFU_AES_BLOCK_SIZE];
+	uint32_t cmac_next = 0xFFFFFFFF;	// next image block for the MAC, invalid if out of order
+	#define DFU_IMAGE_TRAILER_SIZE	DFU_AES_BLOCK_SIZE
+#else
+	#define DFU_IMAGE_TRAILER_SIZE	0
+#endif
+
+#if defined(AES_DECRYPT) || defined(IMAGE_AUTH)
+	_Static_assert(AES_BLOCK_SIZE == DFU_AES_BLOCK_SIZE, "AES driver and image format block sizes differ");
+#endif
+
+#ifdef SUBPAGE_DNLOAD
+	uint32_t write_address = 0;
+	uint16_t block_size = APP_SECTION_PAGE_SIZE;
+	uint16_t combine_page = 0xFFFF;		// page currently held in write_buffer
+#endif
+
+#ifdef BURST_DNLOAD
+	uint16_t burst_count = 0;
+	uint16_t burst_remaining = 0;
+	uint16_t burst_first_failed = 0xFFFF;
+	uint8_t burst_failed_status = DFU_STATUS_OK;	// status of burst_first_failed
+	uint8_t burst_failed[DFU_BURST_MAX_BLOCKS / 8];
+	_Static_assert(sizeof(DFU_BurstStatus_t) <= USB_EP0_BUFFER_SIZE, "Burst status exceeds EP0 buffer size");
+#endif
+
+#ifdef STREAM_CRC
+	bool stream_crc_active = false;		// CRC module is fed from the DNLOAD data
+	bool stream_valid = false;			// stream started at block 0 and no block was repeated or skipped
+	uint16_t stream_block = 0;			// next block number
+	uint16_t stream_block_head = 0;		// bytes of the current block received
+	uint32_t stream_length = 0;
+	uint32_t stream_crc = 0;			// only valid once the stream is finished
+	bool stream_expected_set = false;
+	uint32_t stream_expected = 0;
+#endif
+
+#ifdef RESUME_SUPPORT
+	#ifdef DELAYED_ZERO_PAGE
+		#define DFU_JOURNAL_FIRST_PAGE	1	// page 0 is only written at manifestation
+	#else
+		#define DFU_JOURNAL_FIRST_PAGE	0
+	#endif
+	uint16_t journal_next = DFU_JOURNAL_FIRST_PAGE;	// first page not contiguously written
+	bool resuming = false;
+#endif
+
+#if defined(BOOT_VALIDATION) && !defined(IMAGE_HEADER)
+	#error BOOT_VALIDATION requires IMAGE_HEADER
+#endif
+
+#ifdef DFUSE_MODE
+	uint32_t dfuse_address = 0;			// address pointer
+#endif
+
+#if defined(DFUSE_MODE) && (defined(BOOT_VALIDATION) || defined(CONTAINER_ALT))
+	#error DFUSE_MODE is not compatible with BOOT_VALIDATION or CONTAINER_ALT
+#endif
+
+#if defined(AB_UPDATE) && (!defined(IMAGE_HEADER) || defined(DFUSE_MODE) || defined(CONTAINER_ALT))
+	#error AB_UPDATE requires IMAGE_HEADER and is not compatible with DFUSE_MODE or CONTAINER_ALT
+#endif
+
+#if defined(AES_DECRYPT) && (!defined(IMAGE_HEADER) || defined(USB_HID) || defined(DFUSE_MODE) || defined(CONTAINER_ALT))
+	#error AES_DECRYPT requires IMAGE_HEADER and is not supported with USB_HID, DFUSE_MODE or CONTAINER_ALT
+#endif
+
+#if defined(IMAGE_AUTH) && (!defined(IMAGE_HEADER) || defined(USB_HID) || defined(DFUSE_MODE) || defined(CONTAINER_ALT))
+	#error IMAGE_AUTH requires IMAGE_HEADER and is not supported with USB_HID, DFUSE_MODE or CONTAINER_ALT
+#endif
+
+#if defined(IMAGE_AUTH_BOOT) && !(defined(IMAGE_AUTH) && defined(BOOT_VALIDATION))
+	#error IMAGE_AUTH_BOOT requires IMAGE_AUTH and BOOT_VALIDATION
+#endif
+
+#if defined(AES_DECRYPT) && defined(UPLOAD_SUPPORT)
+	#error AES_DECRYPT with UPLOAD_SUPPORT would let the host read back the decrypted image
+#endif
+
+#if defined(STREAM_CRC) && (defined(USB_HID) || defined(DFUSE_MODE))
+	#error STREAM_CRC is not supported with USB_HID or DFUSE_MODE
+#endif
+
+#if defined(FUSES_ALT) && !defined(UPLOAD_SUPPORT)
+	#error FUSES_ALT requires UPLOAD_SUPPORT
+#endif
+
+#ifdef USERSIG_ALT
+	_Static_assert(USER_SIGNATURES_SIZE <= APP_SECTION_PAGE_SIZE, "User signature row larger than a flash page");
+#endif
+
+
+/**************************************************************************************************
+* Write one EEPROM page
+*/
+void dfu_write_eeprom_page(const uint8_t *ptr, uint16_t address)
+{
+	EEP_DisableMapping();
+//	EEP_LoadPageBuffer(ptr, EEPROM_PAGE_SIZE);
+	EEP_WaitForNVM();
+	NVM.CMD = NVM_CMD_LOAD_EEPROM_BUFFER_gc;
+	NVM.ADDR1 = 0x00;
+	NVM.ADDR2 = 0x00;
+	for (uint8_t i = 0; i < EEPROM_PAGE_SIZE; ++i) {
+		NVM.ADDR0 = i;
+		NVM.DATA0 = *ptr++;
+	}
+//	EEP_AtomicWritePage(page + i);
+	NVM.ADDR0 = address & 0xFF;
+	NVM.ADDR1 = (address >> 8) & 0x1F;
+	NVM.ADDR2 = 0x00;
+	NVM.CMD = NVM_CMD_ERASE_WRITE_EEPROM_PAGE_gc;
+	NVM_EXEC();
+}
+
+/**************************************************************************************************
+* Download journal. The first page not yet contiguously written is saved to EEPROM every
+* DFU_JOURNAL_INTERVAL pages, so that an interrupted download can be resumed. The host checks
+* the already written pages with DFU_VREQ_RESUME_INFO before continuing.
+*/
+#ifdef RESUME_SUPPORT
+void dfu_write_journal(uint16_t next_page)
+{
+	uint8_t page[EEPROM_PAGE_SIZE];
+	DFU_Journal_t *jnl = (DFU_Journal_t *)page;
+	memset(page, 0xFF, sizeof(page));
+	if (next_page != 0)
+	{
+		jnl->magic = DFU_JOURNAL_MAGIC;
+		jnl->next_page = next_page;
+	}
+	dfu_write_eeprom_page(page, DFU_JOURNAL_ADDR);
+	EEP_WaitForNVM();
+}
+
+uint16_t dfu_read_journal(void)
+{
+	DFU_Journal_t jnl;
+	EEP_WaitForNVM();
+	EEP_EnableMapping();
+	memcpy(&jnl, (void *)(MAPPED_EEPROM_START + DFU_JOURNAL_ADDR), sizeof(jnl));
+	EEP_DisableMapping();
+
+	if ((jnl.magic != DFU_JOURNAL_MAGIC) || (jnl.next_page > APP_SECTION_SIZE / APP_SECTION_PAGE_SIZE))
+		return DFU_JOURNAL_FIRST_PAGE;
+	return jnl.next_page;
+}
+
+void dfu_journal_start(void)
+{
+	if (!resuming)
+		journal_next = DFU_JOURNAL_FIRST_PAGE;
+	resuming = false;
+}
+
+void dfu_journal_page(uint16_t page)
+{
+	if (page != journal_next)
+		return;
+	journal_next++;
+	if ((journal_next % DFU_JOURNAL_INTERVAL) == 0)
+		dfu_write_journal(journal_next);
+}
+#endif
+
+/**************************************************************************************************
+* Get the flash address of a page in the current alternate
+*/
+uint32_t dfu_flash_address(uint16_t page)
+{
+	return APP_SECTION_START + ((uint32_t)(page + page_offset) * APP_SECTION_PAGE_SIZE);
+}
+
+/**************************************************************************************************
+* Program the write buffer into a flash page classified by SP_CompareFlashPage(). Blank pages
+* are written without an erase.
+*/
+static void dfu_program_flash(uint32_t address, uint8_t flash)
+{
+	if (flash != SP_PAGE_BLANK)
+	{
+		SP_EraseApplicationPage(address);
+		SP_WaitForSPM();
+	}
+	SP_LoadFlashPage(write_buffer);
+	SP_WriteApplicationPage(address);
+}
+
+/**************************************************************************************************
+* Write buffer to flash/EEPROM
+*/
+void dfu_write_buffer(uint16_t page)
+{
+#ifdef USERSIG_ALT
+	if (memory == DFU_ALT_USERSIG)
+	{
+		SP_WaitForSPM();
+		SP_EraseUserSignatureRow();
+		SP_WaitForSPM();
+		SP_LoadFlashPage(write_buffer);
+		SP_WriteUserSignatureRow();
+		SP_WaitForSPM();
+	}
+	else
+#endif
+	if (DFU_ALT_IS_FLASH(memory))	// flash or app table
+	{
+		uint32_t address = dfu_flash_address(page);
+		SP_WaitForSPM();	// previous page may still be writing
+		// pages that already hold the data are skipped, blank ones don't need erasing
+		uint8_t flash = SP_CompareFlashPage(write_buffer, address);
+#ifdef VERIFY_WRITES
+		uint8_t attempts = 3;
+		while (flash != SP_PAGE_EQUAL)
+		{
+			if (attempts == 0)
+			{
+				status = DFU_STATUS_errWRITE;
+				break;
+			}
+			attempts--;
+			dfu_program_flash(address, flash);
+			// verify write
+			SP_WaitForSPM();
+			flash = SP_CompareFlashPage(write_buffer, address);
+		}
+#else
+		if (flash != SP_PAGE_EQUAL)
+			dfu_program_flash(address, flash);
+#endif
+#ifdef RESUME_SUPPORT
+		if ((status == DFU_STATUS_OK) && (alternative == DFU_ALT_FLASH))
+			dfu_journal_page(page);
+#endif
+	}
+	else if (memory == DFU_ALT_EEPROM)
+	{
+		uint8_t *ptr = write_buffer;
+		for (uint8_t i = 0; i < (APP_SECTION_PAGE_SIZE / EEPROM_PAGE_SIZE); i++)
+		{
+			uint16_t address = (((page * (APP_SECTION_PAGE_SIZE/EEPROM_PAGE_SIZE)) + i) * EEPROM_PAGE_SIZE);
+#ifdef BOOT_VALIDATION
+			if (address != DFU_BOOT_RECORD_ADDR)	// reserved for the boot record
+#endif
+#ifdef RESUME_SUPPORT
+			if (address != DFU_JOURNAL_ADDR)		// reserved for the download journal
+#endif
+#ifdef AB_UPDATE
+			if (address != DFU_STAGE_RECORD_ADDR)	// reserved for the stage record
+#endif
+			dfu_write_eeprom_page(ptr, address);
+			ptr += EEPROM_PAGE_SIZE;
+		}
+	}
+	memset(write_buffer, 0xFF, sizeof(write_buffer));
+}
+
+/**************************************************************************************************
+* Size of the memory behind the current alternate, in bytes
+*/
+uint32_t dfu_memory_size(void)
+{
+	switch (memory)
+	{
+#ifdef USERSIG_ALT
+		case DFU_ALT_USERSIG:
+			return USER_SIGNATURES_SIZE;
+#endif
+#ifdef FUSES_ALT
+		case DFU_ALT_FUSES:
+			return sizeof(DFU_FuseBlock_t);
+#endif
+		default:
+			return (uint32_t)max_page * APP_SECTION_PAGE_SIZE;
+	}
+}
+
+/**************************************************************************************************
+* Read from the current alternate. Returns the number of bytes read, which is less than len at
+* the end of the memory.
+*/
+#ifdef UPLOAD_SUPPORT
+uint16_t dfu_read_memory(uint8_t *dest, uint32_t offset, uint16_t len)
+{
+	uint32_t size = dfu_memory_size();
+	if (offset >= size)
+		return 0;
+	if (len > size - offset)
+		len = size - offset;
+
+	switch (memory)
+	{
+		case DFU_ALT_EEPROM:
+			EEP_EnableMapping();
+			memcpy(dest, (void *)(MAPPED_EEPROM_START + (uint16_t)offset), len);
+			break;
+
+#ifdef USERSIG_ALT
+		case DFU_ALT_USERSIG:
+			for (uint16_t i = 0; i < len; i++)
+				dest[i] = SP_ReadUserSignatureByte(offset + i);
+			break;
+#endif
+
+#ifdef FUSES_ALT
+		case DFU_ALT_FUSES: {
+			DFU_FuseBlock_t fb;
+			for (uint8_t i = 0; i < sizeof(fb.fuse); i++)
+				fb.fuse[i] = SP_ReadFuseByte(i);
+			fb.lockbits = NVM.LOCKBITS;
+			for (uint8_t i = 0; i < sizeof(fb.prod_signature); i++)
+				fb.prod_signature[i] = SP_ReadCalibrationByte(i);
+			memcpy(dest, (uint8_t *)&fb + offset, len);
+			break;
+		}
+#endif
+
+		default:	// flash or app table
+			SP_WaitForSPM();	// the last page of a burst may still be writing
+			SP_ReadFlash(dest, dfu_flash_address(0) + offset, len);
+			break;
+	}
+	return len;
+}
+#endif
+
+/**************************************************************************************************
+* AES-128 CTR decryption. block is the index of the first 16 byte block in the image.
+*/
+#ifdef AES_DECRYPT
+void dfu_aes_ctr(uint8_t *data, uint16_t len, uint32_t block)
+{
+	uint8_t ks[DFU_AES_BLOCK_SIZE];
+	for (; len >= DFU_AES_BLOCK_SIZE; len -= DFU_AES_BLOCK_SIZE, block++)
+	{
+		uint32_t ctr = ((uint32_t)aes_iv[12] << 24) | ((uint32_t)aes_iv[13] << 16) |
+					   ((uint16_t)aes_iv[14] << 8) | aes_iv[15];
+		ctr += block;
+
+		memcpy(ks, aes_iv, 12);
+		ks[12] = ctr >> 24;
+		ks[13] = ctr >> 16;
+		ks[14] = ctr >> 8;
+		ks[15] = ctr;
+		aes_encrypt(ks, pgm_get_far_address(aes_key));
+
+		for (uint8_t i = 0; i < DFU_AES_BLOCK_SIZE; i++)
+			*data++ ^= ks[i];
+	}
+}
+#endif
+
+/**************************************************************************************************
+* AES-CMAC image authentication. The tag is in a 16 byte trailer after the image, and the image
+* length is a multiple of 16 bytes, so only the K1 subkey is needed. The MAC is calculated as the
+* pages are programmed. If pages arrive out of order (e.g. a resumed download) it is calculated
+* from flash at manifestation instead.
+*/
+#ifdef IMAGE_AUTH
+static void dfu_cmac_start(void)
+{
+	memset(cmac_k1, 0, sizeof(cmac_k1));
+	aes_encrypt(cmac_k1, pgm_get_far_address(auth_key));
+	uint8_t msb = cmac_k1[0] & 0x80;
+	for (uint8_t i = 0; i < DFU_AES_BLOCK_SIZE - 1; i++)
+		cmac_k1[i] = (cmac_k1[i] << 1) | (cmac_k1[i + 1] >> 7);
+	cmac_k1[DFU_AES_BLOCK_SIZE - 1] <<= 1;
+	if (msb)
+		cmac_k1[DFU_AES_BLOCK_SIZE - 1] ^= 0x87;
+
+	memset(cmac_state, 0, sizeof(cmac_state));
+	cmac_next = 0;
+}
+
+static void dfu_cmac_block(const uint8_t *data, uint32_t blocks)
+{
+	for (uint8_t i = 0; i < DFU_AES_BLOCK_SIZE; i++)
+		cmac_state[i] ^= data[i];
+	if (++cmac_next == blocks)	// last block
+	{
+		for (uint8_t i = 0; i < DFU_AES_BLOCK_SIZE; i++)
+			cmac_state[i] ^= cmac_k1[i];
+	}
+	aes_encrypt(cmac_state, pgm_get_far_address(auth_key));
+}
+
+static void dfu_cmac_page(uint16_t page)
+{
+	uint32_t blocks = image_header.length / DFU_AES_BLOCK_SIZE;
+	if ((uint32_t)page * (APP_SECTION_PAGE_SIZE / DFU_AES_BLOCK_SIZE) != cmac_next)
+	{
+		cmac_next = 0xFFFFFFFF;		// out of order
+		return;
+	}
+	for (uint16_t i = 0; (i < sizeof(write_buffer)) && (cmac_next < blocks); i += DFU_AES_BLOCK_SIZE)
+		dfu_cmac_block(&write_buffer[i], blocks);
+}
+
+/**************************************************************************************************
+* Check the tag of an image in flash. Uses the MAC calculated during the download if it covers the
+* whole image, otherwise calculates it from flash.
+*/
+bool dfu_image_authentic(uint32_t address, uint32_t length)
+{
+	uint32_t blocks = length / DFU_AES_BLOCK_SIZE;
+	uint8_t buf[DFU_AES_BLOCK_SIZE];
+
+	if (cmac_next != blocks)
+	{
+		dfu_cmac_start();
+		for (uint32_t i = 0; i < blocks; i++)
+		{
+			memcpy_PF(buf, address + (i * DFU_AES_BLOCK_SIZE), DFU_AES_BLOCK_SIZE);
+			dfu_cmac_block(buf, blocks);
+		}
+	}
+	cmac_next = 0xFFFFFFFF;		// used up
+
+	memcpy_PF(buf, address + length, DFU_AES_BLOCK_SIZE);
+	return memcmp(buf, cmac_state, DFU_AES_BLOCK_SIZE) == 0;
+}
+#endif
+
+/**************************************************************************************************
+* Prepare the write buffer before it is programmed: decrypt it and add it to the MAC. Flash images
+* must have a header, pages without one are refused. Returns false if the page must not be
+* written.
+*/
+#if defined(AES_DECRYPT) || defined(IMAGE_AUTH)
+static bool dfu_prepare_page(uint16_t page)
+{
+	if (!DFU_ALT_IS_FLASH(memory))
+		return true;
+	if (image_offset == 0)
+	{
+		dfu_error(DFU_STATUS_errFILE);
+		return false;
+	}
+#ifdef AES_DECRYPT
+	dfu_aes_ctr(write_buffer, sizeof(write_buffer), (uint32_t)page * (APP_SECTION_PAGE_SIZE / DFU_AES_BLOCK_SIZE));
+#endif
+#ifdef IMAGE_AUTH
+	dfu_cmac_page(page);
+#endif
+	return true;
+}
+#endif
+
+/**************************************************************************************************
+* Hold back flash page zero until manifestation, so that an interrupted update leaves the reset
+* vector blank. The old page is erased here so its reset vector can't survive an interrupted
+* update. Returns true if the page was taken.
+*/
+#ifdef DELAYED_ZERO_PAGE
+static bool dfu_hold_zero_page(uint16_t page)
+{
+	if ((page != 0) || (memory != DFU_ALT_FLASH))
+		return false;
+	memcpy(zero_buffer, write_buffer, sizeof(zero_buffer));
+	zero_pending = true;
+	SP_WaitForSPM();
+	SP_EraseApplicationPage(dfu_flash_address(0));
+	return true;
+}
+#endif
+
+/**************************************************************************************************
+* Write one page from the write buffer. Flash pages are only erased if they need it, see
+* dfu_write_buffer(). Page zero is held back until manifestation if DELAYED_ZERO_PAGE is enabled.
+*/
+void dfu_program_page(uint16_t page)
+{
+	if (page >= max_page) {
+		dfu_error(DFU_STATUS_errADDRESS);
+		return;
+	}
+#if defined(AES_DECRYPT) || defined(IMAGE_AUTH)
+	if (!dfu_prepare_page(page))
+		return;
+#endif
+
+#ifdef DELAYED_ZERO_PAGE
+	if (dfu_hold_zero_page(page))
+	{
+		memset(write_buffer, 0xFF, sizeof(write_buffer));
+		return;
+	}
+#endif
+	dfu_write_buffer(page);
+}
+
+/**************************************************************************************************
+* Write combining for blocks smaller than a page. Data is placed in the write buffer by byte
+* address and each page is programmed once, when it is full or when the stream moves on to
+* another page. Returns true if the last page written to is full and ready to be flushed.
+*/
+#ifdef SUBPAGE_DNLOAD
+void dfu_combine_flush(void)
+{
+	if (combine_page != 0xFFFF)
+		dfu_program_page(combine_page);
+	combine_page = 0xFFFF;
+}
+
+bool dfu_combine(const uint8_t *data, uint16_t len)
+{
+	bool full = false;
+	while (len > 0)
+	{
+		uint16_t page = write_address / APP_SECTION_PAGE_SIZE;
+		uint16_t offset = write_address % APP_SECTION_PAGE_SIZE;
+		if (page != combine_page)
+		{
+			dfu_combine_flush();
+			memset(write_buffer, 0xFF, sizeof(write_buffer));
+			combine_page = page;
+		}
+
+		uint16_t maxlen = APP_SECTION_PAGE_SIZE - offset;
+		if (maxlen > len)
+			maxlen = len;
+		memcpy(&write_buffer[offset], data, maxlen);
+		write_address += maxlen;
+		data += maxlen;
+		len -= maxlen;
+
+		full = (offset + maxlen >= APP_SECTION_PAGE_SIZE);
+		if (full && (len > 0))
+			dfu_combine_flush();
+	}
+	return full;
+}
+#endif
+
+/**************************************************************************************************
+* CRC-32 of a flash range using the NVM controller and CRC module. Length must be even.
+*/
+uint32_t dfu_flash_crc(uint32_t start, uint32_t length)
+{
+#ifdef STREAM_CRC
+	if (stream_crc_active)		// the module is needed, a stream in progress is lost
+	{
+		stream_crc_active = false;
+		stream_valid = false;
+	}
+#endif
+	SP_WaitForSPM();
+	CRC.CTRL = CRC_RESET_RESET1_gc;
+	CRC.CTRL = CRC_CRC32_bm | CRC_SOURCE_FLASH_gc;
+	NVM_flash_range_crc(start, start + length - 1);
+	while (CRC.STATUS & CRC_BUSY_bm);
+	uint32_t crc = CRC.CHECKSUM0 | ((uint32_t)CRC.CHECKSUM1 << 8) |
+				   ((uint32_t)CRC.CHECKSUM2 << 16) | ((uint32_t)CRC.CHECKSUM3 << 24);
+	CRC.CTRL = CRC_SOURCE_DISABLE_gc;
+	return crc;
+}
+
+/**************************************************************************************************
+* Streaming CRC-32 of the DNLOAD data. Each packet is fed to the CRC module through the I/O
+* interface as it arrives, so the transfer can be checked against a CRC of the file sent by the
+* host without another pass over memory. The stream starts at block 0 and is no longer valid if a
+* block is repeated or skipped, or if dfu_flash_crc() needs the module. The checksum can only be
+* read once the stream is finished.
+*/
+#ifdef STREAM_CRC
+void dfu_stream_crc_data(const uint8_t *data, uint16_t len)
+{
+	if (stream_block_head == 0)		// first packet of a block
+	{
+		if (usb_setup.wValue == 0)
+		{
+			CRC.CTRL = CRC_RESET_RESET1_gc;
+			CRC.CTRL = CRC_CRC32_bm | CRC_SOURCE_IO_gc;
+			stream_crc_active = true;
+			stream_valid = true;
+			stream_length = 0;
+		}
+		else if ((usb_setup.wValue != stream_block) || !stream_crc_active)
+			stream_valid = false;
+		stream_block = usb_setup.wValue + 1;
+	}
+	stream_block_head += len;
+	if (stream_block_head >= usb_setup.wLength)
+		stream_block_head = 0;
+
+	if (!stream_valid)
+		return;
+	stream_length += len;
+	while (len--)
+		CRC.DATAIN = *data++;
+}
+
+/**************************************************************************************************
+* End the stream and release the CRC module. Returns true if stream_crc is valid.
+*/
+bool dfu_stream_crc_finish(void)
+{
+	if (stream_crc_active)
+	{
+		CRC.STATUS = CRC_BUSY_bm;	// end of data
+		stream_crc = CRC.CHECKSUM0 | ((uint32_t)CRC.CHECKSUM1 << 8) |
+					 ((uint32_t)CRC.CHECKSUM2 << 16) | ((uint32_t)CRC.CHECKSUM3 << 24);
+		CRC.CTRL = CRC_SOURCE_DISABLE_gc;
+		stream_crc_active = false;
+	}
+	return stream_valid;
+}
+#endif
+
+/**************************************************************************************************
+* Image header. If block 0 starts with the magic number it is a header, and the image starts at
+* block 1. Images that don't fit are rejected before anything is erased.
+*/
+#ifdef IMAGE_HEADER
+void dfu_parse_header(const uint8_t *data)
+{
+	memcpy(&image_header, data, sizeof(image_header));
+	if (image_header.magic != DFU_IMAGE_MAGIC)
+	{
+		image_header.length = 0;
+		image_offset = 0;
+	}
+	else
+		image_offset = 1;
+#ifdef AES_DECRYPT
+	memcpy(aes_iv, ((const DFU_EncryptedHeader_t *)data)->iv, sizeof(aes_iv));
+#endif
+#ifdef IMAGE_AUTH
+	dfu_cmac_start();
+#endif
+}
+
+void dfu_check_header(void)
+{
+	if ((image_offset != 0) &&
+		((image_header.length == 0) ||
+		 (image_header.length + DFU_IMAGE_TRAILER_SIZE > (uint32_t)max_page * APP_SECTION_PAGE_SIZE) ||
+#ifdef IMAGE_AUTH
+		 (image_header.length % DFU_AES_BLOCK_SIZE) ||
+#endif
+		 (image_header.length & 1)))
+		dfu_error(DFU_STATUS_errADDRESS);
+}
+#endif
+
+/**************************************************************************************************
+* Get the page number for the current DNLOAD block
+*/
+static inline uint16_t dfu_block_page(void)
+{
+#ifdef IMAGE_HEADER
+	return usb_setup.wValue - image_offset;
+#else
+	return usb_setup.wValue;
+#endif
+}
+
+/**************************************************************************************************
+* Boot record. The length and CRC of the last verified image are kept in the last EEPROM page,
+* so that the application can be checked with the hardware CRC before it is started. A length
+* of zero invalidates the record. With IMAGE_AUTH records are only written for authenticated
+* images, and the record doubles as the validated flag for IMAGE_AUTH_BOOT.
+*/
+#ifdef BOOT_VALIDATION
+#ifdef IMAGE_AUTH
+#define DFU_BOOT_RECORD_MAGIC	DFU_AUTH_MAGIC
+#else
+#define DFU_BOOT_RECORD_MAGIC	DFU_IMAGE_MAGIC
+#endif
+
+void dfu_write_boot_record(uint32_t length, uint32_t crc)
+{
+	uint8_t page[EEPROM_PAGE_SIZE];
+	DFU_BootRecord_t *rec = (DFU_BootRecord_t *)page;
+	memset(page, 0xFF, sizeof(page));
+	if (length != 0)
+	{
+		rec->magic = DFU_BOOT_RECORD_MAGIC;
+		rec->length = length;
+		rec->crc = crc;
+	}
+	dfu_write_eeprom_page(page, DFU_BOOT_RECORD_ADDR);
+	EEP_WaitForNVM();
+}
+
+bool dfu_app_valid(void)
+{
+	DFU_BootRecord_t rec;
+	EEP_WaitForNVM();
+	EEP_EnableMapping();
+	memcpy(&rec, (void *)(MAPPED_EEPROM_START + DFU_BOOT_RECORD_ADDR), sizeof(rec));
+	EEP_DisableMapping();
+
+	if (((rec.magic != DFU_IMAGE_MAGIC) && (rec.magic != DFU_AUTH_MAGIC)) ||
+		(rec.length == 0) || (rec.length > APP_SECTION_SIZE) || (rec.length & 1))
+		return false;
+	bool crc_ok = (dfu_flash_crc(APP_SECTION_START, rec.length) == rec.crc);
+
+#ifdef IMAGE_AUTH_BOOT
+	// authenticated before and unchanged since, otherwise do the full check once and cache it
+	if (crc_ok && (rec.magic == DFU_AUTH_MAGIC))
+		return true;
+	if ((rec.length % DFU_AES_BLOCK_SIZE) || (rec.length + DFU_IMAGE_TRAILER_SIZE > APP_SECTION_SIZE) ||
+		!dfu_image_authentic(APP_SECTION_START, rec.length))
+		return false;
+	if (!crc_ok)
+		rec.crc = dfu_flash_crc(APP_SECTION_START, rec.length);
+	dfu_write_boot_record(rec.length, rec.crc);
+	return true;
+#else
+	return crc_ok;
+#endif
+}
+#endif
+
+/**************************************************************************************************
+* Start a download that may begin with a header. A new flash download invalidates the boot record.
+*/
+#ifdef IMAGE_HEADER
+void dfu_header_start(void)
+{
+	image_header.length = 0;
+	image_offset = 0;
+#ifdef BOOT_VALIDATION
+	if (alternative == DFU_ALT_FLASH)
+		dfu_write_boot_record(0, 0);	// application is no longer valid
+#endif
+}
+
+/**************************************************************************************************
+* Program page n of a stream that has no block numbers (HID). A header fills page 0 of the stream
+* and is not written, the image follows from page 1.
+*/
+void dfu_program_stream_page(uint16_t n)
+{
+	if (n == 0)
+	{
+		dfu_parse_header(write_buffer);
+		dfu_check_header();
+		if (image_offset != 0)
+			return;
+	}
+	uint16_t page = n - image_offset;
+	if ((image_header.length != 0) &&
+		((uint32_t)page * APP_SECTION_PAGE_SIZE >= image_header.length + DFU_IMAGE_TRAILER_SIZE)) {
+		dfu_error(DFU_STATUS_errADDRESS);	// nothing past the end of the image
+		return;
+	}
+	dfu_program_page(page);
+}
+#endif
+
+/**************************************************************************************************
+* A/B staged updates. The flash alternate writes to the staging slot and a verified download
+* leaves a stage record in EEPROM. At the next reset the staged image is checked again and copied
+* into the primary slot. The staging slot is not touched by the copy, so a copy interrupted by a
+* reset is simply repeated, and the record is only cleared once the primary image verifies.
+*/
+#ifdef AB_UPDATE
+void dfu_write_stage_record(uint32_t length, uint32_t crc)
+{
+	uint8_t page[EEPROM_PAGE_SIZE];
+	DFU_StageRecord_t *rec = (DFU_StageRecord_t *)page;
+	memset(page, 0xFF, sizeof(page));
+	if (length != 0)
+	{
+		rec->magic = DFU_STAGE_MAGIC;
+		rec->length = length;
+		rec->crc = crc;
+	}
+	dfu_write_eeprom_page(page, DFU_STAGE_RECORD_ADDR);
+	EEP_WaitForNVM();
+}
+
+void dfu_ab_install(void)
+{
+	DFU_StageRecord_t rec;
+	EEP_WaitForNVM();
+	EEP_EnableMapping();
+	memcpy(&rec, (void *)(MAPPED_EEPROM_START + DFU_STAGE_RECORD_ADDR), sizeof(rec));
+	EEP_DisableMapping();
+
+	if (rec.magic != DFU_STAGE_MAGIC)
+		return;
+	if ((rec.length == 0) || (rec.length + DFU_IMAGE_TRAILER_SIZE > (uint32_t)DFU_AB_SLOT_PAGES * APP_SECTION_PAGE_SIZE) ||
+		(rec.length & 1) || (dfu_flash_crc(DFU_AB_STAGE_START, rec.length) != rec.crc)
+#ifdef IMAGE_AUTH
+		|| (rec.length % DFU_AES_BLOCK_SIZE) || !dfu_image_authentic(DFU_AB_STAGE_START, rec.length)
+#endif
+		)
+	{
+		dfu_write_stage_record(0, 0);	// staged image damaged, keep the primary one
+		return;
+	}
+
+	uint16_t pages = (rec.length + DFU_IMAGE_TRAILER_SIZE + APP_SECTION_PAGE_SIZE - 1) / APP_SECTION_PAGE_SIZE;
+	for (uint16_t i = 0; i < pages; i++)
+	{
+		uint32_t offset = (uint32_t)i * APP_SECTION_PAGE_SIZE;
+		SP_WaitForSPM();
+		SP_ReadFlashPage(write_buffer, DFU_AB_STAGE_START + offset);
+		SP_EraseApplicationPage(APP_SECTION_START + offset);
+		SP_WaitForSPM();
+		SP_LoadFlashPage(write_buffer);
+		SP_WriteApplicationPage(APP_SECTION_START + offset);
+	}
+
+	if (dfu_flash_crc(APP_SECTION_START, rec.length) != rec.crc)
+	{
+		// leave the record so the copy is retried, and enter DFU until it succeeds
+		SP_WaitForSPM();
+		SP_EraseApplicationPage(APP_SECTION_START);
+		SP_WaitForSPM();
+		return;
+	}
+#ifdef BOOT_VALIDATION
+	dfu_write_boot_record(rec.length, rec.crc);
+#endif
+	dfu_write_stage_record(0, 0);
+}
+#endif
+
+/**************************************************************************************************
+* Install an image staged in external SPI flash by the application. The layout is the same as an
+* IMAGE_HEADER download: a header padded to one page, followed by the image. Each page is read
+* into the write buffer while the previous one is being programmed. The header is cleared
+* afterwards whether the image verified or not, so a bad image is only tried once.
+*/
+#ifdef EXT_FLASH_UPDATE
+void dfu_ext_install(void)
+{
+	DFU_ImageHeader_t hdr;
+	uint16_t max_pages;
+	uint16_t offset;
+	dfu_memory_layout(DFU_ALT_FLASH, &max_pages, &offset);	// staging slot with AB_UPDATE
+	uint32_t base = APP_SECTION_START + ((uint32_t)offset * APP_SECTION_PAGE_SIZE);
+
+	spi_flash_init();
+	spi_flash_read_begin(EXT_FLASH_IMAGE_ADDR);
+	spi_flash_read((uint8_t *)&hdr, sizeof(hdr));
+	if ((hdr.magic != DFU_IMAGE_MAGIC) || (hdr.length == 0) ||
+		(hdr.length + DFU_IMAGE_TRAILER_SIZE > (uint32_t)max_pages * APP_SECTION_PAGE_SIZE) ||
+#ifdef IMAGE_AUTH
+		(hdr.length % DFU_AES_BLOCK_SIZE) ||
+#endif
+		(hdr.length & 1))
+	{
+		spi_flash_read_end();
+		spi_flash_deinit();
+		return;
+	}
+
+	uint16_t pages = (hdr.length + DFU_IMAGE_TRAILER_SIZE + APP_SECTION_PAGE_SIZE - 1) / APP_SECTION_PAGE_SIZE;
+	spi_flash_read(write_buffer, APP_SECTION_PAGE_SIZE - sizeof(hdr));	// header padding
+#ifdef AES_DECRYPT
+	memcpy(aes_iv, write_buffer, sizeof(aes_iv));	// follows the header
+#endif
+	spi_flash_read(write_buffer, APP_SECTION_PAGE_SIZE);
+	for (uint16_t i = 0; i < pages; i++)
+	{
+		uint32_t address = base + ((uint32_t)i * APP_SECTION_PAGE_SIZE);
+#ifdef AES_DECRYPT
+		dfu_aes_ctr(write_buffer, sizeof(write_buffer), (uint32_t)i * (APP_SECTION_PAGE_SIZE / DFU_AES_BLOCK_SIZE));
+#endif
+		SP_WaitForSPM();
+		SP_EraseApplicationPage(address);
+		SP_WaitForSPM();
+		SP_LoadFlashPage(write_buffer);
+		SP_WriteApplicationPage(address);
+		if (i + 1 < pages)
+			spi_flash_read(write_buffer, APP_SECTION_PAGE_SIZE);	// overlaps the page write
+	}
+	spi_flash_read_end();
+
+	bool ok = (dfu_flash_crc(base, hdr.length) == hdr.crc);
+#ifdef IMAGE_AUTH
+	ok = ok && dfu_image_authentic(base, hdr.length);
+#endif
+	memset(write_buffer, 0, sizeof(hdr.magic));
+	spi_flash_program(EXT_FLASH_IMAGE_ADDR, write_buffer, sizeof(hdr.magic));
+	spi_flash_deinit();
+	memset(write_buffer, 0xFF, sizeof(write_buffer));
+
+	if (!ok)
+	{
+#ifndef AB_UPDATE	// the primary image is untouched
+		SP_WaitForSPM();
+		SP_EraseApplicationPage(APP_SECTION_START);
+		SP_WaitForSPM();
+#endif
+		return;
+	}
+#ifdef AB_UPDATE
+	dfu_write_stage_record(hdr.length, hdr.crc);
+#elif defined(BOOT_VALIDATION)
+	dfu_write_boot_record(hdr.length, hdr.crc);
+#endif
+}
+#endif
+
+#if defined(STREAM_CRC) || defined(IMAGE_HEADER)
+/**************************************************************************************************
+* Reject a download that failed verification
+*/
+static void dfu_verify_failed(void)
+{
+#ifndef AB_UPDATE	// the primary image is untouched
+	if (alternative == DFU_ALT_FLASH)
+	{
+		// make sure the broken image can't be started
+		SP_WaitForSPM();
+		SP_EraseApplicationPage(APP_SECTION_START);
+		SP_WaitForSPM();
+	}
+#endif
+	dfu_error(DFU_STATUS_errVERIFY);
+}
+#endif
+
+/**************************************************************************************************
+* Finish a download. Returns with the state set to dfuERROR if the image fails verification.
+*/
+void dfu_manifest(void)
+{
+#ifdef CONTAINER_ALT
+	if ((alternative == DFU_ALT_CONTAINER) && ((segment_remaining != 0) || (segment_fill != 0)))
+	{
+		dfu_error(DFU_STATUS_errNOTDONE);	// stream ended inside a segment
+#ifdef DELAYED_ZERO_PAGE
+		zero_pending = false;				// page 0 stays erased
+#endif
+		return;
+	}
+#endif
+
+#ifdef STREAM_CRC
+	bool stream_ok = dfu_stream_crc_finish();
+	if (stream_expected_set)
+	{
+		stream_expected_set = false;
+		if (!stream_ok || (stream_crc != stream_expected))
+		{
+			dfu_verify_failed();
+			return;		// nothing is committed
+		}
+	}
+#endif
+
+#ifdef DELAYED_ZERO_PAGE
+	if (zero_pending)
+	{
+		dfu_select_memory(DFU_ALT_FLASH);
+		memcpy(write_buffer, zero_buffer, sizeof(write_buffer));
+		dfu_write_buffer(0);
+		zero_pending = false;
+	}
+#endif
+
+#ifdef IMAGE_HEADER
+	if ((DFU_ALT_IS_FLASH(alternative)) && (image_header.length != 0))
+	{
+		bool ok = (dfu_flash_crc(dfu_flash_address(0), image_header.length) == image_header.crc);
+#ifdef IMAGE_AUTH
+		ok = ok && dfu_image_authentic(dfu_flash_address(0), image_header.length);
+#endif
+		if (!ok)
+			dfu_verify_failed();
+#ifdef AB_UPDATE
+		else if (alternative == DFU_ALT_FLASH)
+			dfu_write_stage_record(image_header.length, image_header.crc);	// installed after reset
+#elif defined(BOOT_VALIDATION)
+		else if (alternative == DFU_ALT_FLASH)
+			dfu_write_boot_record(image_header.length, image_header.crc);
+#endif
+	}
+#endif
+
+#ifdef RESUME_SUPPORT
+	if ((alternative == DFU_ALT_FLASH) && (state != DFU_STATE_dfuERROR))
+		dfu_write_journal(0);	// download complete
+#endif
+}
 
 /**************************************************************************************************
-* Write buffer to flash/EEPROM
+* Container downloads. The stream is a sequence of DFU_SegmentHeader_t, each followed by its data,
+* and segments are dispatched to the memory they name. Data is programmed in whole pages, the
+* last page of a segment is padded with 0xFF. Headers don't need to be aligned to blocks.
 */
-void dfu_write_buffer(uint16_t page)
+#ifdef CONTAINER_ALT
+void dfu_container_start(void)
+{
+	segment_fill = 0;
+	segment_remaining = 0;
+	write_head = 0;
+	memset(write_buffer, 0xFF, sizeof(write_buffer));
+}
+
+static void dfu_container_segment(void)
 {
-	if (alternative == 0)	// flash
+	segment_fill = 0;
+	if ((segment.magic != DFU_SEGMENT_MAGIC) ||
+		(segment.memory == DFU_ALT_FUSES) ||
+		!dfu_select_memory(segment.memory))
 	{
-#ifdef VERIFY_WRITES
-		uint8_t attempts = 3;
-		for(;;)
+		dfu_error(DFU_STATUS_errTARGET);
+		return;
+	}
+	if ((segment.offset % APP_SECTION_PAGE_SIZE) ||
+		(segment.offset + segment.length > (uint32_t)max_page * APP_SECTION_PAGE_SIZE))
+	{
+		dfu_error(DFU_STATUS_errADDRESS);
+		return;
+	}
+	segment_page = segment.offset / APP_SECTION_PAGE_SIZE;
+	segment_remaining = segment.length;
+}
+
+void dfu_container_data(const uint8_t *data, uint16_t len)
+{
+	while ((len > 0) && (state != DFU_STATE_dfuERROR))
+	{
+		if (segment_remaining == 0)		// next header
 		{
-			SP_WaitForSPM();
-			SP_LoadFlashPage(write_buffer);
-			SP_WriteApplicationPage(APP_SECTION_START + ((uint32_t)page * APP_SECTION_PAGE_SIZE));
-			// verify write
-			SP_WaitForSPM();
-			if (memcmp_PF(write_buffer, (uint_farptr_t)page * APP_SECTION_PAGE_SIZE, APP_SECTION_PAGE_SIZE) == 0)
-				break;
-			attempts--;
-			if (attempts == 0)
+			uint8_t maxlen = sizeof(segment) - segment_fill;
+			if (maxlen > len)
+				maxlen = len;
+			memcpy((uint8_t *)&segment + segment_fill, data, maxlen);
+			segment_fill += maxlen;
+			data += maxlen;
+			len -= maxlen;
+			if (segment_fill >= sizeof(segment))
+				dfu_container_segment();
+			continue;
+		}
+
+		uint16_t maxlen = sizeof(write_buffer) - write_head;
+		if (maxlen > len)
+			maxlen = len;
+		if (maxlen > segment_remaining)
+			maxlen = segment_remaining;
+		memcpy(&write_buffer[write_head], data, maxlen);
+		write_head += maxlen;
+		data += maxlen;
+		len -= maxlen;
+		segment_remaining -= maxlen;
+
+		if ((write_head >= sizeof(write_buffer)) || (segment_remaining == 0))
+		{
+			dfu_program_page(segment_page++);	// leaves the buffer filled with 0xFF
+			write_head = 0;
+		}
+	}
+}
+#endif
+
+/**************************************************************************************************
+* DfuSe (DFU 1.1a) addressed downloads. Block 0 carries a command, blocks from 2 onwards are
+* written at the address pointer plus (block - 2) pages, so sparse images can be sent as separate
+* elements. Addresses are flash addresses for flash alternates, offsets for other memories.
+*/
+#ifdef DFUSE_MODE
+static uint32_t dfu_dfuse_base(void)
+{
+	if (DFU_ALT_IS_FLASH(memory))
+		return dfu_flash_address(0);
+	return 0;
+}
+
+static void dfu_dfuse_block(uint16_t len)
+{
+	state = DFU_STATE_dfuDNBUSY;		// DfuSe hosts expect to see this once from GETSTATUS
+
+	if (usb_setup.wValue == 0)			// command
+	{
+		uint32_t address;
+		memcpy(&address, &write_buffer[1], sizeof(address));
+		if ((len != 5) || (address % APP_SECTION_PAGE_SIZE))
+			dfu_error(DFU_STATUS_errADDRESS);	// no mass erase, pages only
+		else if (write_buffer[0] == DFUSE_CMD_SET_ADDRESS)
+			dfuse_address = address;
+		else if (write_buffer[0] == DFUSE_CMD_ERASE)
+		{
+			address -= dfu_dfuse_base();
+			if (address >= (uint32_t)max_page * APP_SECTION_PAGE_SIZE)
+				dfu_error(DFU_STATUS_errADDRESS);
+			else if (DFU_ALT_IS_FLASH(memory))	// other memories are erased when written
 			{
-				status = DFU_STATUS_errWRITE;
-				break;
+				SP_WaitForSPM();
+				SP_EraseApplicationPage(dfu_flash_address(address / APP_SECTION_PAGE_SIZE));
 			}
-			SP_EraseApplicationPage(APP_SECTION_START + ((uint32_t)page * APP_SECTION_PAGE_SIZE));
 		}
-#else
-		SP_WaitForSPM();
-		SP_LoadFlashPage(write_buffer);
-		SP_WriteApplicationPage(APP_SECTION_START + ((uint32_t)page * APP_SECTION_PAGE_SIZE));
-#endif
+		else
+			dfu_error(DFU_STATUS_errSTALLEDPKT);
 	}
-	else					// EEPROM
+	else if (usb_setup.wValue == 1)
+		dfu_error(DFU_STATUS_errSTALLEDPKT);
+	else
 	{
-		EEP_DisableMapping();
-		uint8_t *ptr = write_buffer;
-		for (uint8_t i = 0; i < (APP_SECTION_PAGE_SIZE / EEPROM_PAGE_SIZE); i++)
+		uint32_t address = dfuse_address - dfu_dfuse_base() +
+						   ((uint32_t)(usb_setup.wValue - 2) * APP_SECTION_PAGE_SIZE);
+		if (address % APP_SECTION_PAGE_SIZE)
+			dfu_error(DFU_STATUS_errADDRESS);
+		else
+			dfu_program_page(address / APP_SECTION_PAGE_SIZE);
+	}
+}
+#endif
+
+/**************************************************************************************************
+* Burst download. After the host announces a number of blocks it can send them as consecutive
+* DNLOAD requests without GETSTATUS in between. Write errors are recorded per block instead of
+* stopping the download, and reported by DFU_VREQ_BURST_STATUS.
+*/
+#ifdef BURST_DNLOAD
+void dfu_burst_block_done(void)
+{
+	if (burst_remaining == 0)
+		return;
+
+	uint16_t block = burst_count - burst_remaining;
+	if (status != DFU_STATUS_OK)
+	{
+		burst_failed[block / 8] |= 1 << (block & 7);
+		if (burst_first_failed == 0xFFFF)
 		{
-//			EEP_LoadPageBuffer(ptr, EEPROM_PAGE_SIZE);
-			EEP_WaitForNVM();
-			NVM.CMD = NVM_CMD_LOAD_EEPROM_BUFFER_gc;
-			NVM.ADDR1 = 0x00;
-			NVM.ADDR2 = 0x00;
-			for (uint8_t i = 0; i < EEPROM_PAGE_SIZE; ++i) {
-				NVM.ADDR0 = i;
-				NVM.DATA0 = *ptr++;
-			}
-//			EEP_AtomicWritePage(page + i);
-			uint16_t address = (((page * (APP_SECTION_PAGE_SIZE/EEPROM_PAGE_SIZE)) + i) * EEPROM_PAGE_SIZE);
-			NVM.ADDR0 = address & 0xFF;
-			NVM.ADDR1 = (address >> 8) & 0x1F;
-			NVM.ADDR2 = 0x00;
-			NVM.CMD = NVM_CMD_ERASE_WRITE_EEPROM_PAGE_gc;
-			NVM_EXEC();
+			burst_first_failed = block;
+			burst_failed_status = status;
 		}
+		// ready for the next block, the error is reported at the end of the burst
+		status = DFU_STATUS_OK;
+		state = DFU_STATE_dfuDNLOAD_IDLE;
 	}
-	memset(write_buffer, 0xFF, sizeof(write_buffer));
+
+	burst_remaining--;
+	if ((burst_remaining == 0) && (burst_first_failed != 0xFFFF))
+		dfu_error(burst_failed_status);
 }
+#endif
 
 /**************************************************************************************************
 * Handle errors with DFU protocol
@@ -102,24 +1208,179 @@ void dfu_reset(void)
 	state = DFU_STATE_dfuIDLE;
 	status = DFU_STATUS_OK;
 	write_head = 0;
+#ifdef DELAYED_ZERO_PAGE
+	zero_pending = false;
+#endif
+#ifdef CONTAINER_ALT
+	block_head = 0;
+#endif
+#ifdef SUBPAGE_DNLOAD
+	write_address = 0;
+	block_size = APP_SECTION_PAGE_SIZE;
+	combine_page = 0xFFFF;
+#endif
+#ifdef BURST_DNLOAD
+	burst_remaining = 0;
+#endif
+#ifdef STREAM_CRC
+	stream_block_head = 0;
+#endif
 }
 
 /**************************************************************************************************
-* Handle set USB interface request
+* Get the number of pages and the flash page offset of a memory. Returns false if it is not
+* supported.
 */
-void dfu_set_alternative(uint8_t alt)
+bool dfu_memory_layout(uint8_t mem, uint16_t *pages, uint16_t *offset)
 {
-	alternative = alt;
-	switch (alternative)
+	*offset = 0;
+	switch (mem)
 	{
-		case 0:	// flash
-			max_page = APP_SECTION_SIZE/APP_SECTION_PAGE_SIZE;
+		case DFU_ALT_FLASH:
+#ifdef AB_UPDATE
+			*pages = DFU_AB_SLOT_PAGES;		// staging slot
+			*offset = DFU_AB_SLOT_PAGES;
+#else
+			*pages = APP_SECTION_SIZE/APP_SECTION_PAGE_SIZE;
+#endif
+			break;
+		case DFU_ALT_EEPROM:
+			*pages = EEPROM_SIZE/APP_SECTION_PAGE_SIZE;
 			break;
-		case 1: // EEPROM
-			max_page = EEPROM_SIZE/APP_SECTION_PAGE_SIZE;
+#ifdef APPTABLE_ALT
+		case DFU_ALT_APPTABLE:
+			*pages = APPTABLE_SECTION_SIZE/APP_SECTION_PAGE_SIZE;
+			*offset = (APPTABLE_SECTION_START - APP_SECTION_START)/APP_SECTION_PAGE_SIZE;
 			break;
+#endif
+#ifdef USERSIG_ALT
+		case DFU_ALT_USERSIG:
+			*pages = 1;
+			break;
+#endif
+#ifdef FUSES_ALT
+		case DFU_ALT_FUSES:	// read only
+			*pages = 0;
+			break;
+#endif
+		default:
+			return false;
+	}
+	return true;
+}
+
+/**************************************************************************************************
+* Select the memory that dfu_write_buffer() and dfu_program_page() work on. Returns false if it
+* is not supported.
+*/
+bool dfu_select_memory(uint8_t mem)
+{
+	uint16_t pages;
+	uint16_t offset;
+	if (!dfu_memory_layout(mem, &pages, &offset))
+		return false;
+	memory = mem;
+	max_page = pages;
+	page_offset = offset;
+	return true;
+}
+
+/**************************************************************************************************
+* Handle set USB interface request. Returns false if the alternate is not supported.
+*/
+bool dfu_set_alternative(uint8_t alt)
+{
+#ifdef CONTAINER_ALT
+	if (alt == DFU_ALT_CONTAINER)
+	{
+		memory = DFU_ALT_CONTAINER;		// nothing to write until the first segment header
+		max_page = 0;
 	}
+	else
+#endif
+	if (!dfu_select_memory(alt))
+		return false;
+	alternative = alt;
 	dfu_reset();
+	return true;
+}
+
+/**************************************************************************************************
+* Reject a DNLOAD block, stalling its data stage. Returns false for dfu_dnload_start().
+*/
+static bool dfu_dnload_reject(uint8_t error_status)
+{
+	dfu_error(error_status);
+	usb_ep0_stall();
+	return false;
+}
+
+/**************************************************************************************************
+* Start a DNLOAD block. OUT requests with a data stage are not passed to dfu_control_setup(), the
+* USB driver defers them until the data arrives, so this runs on the first packet of each block.
+* Returns false if the block is rejected.
+*/
+static bool dfu_dnload_start(void)
+{
+	if ((state != DFU_STATE_dfuIDLE) && (state != DFU_STATE_dfuDNLOAD_IDLE)
+#ifdef BURST_DNLOAD
+		&& !((state == DFU_STATE_dfuDNBUSY) && (burst_remaining != 0))	// no GETSTATUS in a burst
+#endif
+		)
+		return dfu_dnload_reject(DFU_STATUS_errSTALLEDPKT);
+
+#ifdef CONTAINER_ALT
+	if (alternative == DFU_ALT_CONTAINER)
+	{
+		if (usb_setup.wValue == 0)
+			dfu_container_start();
+		state = DFU_STATE_dfuDNBUSY;
+		return true;
+	}
+#endif
+
+#ifdef RESUME_SUPPORT
+	// a new download starts at page 0, unless the host asked to resume
+	if ((usb_setup.wValue == 0) && (alternative == DFU_ALT_FLASH))
+		dfu_journal_start();
+#endif
+	if (usb_setup.wLength > APP_SECTION_PAGE_SIZE)
+		return dfu_dnload_reject(DFU_STATUS_errUNKNOWN);
+#ifdef DFUSE_MODE
+	memset(write_buffer, 0xFF, sizeof(write_buffer));	// pad short blocks
+	state = DFU_STATE_dfuDNBUSY;
+	return true;
+#endif
+#ifdef IMAGE_HEADER
+	// block 0 may be a header, decided when the data arrives
+	if (usb_setup.wValue == 0)
+		dfu_header_start();
+#endif
+#ifdef SUBPAGE_DNLOAD
+	// all blocks except the last are the same size, learn it from block 0
+	if (usb_setup.wValue == 0)
+		block_size = usb_setup.wLength;
+	else if (usb_setup.wLength > block_size)
+		return dfu_dnload_reject(DFU_STATUS_errADDRESS);
+	write_address = (uint32_t)dfu_block_page() * block_size;
+	if (write_address + usb_setup.wLength > (uint32_t)max_page * APP_SECTION_PAGE_SIZE)
+		return dfu_dnload_reject(DFU_STATUS_errADDRESS);
+#else
+	if (dfu_block_page() >= max_page)
+		return dfu_dnload_reject(DFU_STATUS_errADDRESS);
+#endif
+#ifdef IMAGE_HEADER
+	// nothing past the end of the image
+#ifdef SUBPAGE_DNLOAD
+	uint32_t offset = write_address;
+#else
+	uint32_t offset = (uint32_t)dfu_block_page() * APP_SECTION_PAGE_SIZE;
+#endif
+	if ((image_header.length != 0) && (offset >= image_header.length + DFU_IMAGE_TRAILER_SIZE))
+		return dfu_dnload_reject(DFU_STATUS_errADDRESS);
+#endif
+	state = DFU_STATE_dfuDNBUSY;
+	return true;
 }
 
 /**************************************************************************************************
@@ -133,71 +1394,74 @@ void dfu_control_setup(void)
 
 	switch (usb_setup.bRequest)
 	{
-		// write block
+		// end of download, blocks with data are started by dfu_dnload_start()
 		case DFU_DNLOAD:
-			if ((state == DFU_STATE_dfuIDLE) || (state == DFU_STATE_dfuDNLOAD_IDLE))
+			if (((state == DFU_STATE_dfuIDLE) || (state == DFU_STATE_dfuDNLOAD_IDLE)) &&
+				(usb_setup.wLength == 0))
 			{
-				// enter manifest mode?
-				if (usb_setup.wLength == 0) {
-					state = DFU_STATE_dfuMANIFEST_SYNC;
-					usb_ep0_out();
-					usb_ep0_in(0);
-					return;
-				}
-
-				// else start next page
-				write_head = 0;
-				if (usb_setup.wLength > APP_SECTION_PAGE_SIZE) {
-					dfu_error(DFU_STATUS_errUNKNOWN);
-					return;
-				}
-				if (usb_setup.wValue > max_page) {
-					dfu_error(DFU_STATUS_errADDRESS);
-					return;
-				}
-				if (alternative == 0)
-					SP_EraseApplicationPage(APP_SECTION_START + ((uint32_t)usb_setup.wValue * APP_SECTION_PAGE_SIZE));
-				state = DFU_STATE_dfuDNBUSY;
-				return usb_ep0_out();
+#ifdef SUBPAGE_DNLOAD
+				dfu_combine_flush();
+#endif
+				state = DFU_STATE_dfuMANIFEST_SYNC;
+				usb_ep0_out();
+				usb_ep0_in(0);
+				return;
 			}
-			else
-				dfu_error(DFU_STATUS_errSTALLEDPKT);
-
+			dfu_error(DFU_STATUS_errSTALLEDPKT);
 			return usb_ep0_stall();
 
 		// read memory
 #ifdef UPLOAD_SUPPORT
-		case DFU_UPLOAD:
-			if (usb_setup.wValue >= max_page)
-				return usb_ep0_in(0);	// end of firmware image
+		case DFU_UPLOAD: {
 			if (usb_setup.wLength > sizeof(write_buffer))
 			{
 				dfu_error(DFU_STATUS_errNOTDONE);
 				return;
 			}
 
-			if (alternative == 0)
-				memcpy_PF(write_buffer, read_head, usb_setup.wLength);
-			else {
-				EEP_EnableMapping();
-				memcpy(write_buffer, (void *)(MAPPED_EEPROM_START + (uint16_t)read_head), usb_setup.wLength);
+#ifdef DFUSE_MODE
+			if (usb_setup.wValue == 0)	// get commands
+			{
+				write_buffer[0] = DFUSE_CMD_GET_COMMANDS;
+				write_buffer[1] = DFUSE_CMD_SET_ADDRESS;
+				write_buffer[2] = DFUSE_CMD_ERASE;
+				state = DFU_STATE_dfuUPLOAD_IDLE;
+				usb_ep_start_in(0x80, write_buffer, 3, false);
+				return;
 			}
-			read_head += usb_setup.wLength;
+			read_head = dfuse_address - dfu_dfuse_base() +
+						((uint32_t)(usb_setup.wValue - 2) * usb_setup.wLength);
+#else
+			if (usb_setup.wValue == 0)
+				read_head = 0;
+#endif
+			uint16_t len = dfu_read_memory(write_buffer, read_head, usb_setup.wLength);	// short at end of memory
+			read_head += len;
 			state = DFU_STATE_dfuUPLOAD_IDLE;
-			usb_ep_start_in(0x80, write_buffer, usb_setup.wLength, false);
+			usb_ep_start_in(0x80, write_buffer, len, false);
 			return;
+		}
 #endif
 
 		// read status
 		case DFU_GETSTATUS: {
+			uint16_t poll_timeout = 0;
 			if (state == DFU_STATE_dfuMANIFEST_SYNC) {
+#ifdef MANIFEST_TOLERANT
+				state = DFU_STATE_dfuMANIFEST;
+				dfu_manifest();
+				poll_timeout = DFU_MANIFEST_POLL_MS;
+#else
 				state = DFU_STATE_dfuMANIFEST_WAIT_RST;
-				reset_flag = true;
-#ifdef DELAYED_ZERO_PAGE
-				memcpy(write_buffer, zero_buffer, sizeof(write_buffer));
-				dfu_write_buffer(0);
+				dfu_manifest();
+				if (state != DFU_STATE_dfuERROR)
+					reset_flag = true;
 #endif
 			}
+#ifdef MANIFEST_TOLERANT
+			else if (state == DFU_STATE_dfuMANIFEST)
+				state = DFU_STATE_dfuIDLE;		// host can verify, then sends DFU_DETACH
+#endif
 
 			uint8_t len = usb_setup.wLength;
 			if (len > sizeof(DFU_StatusResponse))
@@ -205,8 +1469,10 @@ void dfu_control_setup(void)
 			DFU_StatusResponse *st = (DFU_StatusResponse *)ep0_buf_in;
 			st->bStatus = status;
 			st->bState = state;
-			st->bwPollTimeout[0] = 0;
-			st->bwPollTimeout[1] = 0;
+			if (state == DFU_STATE_dfuDNBUSY)
+				state = DFU_STATE_dfuDNLOAD_IDLE;
+			st->bwPollTimeout[0] = poll_timeout & 0xFF;
+			st->bwPollTimeout[1] = poll_timeout >> 8;
 			st->bwPollTimeout[2] = 0;
 			st->iString = 0;
 			usb_ep0_in(len);
@@ -246,6 +1512,89 @@ void dfu_control_out_completion(void)
 	switch(usb_setup.bRequest) {
 		case DFU_DNLOAD: {
 			uint16_t len = usb_ep_get_out_transaction_length(0);
+#ifdef CONTAINER_ALT
+			uint16_t head = (alternative == DFU_ALT_CONTAINER) ? block_head : write_head;
+#else
+			uint16_t head = write_head;
+#endif
+			if ((head == 0) && !dfu_dnload_start())
+				return;
+#ifdef STREAM_CRC
+			dfu_stream_crc_data(ep0_buf_out, len);
+#endif
+#ifdef DFUSE_MODE
+			if (write_head + len > sizeof(write_buffer))
+				len = sizeof(write_buffer) - write_head;
+			memcpy(&write_buffer[write_head], ep0_buf_out, len);
+			write_head += len;
+			if (write_head >= usb_setup.wLength)
+			{
+				usb_ep0_in(0);
+				dfu_dfuse_block(write_head);
+				write_head = 0;
+#ifdef BURST_DNLOAD
+				dfu_burst_block_done();
+#endif
+			}
+			else
+				usb_ep0_out();
+			return;
+#endif
+#ifdef CONTAINER_ALT
+			if (alternative == DFU_ALT_CONTAINER)
+			{
+				dfu_container_data(ep0_buf_out, len);
+				block_head += len;
+				if (block_head >= usb_setup.wLength)
+				{
+					block_head = 0;
+					if (state != DFU_STATE_dfuERROR)
+						state = DFU_STATE_dfuDNLOAD_IDLE;
+					usb_ep0_in(0);
+#ifdef BURST_DNLOAD
+					dfu_burst_block_done();
+#endif
+				}
+				else
+					usb_ep0_out();
+				return;
+			}
+#endif
+#ifdef SUBPAGE_DNLOAD
+			bool full = false;
+#ifdef IMAGE_HEADER
+			if (usb_setup.wValue == 0)
+			{
+				if (write_head == 0)
+					dfu_parse_header(ep0_buf_out);
+			}
+			if ((usb_setup.wValue != 0) || (image_offset == 0))	// header block is not written
+#endif
+			full = dfu_combine(ep0_buf_out, len);
+			write_head += len;
+			if (write_head >= usb_setup.wLength)
+			{
+				write_head = 0;
+				state = DFU_STATE_dfuDNLOAD_IDLE;
+				usb_ep0_in(0);
+#ifdef IMAGE_HEADER
+				if (usb_setup.wValue == 0)
+					dfu_check_header();
+#endif
+				if (full)
+					dfu_combine_flush();
+#ifdef BURST_DNLOAD
+				dfu_burst_block_done();
+#endif
+			}
+			else
+			{
+				if (full)
+					dfu_combine_flush();
+				usb_ep0_out();
+			}
+			return;
+#endif
 			while (len > 0)
 			{
 				if (write_head >= sizeof(write_buffer)) {
@@ -264,20 +1613,129 @@ void dfu_control_out_completion(void)
 
 			if (write_head >= usb_setup.wLength)
 			{
-#ifdef DELAYED_ZERO_PAGE
-				if (usb_setup.wValue == 0)	// zero page
-					memcpy(zero_buffer, write_buffer, sizeof(zero_buffer));
-				else
-#endif
-				dfu_write_buffer(usb_setup.wValue);
-
+				// complete the status stage first so the host can send the next block while
+				// this one is being programmed
 				write_head = 0;
 				state = DFU_STATE_dfuDNLOAD_IDLE;
 				usb_ep0_in(0);
+
+#ifdef IMAGE_HEADER
+				if (usb_setup.wValue == 0)
+				{
+					dfu_parse_header(write_buffer);
+					dfu_check_header();
+				}
+				if ((usb_setup.wValue != 0) || (image_offset == 0))	// header block is not written
+#endif
+				dfu_program_page(dfu_block_page());
+#ifdef BURST_DNLOAD
+				dfu_burst_block_done();
+#endif
 			}
 			else
 				usb_ep0_out();
+			return;
+		}
+
+#ifdef STREAM_CRC
+		// expected stream CRC, checked at manifestation
+		case DFU_VREQ_STREAM_CRC:
+			if (usb_setup.wLength != sizeof(stream_expected))
+				return usb_ep0_stall();
+			memcpy(&stream_expected, ep0_buf_out, sizeof(stream_expected));
+			stream_expected_set = true;
+			usb_ep0_in(0);
+			return;
+#endif
+	}
+}
+
+/**************************************************************************************************
+* Handle vendor requests to the DFU interface
+*/
+void dfu_vendor_setup(void)
+{
+	switch (usb_setup.bRequest)
+	{
+#ifdef BURST_DNLOAD
+		// announce wValue blocks
+		case DFU_VREQ_BURST:
+			if ((usb_setup.wValue > DFU_BURST_MAX_BLOCKS) ||
+				((state != DFU_STATE_dfuIDLE) && (state != DFU_STATE_dfuDNLOAD_IDLE)))
+				return usb_ep0_stall();
+			burst_count = usb_setup.wValue;
+			burst_remaining = usb_setup.wValue;
+			burst_first_failed = 0xFFFF;
+			burst_failed_status = DFU_STATUS_OK;
+			memset(burst_failed, 0, sizeof(burst_failed));
+			usb_ep0_in(0);
+			return usb_ep0_out();
+
+		case DFU_VREQ_BURST_STATUS: {
+			DFU_BurstStatus_t *st = (DFU_BurstStatus_t *)ep0_buf_in;
+			st->bStatus = status;
+			st->bState = state;
+			st->wBlocksDone = burst_count - burst_remaining;
+			st->wFirstFailed = burst_first_failed;
+			st->bFirstFailedStatus = burst_failed_status;
+			memcpy(st->bmFailed, burst_failed, sizeof(burst_failed));
+			uint8_t len = usb_setup.wLength;
+			if (len > sizeof(DFU_BurstStatus_t))
+				len = sizeof(DFU_BurstStatus_t);
+			usb_ep0_in(len);
+			return usb_ep0_out();
+		}
+#endif
+
+#ifdef RESUME_SUPPORT
+		case DFU_VREQ_RESUME_INFO: {
+			DFU_ResumeInfo_t *ri = (DFU_ResumeInfo_t *)ep0_buf_in;
+			ri->wNextPage = dfu_read_journal();
+#ifdef DELAYED_ZERO_PAGE
+			ri->bZeroPagePending = 1;
+#else
+			ri->bZeroPagePending = 0;
+#endif
+			ri->dwCrcStart = (uint32_t)DFU_JOURNAL_FIRST_PAGE * APP_SECTION_PAGE_SIZE;
+			ri->dwCrcLength = ((uint32_t)ri->wNextPage * APP_SECTION_PAGE_SIZE) - ri->dwCrcStart;
+			ri->dwCrc = 0;
+			if (ri->dwCrcLength != 0)
+				ri->dwCrc = dfu_flash_crc(APP_SECTION_START + ri->dwCrcStart, ri->dwCrcLength);
+			uint8_t len = usb_setup.wLength;
+			if (len > sizeof(DFU_ResumeInfo_t))
+				len = sizeof(DFU_ResumeInfo_t);
+			usb_ep0_in(len);
+			return usb_ep0_out();
+		}
+
+		// continue the journaled download, the next block 0 won't reset it
+		case DFU_VREQ_RESUME:
+			if ((alternative != DFU_ALT_FLASH) || (state != DFU_STATE_dfuIDLE))
+				return usb_ep0_stall();
+			journal_next = dfu_read_journal();
+			resuming = true;
+			usb_ep0_in(0);
+			return usb_ep0_out();
+#endif
+
+#ifdef STREAM_CRC
+		// finishes the stream, so only ask once all blocks have been sent
+		case DFU_VREQ_STREAM_CRC_STATUS: {
+			DFU_StreamCrc_t *sc = (DFU_StreamCrc_t *)ep0_buf_in;
+			sc->bValid = dfu_stream_crc_finish();
+			sc->bExpected = stream_expected_set;
+			sc->dwLength = stream_length;
+			sc->dwCrc = sc->bValid ? stream_crc : 0;
+			uint8_t len = usb_setup.wLength;
+			if (len > sizeof(DFU_StreamCrc_t))
+				len = sizeof(DFU_StreamCrc_t);
+			usb_ep0_in(len);
+			return usb_ep0_out();
 		}
+#endif
+
+		default:
+			return usb_ep0_stall();
 	}
 }
 
@@ -34,7 +34,7 @@ typedef struct
 	uint16_t	wDetachTimeout;
 	uint16_t	wTransferSize;
 	uint16_t	bcdDFUVersion;
-} DFU_FunctionalDescriptor_t;
+} __attribute__ ((packed)) DFU_FunctionalDescriptor_t;
 
 
 // DFU requests
@@ -56,6 +56,164 @@ typedef struct {
 } DFU_StatusResponse;
 
 
+// Optional image header (IMAGE_HEADER), sent as DNLOAD block 0 and padded to the block size
+// with 0xFF. The image itself starts at block 1. The CRC is CRC-32 as calculated by the XMEGA
+// CRC module over the flash range, and the length must be even.
+#define DFU_IMAGE_MAGIC						0x474D4958UL	// "XIMG"
+
+typedef struct {
+	uint32_t	magic;
+	uint32_t	length;
+	uint32_t	crc;
+	uint16_t	version;
+	uint16_t	reserved;
+} DFU_ImageHeader_t;
+
+
+// Encrypted images (AES_DECRYPT). The image header is followed by a 16 byte initial counter block
+// and the image is encrypted with AES-128 in CTR mode. The counter for each 16 byte block of the
+// image is the initial block with the block index added to its last 4 bytes, big endian. The
+// header CRC is over the decrypted image.
+//
+// Authenticated images (IMAGE_AUTH). The image length is a multiple of 16 bytes and the image is
+// followed by a 16 byte AES-CMAC tag over it, which is not counted in the header length. When
+// the image is also encrypted the tag is encrypted along with it.
+#define DFU_AES_BLOCK_SIZE					16
+
+typedef struct {
+	DFU_ImageHeader_t	header;
+	uint8_t				iv[DFU_AES_BLOCK_SIZE];
+} DFU_EncryptedHeader_t;
+
+
+// Boot record (BOOT_VALIDATION), kept in the last EEPROM page. With IMAGE_AUTH the magic is
+// DFU_AUTH_MAGIC, the image passed the AES-CMAC check.
+#define DFU_BOOT_RECORD_ADDR				(EEPROM_SIZE - EEPROM_PAGE_SIZE)
+#define DFU_AUTH_MAGIC						0x48545541UL	// "AUTH"
+
+typedef struct {
+	uint32_t	magic;
+	uint32_t	length;
+	uint32_t	crc;
+} DFU_BootRecord_t;
+
+
+// Download journal (RESUME_SUPPORT), kept in the second to last EEPROM page
+#define DFU_JOURNAL_ADDR					(EEPROM_SIZE - (2 * EEPROM_PAGE_SIZE))
+#define DFU_JOURNAL_MAGIC					0x4C4E524AUL	// "JRNL"
+
+typedef struct {
+	uint32_t	magic;
+	uint16_t	next_page;
+} DFU_Journal_t;
+
+typedef struct {
+	uint16_t	wNextPage;			// first flash page not known to be written
+	uint8_t		bZeroPagePending;	// page 0 must be sent again
+	uint32_t	dwCrcStart;			// CRC-32 of the written pages, see DFU_ImageHeader_t
+	uint32_t	dwCrcLength;
+	uint32_t	dwCrc;
+} DFU_ResumeInfo_t;
+
+
+// A/B staged updates (AB_UPDATE). The application section below the app table is split in two
+// slots. Downloads go to the staging slot, and the stage record tells the bootloader to copy
+// a complete image into the primary slot at the next reset. The application can stage an
+// image itself through the SPM table and write the record to the third to last EEPROM page.
+#define DFU_AB_SLOT_PAGES					((APPTABLE_SECTION_START - APP_SECTION_START) / APP_SECTION_PAGE_SIZE / 2)
+#define DFU_AB_STAGE_START					(APP_SECTION_START + ((uint32_t)DFU_AB_SLOT_PAGES * APP_SECTION_PAGE_SIZE))
+#define DFU_STAGE_RECORD_ADDR				(EEPROM_SIZE - (3 * EEPROM_PAGE_SIZE))
+#define DFU_STAGE_MAGIC						0x47415453UL	// "STAG"
+
+typedef struct {
+	uint32_t	magic;
+	uint32_t	length;			// image length in bytes, even
+	uint32_t	crc;			// CRC-32 of the staged image, see DFU_ImageHeader_t
+} DFU_StageRecord_t;
+
+
+// DFU interface alternate settings. The numbers are fixed, whether or not the optional ones are
+// enabled in dfu_config.h.
+enum {
+	DFU_ALT_FLASH						= 0,
+	DFU_ALT_EEPROM						= 1,
+	DFU_ALT_APPTABLE					= 2,	// APPTABLE_ALT
+	DFU_ALT_USERSIG						= 3,	// USERSIG_ALT
+	DFU_ALT_FUSES						= 4,	// FUSES_ALT, read only DFU_FuseBlock_t
+	DFU_ALT_CONTAINER					= 5,	// CONTAINER_ALT, DFU_SegmentHeader_t stream
+};
+
+#define DFU_ALT_IS_FLASH(alt)				(((alt) == DFU_ALT_FLASH) || ((alt) == DFU_ALT_APPTABLE))
+
+typedef struct {
+	uint8_t		fuse[FUSE_SIZE];						// FUSEBYTE0 onwards
+	uint8_t		lockbits;
+	uint8_t		prod_signature[PROD_SIGNATURES_SIZE];	// NVM_PROD_SIGNATURES_t
+} DFU_FuseBlock_t;
+
+// DfuSe commands (DFUSE_MODE), sent in block 0
+enum {
+	DFUSE_CMD_GET_COMMANDS				= 0x00,
+	DFUSE_CMD_SET_ADDRESS				= 0x21,
+	DFUSE_CMD_ERASE						= 0x41,
+};
+
+// Container segment (CONTAINER_ALT), followed by length bytes of data
+#define DFU_SEGMENT_MAGIC					0x4D474553UL	// "SEGM"
+
+typedef struct {
+	uint32_t	magic;
+	uint8_t		memory;			// DFU_ALT_FLASH, _EEPROM, _APPTABLE or _USERSIG
+	uint8_t		reserved[3];
+	uint32_t	offset;			// byte offset in the memory, multiple of APP_SECTION_PAGE_SIZE
+	uint32_t	length;
+} DFU_SegmentHeader_t;
+
+
+// Boot mailbox (BOOT_MAILBOX) at INTERNAL_SRAM_START, written by the application before it enters
+// the bootloader. The bootloader's .data section starts after it.
+#define DFU_MAILBOX_MAGIC					0x584F424DUL	// "MBOX"
+#define DFU_MAILBOX_CLOCKS_bm				(1<<0)	// clocks already set up as by usb_configure_clock()
+#define DFU_MAILBOX_ALT_bm					(1<<1)	// preselect alternative
+
+typedef struct {
+	uint32_t	magic;
+	uint8_t		flags;
+	uint8_t		alternative;
+	uint8_t		reserved[2];
+} DFU_Mailbox_t;
+
+
+// Vendor requests to the DFU interface
+enum {
+	DFU_VREQ_BURST						= 0x40,	// OUT, wValue = number of DNLOAD blocks to follow
+	DFU_VREQ_BURST_STATUS				= 0x41,	// IN, returns DFU_BurstStatus_t
+	DFU_VREQ_RESUME_INFO				= 0x42,	// IN, returns DFU_ResumeInfo_t
+	DFU_VREQ_RESUME						= 0x43,	// OUT, continue the journaled download
+	DFU_VREQ_STREAM_CRC					= 0x44,	// OUT, 4 byte data stage with the expected stream CRC
+	DFU_VREQ_STREAM_CRC_STATUS			= 0x45,	// IN, returns DFU_StreamCrc_t
+};
+
+#define DFU_BURST_MAX_BLOCKS				(APP_SECTION_SIZE / APP_SECTION_PAGE_SIZE)
+
+typedef struct {
+	uint8_t		bStatus;
+	uint8_t		bState;
+	uint16_t	wBlocksDone;
+	uint16_t	wFirstFailed;						// 0xFFFF if all blocks written OK
+	uint8_t		bFirstFailedStatus;					// bStatus of block wFirstFailed
+	uint8_t		bmFailed[DFU_BURST_MAX_BLOCKS / 8];	// one bit per block, LSB first
+} DFU_BurstStatus_t;
+
+// CRC-32 of the DNLOAD data as received (STREAM_CRC), same polynomial as DFU_ImageHeader_t
+typedef struct {
+	uint8_t		bValid;				// 1 if the stream started at block 0 and no block was repeated or skipped
+	uint8_t		bExpected;			// 1 if the host sent DFU_VREQ_STREAM_CRC
+	uint32_t	dwLength;			// bytes received
+	uint32_t	dwCrc;
+} DFU_StreamCrc_t;
+
+
 // DFU state machine
 enum {
 	DFU_STATE_appIDLE					= 0,
@@ -91,10 +249,83 @@ enum {
 };
 
 
-extern void dfu_set_alternative(uint8_t alt);
+// HID transport (USB_HID), see dfu_hid.c
+// OUT reports from the host start with a command and a sequence number. The sequence
+// number must increment by one for each report after HID_DFU_CMD_START.
+enum {
+	HID_DFU_CMD_START					= 0x01,	// data[0] = alternative, resets sequence
+	HID_DFU_CMD_DATA					= 0x02,	// bLength bytes of image data
+	HID_DFU_CMD_MANIFEST				= 0x03,	// flush last page and finish download
+	HID_DFU_CMD_UPLOAD					= 0x04,	// read up to bLength bytes
+	HID_DFU_CMD_GETSTATUS				= 0x05,
+	HID_DFU_CMD_ABORT					= 0x06,
+	HID_DFU_CMD_DETACH					= 0x07,
+};
+
+#define HID_DFU_HEADER_SIZE					4
+#define HID_DFU_PAYLOAD_SIZE				(USB_HID_REPORT_SIZE - HID_DFU_HEADER_SIZE)
+
+typedef struct {
+	uint8_t		bCommand;
+	uint8_t		bSequence;
+	uint8_t		bLength;
+	uint8_t		bReserved;
+	uint8_t		data[HID_DFU_PAYLOAD_SIZE];
+} HID_DFU_Report_t;
+
+// IN reports from the device acknowledge the last processed sequence number. They are sent
+// in reply to START, MANIFEST, UPLOAD, GETSTATUS, ABORT and DETACH, after every page is
+// programmed and on errors.
+#define HID_DFU_RESPONSE_PAYLOAD_SIZE		(USB_HID_REPORT_SIZE - 5)
+
+typedef struct {
+	uint8_t		bCommand;
+	uint8_t		bSequence;
+	uint8_t		bLength;
+	uint8_t		bStatus;
+	uint8_t		bState;
+	uint8_t		data[HID_DFU_RESPONSE_PAYLOAD_SIZE];
+} HID_DFU_Response_t;
+
+
+extern uint8_t	state;
+extern uint8_t	status;
+extern uint16_t	write_head;
+extern uint8_t	write_buffer[APP_SECTION_PAGE_SIZE];
+extern uint8_t	alternative;
+extern uint8_t	memory;
+extern uint16_t	max_page;
+extern uint16_t	page_offset;
+
+extern void dfu_write_buffer(uint16_t page);
+extern uint32_t dfu_flash_address(uint16_t page);
+extern uint32_t dfu_memory_size(void);
+extern uint16_t dfu_read_memory(uint8_t *dest, uint32_t offset, uint16_t len);
+extern void dfu_program_page(uint16_t page);
+extern void dfu_manifest(void);
+extern void dfu_write_eeprom_page(const uint8_t *ptr, uint16_t address);
+extern uint32_t dfu_flash_crc(uint32_t start, uint32_t length);
+extern void dfu_stream_crc_data(const uint8_t *data, uint16_t len);
+extern bool dfu_stream_crc_finish(void);
+extern bool dfu_app_valid(void);
+extern bool dfu_image_authentic(uint32_t address, uint32_t length);
+extern void dfu_ab_install(void);
+extern void dfu_ext_install(void);
+extern void dfu_journal_start(void);
+extern void dfu_header_start(void);
+extern void dfu_program_stream_page(uint16_t n);
+extern void dfu_error(uint8_t error_status);
+extern void dfu_reset(void);
+extern bool dfu_memory_layout(uint8_t mem, uint16_t *pages, uint16_t *offset);
+extern bool dfu_select_memory(uint8_t mem);
+extern bool dfu_set_alternative(uint8_t alt);
+extern void dfu_container_start(void);
+extern void dfu_container_data(const uint8_t *data, uint16_t len);
 extern void dfu_control_setup(void);
 extern void dfu_control_out_completion(void);
 extern void dfu_control_in_completion(void);
+extern void dfu_vendor_setup(void);
+extern void dfu_hid_report_out(void);
 
 
 
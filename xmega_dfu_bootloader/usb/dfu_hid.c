@@ -0,0 +1,218 @@
+/* dfu_hid.c
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * DFU over HID interrupt reports. Needs no driver installation on Windows.
+ */
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "eeprom.h"
+#include "usb.h"
+#include "usb_xmega.h"
+#include "hid.h"
+#include "dfu.h"
+#include "dfu_config.h"
+
+#ifdef USB_HID
+
+extern volatile bool reset_flag;
+
+static uint8_t	sequence = 0;
+static uint16_t	page = 0;
+#ifdef UPLOAD_SUPPORT
+static uint32_t	read_head = 0;
+#endif
+
+
+/**************************************************************************************************
+* Send status report
+*/
+static void dfu_hid_send_status(uint8_t command)
+{
+	HID_DFU_Response_t *res = (HID_DFU_Response_t *)hid_report;
+	res->bCommand = command;
+	res->bSequence = sequence;
+	res->bLength = 0;
+	res->bStatus = status;
+	res->bState = state;
+	usb_ep_start_in(0x81, hid_report, USB_HID_REPORT_SIZE, false);
+}
+
+/**************************************************************************************************
+* Handle image data. Pages are programmed as soon as they are complete.
+*/
+static void dfu_hid_data(const uint8_t *data, uint8_t len)
+{
+	if ((state != DFU_STATE_dfuIDLE) && (state != DFU_STATE_dfuDNLOAD_IDLE)) {
+		dfu_error(DFU_STATUS_errSTALLEDPKT);
+		dfu_hid_send_status(HID_DFU_CMD_DATA);
+		return;
+	}
+
+	state = DFU_STATE_dfuDNLOAD_IDLE;
+	if (len > HID_DFU_PAYLOAD_SIZE)
+		len = HID_DFU_PAYLOAD_SIZE;
+
+#ifdef CONTAINER_ALT
+	if (alternative == DFU_ALT_CONTAINER)
+	{
+		dfu_container_data(data, len);
+		dfu_hid_send_status(HID_DFU_CMD_DATA);
+		return;
+	}
+#endif
+
+	while (len > 0)
+	{
+		uint16_t maxlen = sizeof(write_buffer) - write_head;
+		if (maxlen > len)
+			maxlen = len;
+		memcpy(&write_buffer[write_head], data, maxlen);
+		write_head += maxlen;
+		data += maxlen;
+		len -= maxlen;
+
+		if (write_head >= sizeof(write_buffer))
+		{
+#ifdef IMAGE_HEADER
+			dfu_program_stream_page(page++);
+#else
+			dfu_program_page(page++);
+#endif
+			write_head = 0;
+			dfu_hid_send_status(HID_DFU_CMD_DATA);
+		}
+	}
+}
+
+/**************************************************************************************************
+* Handle an OUT report. Called from the USB interrupt. Each report is answered by at most one IN
+* report, so if the host has not collected the last one yet the report is left in the buffer,
+* with the OUT endpoint NAKed, and handled when the IN transaction completes. The host can't get
+* more than one report ahead of the acknowledgements.
+*/
+void dfu_hid_report_out(void)
+{
+	if (!(usb_xmega_endpoints[1].in.STATUS & USB_EP_BUSNACK0_bm))
+		return;
+
+	HID_DFU_Report_t *rep = (HID_DFU_Report_t *)hid_report_out;
+
+	if (rep->bCommand == HID_DFU_CMD_START)
+		sequence = rep->bSequence - 1;
+	if (rep->bSequence != (uint8_t)(sequence + 1))
+	{
+		// lost or repeated report, the host must abort and restart
+		dfu_error(DFU_STATUS_errNOTDONE);
+		dfu_hid_send_status(rep->bCommand);
+		return usb_ep_start_out(0x01, hid_report_out, USB_HID_REPORT_SIZE);
+	}
+	sequence = rep->bSequence;
+
+	switch (rep->bCommand)
+	{
+		case HID_DFU_CMD_START:
+			if (!dfu_set_alternative(rep->data[0])) {
+				dfu_error(DFU_STATUS_errTARGET);
+			} else {
+				memset(write_buffer, 0xFF, sizeof(write_buffer));
+				page = 0;
+#ifdef CONTAINER_ALT
+				if (rep->data[0] == DFU_ALT_CONTAINER)
+					dfu_container_start();
+#endif
+#ifdef RESUME_SUPPORT
+				if (rep->data[0] == 0)
+					dfu_journal_start();
+#endif
+#ifdef IMAGE_HEADER
+				if (rep->data[0] != DFU_ALT_CONTAINER)
+					dfu_header_start();		// the first page may be a header
+#endif
+#ifdef UPLOAD_SUPPORT
+				read_head = 0;
+#endif
+			}
+			dfu_hid_send_status(HID_DFU_CMD_START);
+			break;
+
+		case HID_DFU_CMD_DATA:
+			dfu_hid_data(rep->data, rep->bLength);
+			break;
+
+		case HID_DFU_CMD_MANIFEST:
+			if (state == DFU_STATE_dfuDNLOAD_IDLE)
+			{
+				if ((write_head != 0) && (alternative != DFU_ALT_CONTAINER))	// partial last page
+				{
+					memset(&write_buffer[write_head], 0xFF, sizeof(write_buffer) - write_head);
+#ifdef IMAGE_HEADER
+					dfu_program_stream_page(page);
+#else
+					dfu_program_page(page);
+#endif
+					write_head = 0;
+				}
+#ifdef MANIFEST_TOLERANT
+				state = DFU_STATE_dfuMANIFEST;
+				dfu_manifest();
+				if (state != DFU_STATE_dfuERROR)
+					state = DFU_STATE_dfuIDLE;	// host can verify, then sends HID_DFU_CMD_DETACH
+#else
+				state = DFU_STATE_dfuMANIFEST_WAIT_RST;
+				dfu_manifest();
+				if (state != DFU_STATE_dfuERROR)
+					reset_flag = true;
+#endif
+			}
+			else
+				dfu_error(DFU_STATUS_errNOTDONE);
+			dfu_hid_send_status(HID_DFU_CMD_MANIFEST);
+			break;
+
+#ifdef UPLOAD_SUPPORT
+		case HID_DFU_CMD_UPLOAD:
+		{
+			uint8_t len = rep->bLength;
+			if (len > HID_DFU_RESPONSE_PAYLOAD_SIZE)
+				len = HID_DFU_RESPONSE_PAYLOAD_SIZE;
+
+			HID_DFU_Response_t *res = (HID_DFU_Response_t *)hid_report;
+			len = dfu_read_memory(res->data, read_head, len);	// short at end of memory
+			read_head += len;
+			state = DFU_STATE_dfuUPLOAD_IDLE;
+			res->bCommand = HID_DFU_CMD_UPLOAD;
+			res->bSequence = sequence;
+			res->bLength = len;
+			res->bStatus = status;
+			res->bState = state;
+			usb_ep_start_in(0x81, hid_report, USB_HID_REPORT_SIZE, false);
+			break;
+		}
+#endif
+
+		case HID_DFU_CMD_GETSTATUS:
+			dfu_hid_send_status(HID_DFU_CMD_GETSTATUS);
+			break;
+
+		case HID_DFU_CMD_ABORT:
+			dfu_reset();
+			dfu_hid_send_status(HID_DFU_CMD_ABORT);
+			break;
+
+		case HID_DFU_CMD_DETACH:
+			reset_flag = true;
+			dfu_hid_send_status(HID_DFU_CMD_DETACH);
+			break;
+
+		default:
+			dfu_error(DFU_STATUS_errSTALLEDPKT);
+			dfu_hid_send_status(rep->bCommand);
+			break;
+	}
+
+	usb_ep_start_out(0x01, hid_report_out, USB_HID_REPORT_SIZE);
+}
+
+#endif // USB_HID
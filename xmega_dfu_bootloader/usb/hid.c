@@ -10,6 +10,7 @@
 #include "usb_config.h"
 
 uint8_t hid_report[USB_HID_REPORT_SIZE] __attribute__((__aligned__(2)));
+uint8_t hid_report_out[USB_HID_REPORT_SIZE] __attribute__((__aligned__(2)));
 
 
 /* Send HID reports. Blocks until the endpoint is ready.
@@ -16,12 +16,13 @@
 
 #define USB_EP0_MAX_PACKET_SIZE		64
 #define USB_EP0_BUFFER_SIZE			64
+#define USB_EP0_IN_BUFFER_SIZE		128		// IN uses multi-packet mode, for long descriptors
 
 #include "usb_standard.h"
 #include "usb_config.h"
 
 extern USB_SetupPacket_t usb_setup;
-extern uint8_t ep0_buf_in[USB_EP0_BUFFER_SIZE];
+extern uint8_t ep0_buf_in[USB_EP0_IN_BUFFER_SIZE];
 extern uint8_t ep0_buf_out[USB_EP0_BUFFER_SIZE];
 extern volatile uint8_t USB_DeviceState;
 extern volatile uint8_t USB_Device_ConfigurationNumber;
@@ -39,6 +40,9 @@ bool usb_cb_set_configuration(uint8_t config);
 /// Initialize the USB controller
 void usb_init(void);
 
+/// Return the USB controller and clocks to their reset state
+void usb_deinit(void);
+
 /// Configure pull resistor to be detected by the host
 void usb_attach(void);
 
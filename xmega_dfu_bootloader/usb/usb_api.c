@@ -0,0 +1,48 @@
+/* usb_api.c
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * USB API table, see usb_api.h for the layout
+ */
+
+#include <avr/io.h>
+#include "usb.h"
+#include "usb_api.h"
+
+#ifdef USB_API_TABLE
+
+#define USB_API_STR(x)		#x
+#define USB_API_XSTR(x)		USB_API_STR(x)
+
+/**************************************************************************************************
+* Fixed address jump table. The .usbtable section is placed by the linker settings, the order of
+* the entries must match the USB_API_ offsets.
+*/
+__attribute__((naked, used, section(".usbtable")))
+void usb_api_table(void)
+{
+	asm volatile(
+		"jmp	usb_configure_clock					\n\t"
+		"jmp	usb_deinit							\n\t"
+		"jmp	usb_attach							\n\t"
+		"jmp	usb_detach							\n\t"
+		"jmp	usb_ep_enable						\n\t"
+		"jmp	usb_ep_disable						\n\t"
+		"jmp	usb_ep_reset						\n\t"
+		"jmp	usb_ep_start_in						\n\t"
+		"jmp	usb_ep_start_out					\n\t"
+		"jmp	usb_ep_is_ready						\n\t"
+		"jmp	usb_ep_is_transaction_complete		\n\t"
+		"jmp	usb_ep_clear_transaction_complete	\n\t"
+		"jmp	usb_ep_get_out_transaction_length	\n\t"
+		"jmp	usb_ep0_clear_out_setup				\n\t"
+		"jmp	usb_ep0_out							\n\t"
+		"jmp	usb_ep0_stall						\n\t"
+		".fill	6, 4, 0xFFFFFFFF					\n\t"
+		".long	" USB_API_XSTR(USB_API_MAGIC) "		\n\t"
+		".word	" USB_API_XSTR(USB_API_VERSION) "	\n\t"
+		".word	0xFFFF								\n\t"
+	);
+}
+
+#endif // USB_API_TABLE
@@ -0,0 +1,60 @@
+/* usb_api.h
+ *
+ * Copyright 2018 Paul Qureshi
+ *
+ * USB API table (USB_API_TABLE). The bootloader exports the low level USB driver at a fixed
+ * address below the SPM table, so the application doesn't need its own copy. Link the
+ * application with usb_api_stub.S to get the usb.h functions listed below.
+ *
+ * The exported functions don't use any bootloader RAM. The application owns the endpoint table
+ * (see USB_ENDPOINTS() in usb_xmega.h), points USB.EPPTR at it, provides the EP0 buffers, its
+ * own descriptors and request handling, and the USB interrupt handlers. Entries never move,
+ * new ones are added to the free slots and USB_API_VERSION is bumped.
+ *
+ * Safe to include from assembler.
+ */
+
+#ifndef USB_API_H_
+#define USB_API_H_
+
+// byte address, must match the .usbtable section start in the project linker settings (word
+// address 0x10FC0 on 128k parts)
+#define USB_API_TABLE_ADDR					(BOOT_SECTION_START + BOOT_SECTION_SIZE - 128)
+
+// each entry is a 4 byte JMP
+#define USB_API_CONFIGURE_CLOCK				0x00
+#define USB_API_DEINIT						0x04
+#define USB_API_ATTACH						0x08
+#define USB_API_DETACH						0x0C
+#define USB_API_EP_ENABLE					0x10
+#define USB_API_EP_DISABLE					0x14
+#define USB_API_EP_RESET					0x18
+#define USB_API_EP_START_IN					0x1C
+#define USB_API_EP_START_OUT				0x20
+#define USB_API_EP_IS_READY					0x24
+#define USB_API_EP_IS_TRANSACTION_COMPLETE	0x28
+#define USB_API_EP_CLEAR_TRANSACTION_COMPLETE	0x2C
+#define USB_API_EP_GET_OUT_TRANSACTION_LENGTH	0x30
+#define USB_API_EP0_CLEAR_OUT_SETUP			0x34
+#define USB_API_EP0_OUT						0x38
+#define USB_API_EP0_STALL					0x3C
+#define USB_API_FREE						0x40	// up to 0x57
+#define USB_API_MAGIC_OFFSET				0x58	// uint32_t USB_API_MAGIC
+#define USB_API_VERSION_OFFSET				0x5C	// uint16_t USB_API_VERSION
+
+#define USB_API_MAGIC						0x41425355	// "USBA"
+#define USB_API_VERSION						1
+
+
+#ifndef __ASSEMBLER__
+
+// keeps exported functions visible to the jump table with LTO
+#ifdef USB_API_TABLE
+#define USB_API_EXPORT	__attribute__((used, externally_visible))
+#else
+#define USB_API_EXPORT
+#endif
+
+#endif // __ASSEMBLER__
+
+#endif // USB_API_H_
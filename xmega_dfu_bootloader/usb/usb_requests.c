@@ -8,6 +8,7 @@
  */
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include "usb.h"
 #include "usb_config.h"
 #include "usb_xmega.h"
@@ -15,86 +16,146 @@
 #include "dfu.h"
 
 USB_SetupPacket_t usb_setup;
-__attribute__((__aligned__(2))) uint8_t ep0_buf_in[USB_EP0_BUFFER_SIZE];
+__attribute__((__aligned__(2))) uint8_t ep0_buf_in[USB_EP0_IN_BUFFER_SIZE];
 __attribute__((__aligned__(2))) uint8_t ep0_buf_out[USB_EP0_BUFFER_SIZE];
 volatile uint8_t usb_configuration;
 
 
-extern uint16_t usb_handle_descriptor_request(uint8_t type, uint8_t index);
+extern void usb_handle_descriptor_request(uint8_t type, uint8_t index);
 extern void handle_msft_compatible(void);
 
+typedef void (*usb_request_handler_t)(void);
+
+static uint32_t ep0_flash_address;
+static uint16_t ep0_flash_remaining = 0;
+
 
 /**************************************************************************************************
-* Handle standard setup requests
+* Send a response from flash on endpoint 0. Responses longer than ep0_buf_in are sent as several
+* multi-packet transfers of a full buffer, refilled from usb_handle_control_in(). The buffer is a
+* multiple of the packet size, so the host only sees a short packet at the end.
 */
-void usb_handle_standard_setup_requests(void)
+static void usb_ep0_in_flash_next(void)
 {
-	switch (usb_setup.bRequest)
-	{
-		case USB_REQ_GetStatus:
-			// Device:		D0	Self powered
-			//				D1	Remote wake-up
-			// Interface:	(all reserved)
-			// Endpoint:	D0 endpoint halted
-			ep0_buf_in[0] = 0;
-			ep0_buf_in[1] = 0;
-			usb_ep0_in(2);
-			return usb_ep0_out();
+	uint16_t size = ep0_flash_remaining;
+	if (size > sizeof(ep0_buf_in))
+		size = sizeof(ep0_buf_in);
+
+	uint8_t cmd_backup = NVM.CMD;
+	NVM.CMD = 0;
+	memcpy_PF(ep0_buf_in, ep0_flash_address, size);
+	NVM.CMD = cmd_backup;
+
+	ep0_flash_address += size;
+	ep0_flash_remaining -= size;
+	usb_ep_start_in(0x80, ep0_buf_in, size, (ep0_flash_remaining == 0));
+}
 
-		case USB_REQ_ClearFeature:
-		case USB_REQ_SetFeature:
-			// not implemented
-			usb_ep0_in(0);
-			return usb_ep0_out();
+void usb_ep0_in_flash(uint32_t address, uint16_t size)
+{
+	if (size > usb_setup.wLength)	// host requested partial descriptor
+		size = usb_setup.wLength;
+	ep0_flash_address = address;
+	ep0_flash_remaining = size;
+	usb_ep0_in_flash_next();
+}
 
-		case USB_REQ_SetAddress:
-			// USB.ADDR must only change after the IN transaction has completed,
-			// see USB_TRNCOMPL_vect vector
-			usb_ep0_in(0);
-			return usb_ep0_out();
 
-		case USB_REQ_GetDescriptor:
-		{
-			uint8_t type = usb_setup.wValue >> 8;
-			uint8_t index = usb_setup.wValue & 0xFF;
-			uint16_t size = usb_handle_descriptor_request(type, index);
+/**************************************************************************************************
+* Call a handler from one of the tables below. They are in the boot section, above the 64k
+* reachable by __flash pointers, so they are read by far address.
+*/
+static void usb_call_handler(uint32_t address)
+{
+	usb_request_handler_t handler = (usb_request_handler_t)pgm_read_ptr_far(address);
+	handler();
+}
 
-			if (size)
-			{
-				if (size > usb_setup.wLength)	// host requested partial descriptor
-					size = usb_setup.wLength;
 
-				return usb_ep_start_in(0x80, ep0_buf_in, size, true);
-			}
-			else
-				return usb_ep0_stall();
-		}
+/**************************************************************************************************
+* Standard requests, dispatched by bRequest from usb_standard_handlers[]
+*/
+static void usb_req_get_status(void)
+{
+	// Device:		D0	Self powered
+	//				D1	Remote wake-up
+	// Interface:	(all reserved)
+	// Endpoint:	D0 endpoint halted
+	ep0_buf_in[0] = 0;
+	ep0_buf_in[1] = 0;
+	usb_ep0_in(2);
+	return usb_ep0_out();
+}
 
-		case USB_REQ_GetConfiguration:
-			ep0_buf_in[0] = usb_configuration;
-			usb_ep0_in(1);
-			return usb_ep0_out();
+static void usb_req_feature(void)
+{
+	// not implemented
+	usb_ep0_in(0);
+	return usb_ep0_out();
+}
 
-		case USB_REQ_SetConfiguration:
-			if (usb_cb_set_configuration((uint8_t)usb_setup.wValue))
-			{
-				usb_ep0_in(0);
-				usb_configuration = (uint8_t)(usb_setup.wValue);
-				return usb_ep0_out();
-			}
-			return usb_ep0_stall();
+static void usb_req_set_address(void)
+{
+	// USB.ADDR must only change after the IN transaction has completed,
+	// see USB_TRNCOMPL_vect vector
+	usb_ep0_in(0);
+	return usb_ep0_out();
+}
 
-		case USB_REQ_SetInterface:
-			if (usb_handle_set_interface(usb_setup.wIndex, usb_setup.wValue))
-			{
-				usb_ep0_in(0);
-				return usb_ep0_out();
-			}
-			return usb_ep0_stall();
+static void usb_req_get_descriptor(void)
+{
+	return usb_handle_descriptor_request(usb_setup.wValue >> 8, usb_setup.wValue & 0xFF);
+}
 
-		default:
-			return usb_ep0_stall();
+static void usb_req_get_configuration(void)
+{
+	ep0_buf_in[0] = usb_configuration;
+	usb_ep0_in(1);
+	return usb_ep0_out();
+}
+
+static void usb_req_set_configuration(void)
+{
+	if (usb_cb_set_configuration((uint8_t)usb_setup.wValue))
+	{
+		usb_ep0_in(0);
+		usb_configuration = (uint8_t)(usb_setup.wValue);
+		return usb_ep0_out();
 	}
+	return usb_ep0_stall();
+}
+
+static void usb_req_set_interface(void)
+{
+	if (usb_handle_set_interface(usb_setup.wIndex, usb_setup.wValue))
+	{
+		usb_ep0_in(0);
+		return usb_ep0_out();
+	}
+	return usb_ep0_stall();
+}
+
+static const __flash usb_request_handler_t usb_standard_handlers[] = {
+	[USB_REQ_GetStatus]			= usb_req_get_status,
+	[USB_REQ_ClearFeature]		= usb_req_feature,
+	[2]							= usb_ep0_stall,
+	[USB_REQ_SetFeature]		= usb_req_feature,
+	[4]							= usb_ep0_stall,
+	[USB_REQ_SetAddress]		= usb_req_set_address,
+	[USB_REQ_GetDescriptor]		= usb_req_get_descriptor,
+	[USB_REQ_SetDescriptor]		= usb_ep0_stall,
+	[USB_REQ_GetConfiguration]	= usb_req_get_configuration,
+	[USB_REQ_SetConfiguration]	= usb_req_set_configuration,
+	[USB_REQ_GetInterface]		= usb_ep0_stall,
+	[USB_REQ_SetInterface]		= usb_req_set_interface,
+};
+
+static void usb_standard_setup(void)
+{
+	if (usb_setup.bRequest >= sizeof(usb_standard_handlers) / sizeof(usb_standard_handlers[0]))
+		return usb_ep0_stall();
+	return usb_call_handler(pgm_get_far_address(usb_standard_handlers) +
+							(usb_setup.bRequest * sizeof(usb_request_handler_t)));
 }
 
 /**************************************************************************************************
@@ -146,11 +207,11 @@ void dfu_control_setup(void)
 #endif
 
 /**************************************************************************************************
-* Handle class setup requests
+* HID class requests
 */
-void usb_handle_class_setup_requests(void)
-{
 #ifdef USB_HID
+static void hid_control_setup(void)
+{
 	switch (usb_setup.bRequest)
 	{
 		// IN requests
@@ -234,63 +295,88 @@ void usb_handle_class_setup_requests(void)
 		default:
 			return usb_ep0_stall();
 	}
-#else
-	return usb_ep0_stall();
-#endif
 }
+#endif
 
 /**************************************************************************************************
-* Handle vendor setup requests
+* Vendor requests
 */
-void usb_handle_vendor_setup_requests(void)
-{
-	uint8_t recipient = usb_setup.bmRequestType & USB_REQTYPE_RECIPIENT_MASK;
-	if (recipient == USB_RECIPIENT_DEVICE)
-	{
-		switch(usb_setup.bRequest)
-		{
 #ifdef USB_WCID
-			case WCID_REQUEST_ID:
-				return handle_msft_compatible();
+static void usb_vendor_device_setup(void)
+{
+	if (usb_setup.bRequest == WCID_REQUEST_ID)
+		return handle_msft_compatible();
+	return usb_ep0_stall();
+}
+#endif
+
+#if defined(USB_DFU_MODE) || defined(USB_WCID_EXTENDED)
+static void usb_vendor_interface_setup(void)
+{
+#ifdef USB_DFU_MODE
+	if (usb_setup.wIndex == DFU_INTERFACE)
+		return dfu_vendor_setup();
 #endif
-		}
-	}
-	else if (recipient == USB_RECIPIENT_INTERFACE)
-	{
-		switch(usb_setup.bRequest)
-		{
 #ifdef USB_WCID_EXTENDED
-			case WCID_REQUEST_ID:
-				return handle_msft_compatible();
+	if (usb_setup.bRequest == WCID_REQUEST_ID)	// wIndex is the feature index
+		return handle_msft_compatible();
 #endif
-		}
-	}
-
 	return usb_ep0_stall();
 }
+#endif
 
 /**************************************************************************************************
-* Handle control SETUP requests
+* Class requests. There is only one interface, owned by the DFU runtime, DFU mode or HID driver.
 */
-void usb_handle_control_setup(void)
+#if defined(USB_DFU_RUNTIME) || defined(USB_DFU_MODE)
+	#define USB_CLASS_INTERFACE_HANDLER		dfu_control_setup
+#elif defined(USB_HID)
+	#define USB_CLASS_INTERFACE_HANDLER		hid_control_setup
+#endif
+
+#ifdef USB_CLASS_INTERFACE_HANDLER
+static void usb_class_interface_setup(void)
 {
-	switch (usb_setup.bmRequestType & USB_REQTYPE_TYPE_MASK)
-	{
-		case USB_REQTYPE_STANDARD:
-			return usb_handle_standard_setup_requests();
+	if (usb_setup.wIndex != DFU_INTERFACE)		// HID uses the same interface number
+		return usb_ep0_stall();
+	return USB_CLASS_INTERFACE_HANDLER();
+}
+#else
+	#define usb_class_interface_setup		usb_ep0_stall
+#endif
 
-		case USB_REQTYPE_CLASS:
-#if defined(USB_DFU_RUNTIME) || defined(USB_DFU_MODE)
-			if (((usb_setup.bmRequestType & USB_REQTYPE_RECIPIENT_MASK) == USB_RECIPIENT_INTERFACE) &&
-				(usb_setup.wIndex == DFU_INTERFACE))
-				return dfu_control_setup();
+#ifndef USB_WCID
+	#define usb_vendor_device_setup			usb_ep0_stall
+#endif
+#if !defined(USB_DFU_MODE) && !defined(USB_WCID_EXTENDED)
+	#define usb_vendor_interface_setup		usb_ep0_stall
 #endif
-			return usb_handle_class_setup_requests();
 
-		case USB_REQTYPE_VENDOR:
-		default:
-			return usb_handle_vendor_setup_requests();
-	}
+/**************************************************************************************************
+* Setup request dispatch by type and recipient. Drivers register their handlers above, unused
+* entries stall. Handlers are called through EIND, which the startup code points at the boot
+* section.
+*/
+static const __flash usb_request_handler_t usb_setup_handlers[4][4] = {
+	//	device						interface						endpoint				other
+	{	usb_standard_setup,			usb_standard_setup,				usb_standard_setup,		usb_standard_setup	},	// standard
+	{	usb_ep0_stall,				usb_class_interface_setup,		usb_ep0_stall,			usb_ep0_stall		},	// class
+	{	usb_vendor_device_setup,	usb_vendor_interface_setup,		usb_ep0_stall,			usb_ep0_stall		},	// vendor
+	{	usb_ep0_stall,				usb_ep0_stall,					usb_ep0_stall,			usb_ep0_stall		},	// reserved
+};
+
+/**************************************************************************************************
+* Handle control SETUP requests
+*/
+void usb_handle_control_setup(void)
+{
+	ep0_flash_remaining = 0;	// a new request ends an unfinished response
+	uint8_t type = (usb_setup.bmRequestType & USB_REQTYPE_TYPE_MASK) >> 5;
+	uint8_t recipient = usb_setup.bmRequestType & USB_REQTYPE_RECIPIENT_MASK;
+	if (recipient > USB_RECIPIENT_OTHER)
+		return usb_ep0_stall();
+	return usb_call_handler(pgm_get_far_address(usb_setup_handlers) +
+							(((type * 4) + recipient) * sizeof(usb_request_handler_t)));
 }
 
 /**************************************************************************************************
@@ -312,6 +398,9 @@ void usb_handle_control_out(void)
 */
 void usb_handle_control_in(void)
 {
+	if (ep0_flash_remaining)
+		return usb_ep0_in_flash_next();
+
 	if (((usb_setup.bmRequestType & USB_REQTYPE_RECIPIENT_MASK) == USB_RECIPIENT_INTERFACE) &&
 		(usb_setup.wIndex == DFU_INTERFACE))
 		return dfu_control_in_completion();
@@ -322,13 +411,7 @@ void usb_handle_control_in(void)
 */
 bool usb_handle_set_interface(uint16_t interface, uint16_t altsetting)
 {
-	if (interface == DFU_INTERFACE)
-	{
-		if (altsetting < 2)
-		{
-			dfu_set_alternative(altsetting);
-			return true;
-		}
-	}
+	if ((interface == DFU_INTERFACE) && (altsetting <= 0xFF))
+		return dfu_set_alternative(altsetting);
 	return false;
 }
@@ -12,11 +12,22 @@
 #include "usb.h"
 #include "usb_xmega.h"
 #include "usb_xmega_internal.h"
+#include "usb_api.h"
 #include "xmega.h"
+#include "hid.h"
+#include "dfu.h"
 
 
+// Functions exported through the USB API table find the endpoint table through EPPTR, so that
+// they also work with the application's table
+#ifdef USB_API_TABLE
+#define USB_EP_TABLE	((USB_EP_pair_t *)USB.EPPTR)
+#else
+#define USB_EP_TABLE	usb_xmega_endpoints
+#endif
+
 #define _USB_EP(epaddr) \
-	USB_EP_pair_t* pair = &usb_xmega_endpoints[(epaddr & 0x3F)]; \
+	USB_EP_pair_t* pair = &USB_EP_TABLE[(epaddr & 0x3F)]; \
 	USB_EP_t* e __attribute__ ((unused)) = &pair->ep[!!(epaddr&0x80)]; \
 
 
@@ -33,9 +44,38 @@ void usb_init()
 	USB.INTCTRLB = USB_TRNIE_bm | USB_SETUPIE_bm;
 	SREG = saved_sreg;
 
+	usb_init_descriptors();
 	usb_reset();
 }
 
+/**************************************************************************************************
+* Return the USB controller and the clocks set up by usb_configure_clock() to their reset state,
+* so that the application can be started without a reset. Call with interrupts disabled and after
+* usb_detach().
+*/
+USB_API_EXPORT void usb_deinit(void)
+{
+	USB.INTCTRLA = 0;
+	USB.INTCTRLB = 0;
+	USB.CTRLA = 0;
+	USB.CTRLB = 0;
+	USB.ADDR = 0;
+	USB.EPPTR = 0;
+	USB.INTFLAGSACLR = 0xFF;
+	USB.INTFLAGSBCLR = 0xFF;
+	CLK.USBCTRL = 0;
+
+	CCPWrite(&CLK.CTRL, CLK_SCLKSEL_RC2M_gc);
+	CCPWrite(&CLK.PSCTRL, 0);
+	OSC.CTRL = OSC_RC2MEN_bm;					// PLL must be off before PLLCTRL can change
+	OSC.PLLCTRL = 0;
+	OSC.XOSCCTRL = 0;
+	OSC.DFLLCTRL = 0;
+	DFLLRC32M.CTRL = 0;
+	DFLLRC2M.CTRL = 0;
+	DFLLRC32M.CALB = NVM_read_production_signature_byte(offsetof(NVM_PROD_SIGNATURES_t, RCOSC32M));
+}
+
 /**************************************************************************************************
 * Reset USB stack after device or USB reset
 */
@@ -53,7 +93,9 @@ void usb_reset()
 	usb_xmega_endpoints[0].in.DATAPTR = (unsigned) ep0_buf_in;
 
 #ifdef USB_HID
-	usb_ep_enable(0x81, USB_EP_TYPE_BULK_gc, 64, false);
+	usb_ep_enable(0x81, USB_EP_TYPE_BULK_gc, USB_HID_REPORT_SIZE, true);	// retries a waiting OUT report
+	usb_ep_enable(0x01, USB_EP_TYPE_BULK_gc, USB_HID_REPORT_SIZE, true);
+	usb_ep_start_out(0x01, hid_report_out, USB_HID_REPORT_SIZE);
 #endif
 
 	USB.CTRLA = USB_ENABLE_bm | USB_SPEED_bm | usb_num_endpoints;
@@ -66,7 +108,7 @@ void usb_reset()
 * buffer_size		maximum payload size for endpoint
 * enable_interrupt	enable transaction complete interrupt
 */
-inline void usb_ep_enable(uint8_t ep, uint8_t type, usb_size buffer_size, bool enable_interrupt)
+USB_API_EXPORT inline void usb_ep_enable(uint8_t ep, uint8_t type, usb_size buffer_size, bool enable_interrupt)
 {
 	_USB_EP(ep);
 	e->STATUS = USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm;
@@ -76,7 +118,7 @@ inline void usb_ep_enable(uint8_t ep, uint8_t type, usb_size buffer_size, bool e
 /**************************************************************************************************
 * Disable an endpoint.
 */
-inline void usb_ep_disable(uint8_t ep)
+USB_API_EXPORT inline void usb_ep_disable(uint8_t ep)
 {
 	_USB_EP(ep);
 	e->CTRL = 0;
@@ -85,7 +127,7 @@ inline void usb_ep_disable(uint8_t ep)
 /**************************************************************************************************
 * Reset endpoint, clearing all error flags and making ready for use.
 */
-inline void usb_ep_reset(uint8_t ep)
+USB_API_EXPORT inline void usb_ep_reset(uint8_t ep)
 {
 	_USB_EP(ep);
 	e->STATUS = USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm;
@@ -94,7 +136,7 @@ inline void usb_ep_reset(uint8_t ep)
 /**************************************************************************************************
 * Start receiving data into buffer from host.
 */
-inline void usb_ep_start_out(uint8_t ep, uint8_t* data, usb_size len)
+USB_API_EXPORT inline void usb_ep_start_out(uint8_t ep, uint8_t* data, usb_size len)
 {
 	_USB_EP(ep);
 	e->DATAPTR = (unsigned) data;
@@ -104,7 +146,7 @@ inline void usb_ep_start_out(uint8_t ep, uint8_t* data, usb_size len)
 /**************************************************************************************************
 * Start sending data from buffer to host
 */
-void usb_ep_start_in(uint8_t ep, const uint8_t* data, usb_size size, bool zlp)
+USB_API_EXPORT void usb_ep_start_in(uint8_t ep, const uint8_t* data, usb_size size, bool zlp)
 {
 	_USB_EP(ep);
 	e->DATAPTR = (unsigned) data;
@@ -116,7 +158,7 @@ void usb_ep_start_in(uint8_t ep, const uint8_t* data, usb_size size, bool zlp)
 /**************************************************************************************************
 * Check if an endpoint is ready to start the next transaction
 */
-inline bool usb_ep_is_ready(uint8_t ep)
+USB_API_EXPORT inline bool usb_ep_is_ready(uint8_t ep)
 {
 	_USB_EP(ep);
 	return !(e->STATUS & USB_EP_TRNCOMPL0_bm);
@@ -125,7 +167,7 @@ inline bool usb_ep_is_ready(uint8_t ep)
 /**************************************************************************************************
 * Check if an unhandled transaction has completed on an endpoint
 */
-inline bool usb_ep_is_transaction_complete(uint8_t ep)
+USB_API_EXPORT inline bool usb_ep_is_transaction_complete(uint8_t ep)
 {
 	_USB_EP(ep);
 	return e->STATUS & USB_EP_TRNCOMPL0_bm;
@@ -134,7 +176,7 @@ inline bool usb_ep_is_transaction_complete(uint8_t ep)
 /**************************************************************************************************
 * Handle a completed transaction on an endpoint
 */
-void usb_ep_clear_transaction_complete(uint8_t ep)
+USB_API_EXPORT void usb_ep_clear_transaction_complete(uint8_t ep)
 {
 	_USB_EP(ep);
 	LACR16(&(e->STATUS), USB_EP_TRNCOMPL0_bm | USB_EP_BUSNACK0_bm);
@@ -143,7 +185,7 @@ void usb_ep_clear_transaction_complete(uint8_t ep)
 /**************************************************************************************************
 * Get the number of bytes available from a completed transaction on an OUT endpoint
 */
-inline uint16_t usb_ep_get_out_transaction_length(uint8_t ep)
+USB_API_EXPORT inline usb_size usb_ep_get_out_transaction_length(uint8_t ep)
 {
 	_USB_EP(ep);
 	return e->CNT;
@@ -152,29 +194,29 @@ inline uint16_t usb_ep_get_out_transaction_length(uint8_t ep)
 /**************************************************************************************************
 * Physically detach from USB bus
 */
-void usb_detach(void) {
+USB_API_EXPORT void usb_detach(void) {
 	USB.CTRLB &= ~USB_ATTACH_bm;
 }
 
 /**************************************************************************************************
 * Physically attach to USB bus
 */
-void usb_attach(void) {
+USB_API_EXPORT void usb_attach(void) {
 	USB.CTRLB |= USB_ATTACH_bm;
 }
 
 /**************************************************************************************************
 * Clear SETUP OUT stage on the default control pipe
 */
-void usb_ep0_clear_out_setup(void) {
-	LACR16(&usb_xmega_endpoints[0].out.STATUS, USB_EP_SETUP_bm | USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm | USB_EP_OVF_bm | USB_EP_TOGGLE_bm);
+USB_API_EXPORT void usb_ep0_clear_out_setup(void) {
+	LACR16(&USB_EP_TABLE[0].out.STATUS, USB_EP_SETUP_bm | USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm | USB_EP_OVF_bm | USB_EP_TOGGLE_bm);
 }
 
 /**************************************************************************************************
 * Enable the OUT stage on the default control pipe
 */
-void usb_ep0_out(void) {
-	LACR16(&usb_xmega_endpoints[0].out.STATUS, USB_EP_SETUP_bm | USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm | USB_EP_OVF_bm);
+USB_API_EXPORT void usb_ep0_out(void) {
+	LACR16(&USB_EP_TABLE[0].out.STATUS, USB_EP_SETUP_bm | USB_EP_BUSNACK0_bm | USB_EP_TRNCOMPL0_bm | USB_EP_OVF_bm);
 }
 
 /**************************************************************************************************
@@ -187,15 +229,15 @@ void usb_ep0_in(uint8_t size){
 /**************************************************************************************************
 * Stall the default control pipe
 */
-void usb_ep0_stall(void) {
-	usb_xmega_endpoints[0].out.CTRL |= USB_EP_STALL_bm;
-	usb_xmega_endpoints[0].in.CTRL  |= USB_EP_STALL_bm;
+USB_API_EXPORT void usb_ep0_stall(void) {
+	USB_EP_TABLE[0].out.CTRL |= USB_EP_STALL_bm;
+	USB_EP_TABLE[0].in.CTRL  |= USB_EP_STALL_bm;
 }
 
 /**************************************************************************************************
 * Set up the main CPU clock and USB clock
 */
-void usb_configure_clock()
+USB_API_EXPORT void usb_configure_clock()
 {
 #ifdef USB_USE_PLL
 	OSC.XOSCCTRL = OSC_FRQRANGE_12TO16_gc | OSC_XOSCSEL_XTAL_16KCLK_gc;
@@ -315,6 +357,12 @@ ISR(USB_TRNCOMPL_vect)
 		LACR16(&usb_xmega_endpoints[1].in.STATUS, USB_EP_TRNCOMPL0_bm);
 	}
 
+#ifdef USB_HID
+	// EP1 OUT, re-armed by the handler once the IN report for it can be sent
+	if (usb_xmega_endpoints[1].out.STATUS & USB_EP_TRNCOMPL0_bm)
+		dfu_hid_report_out();
+#endif
+
 	// empty callback
 	//usb_cb_completion();
 }
@@ -48,6 +48,9 @@ const uint8_t* usb_ep0_from_progmem(const uint8_t* addr, uint16_t size);
 /// Send size bytes from ep0_buf_in on endpoint 0
 void usb_ep0_in(uint8_t size);
 
+/// Send size bytes from a far flash address on endpoint 0, in several buffers if needed
+void usb_ep0_in_flash(uint32_t address, uint16_t size);
+
 /// Clear out setup packet
 void usb_ep0_clear_out_setup(void);
 
@@ -62,6 +65,7 @@ void usb_handle_control_setup(void);
 void usb_handle_control_out(void);
 void usb_handle_control_in(void);
 bool usb_handle_set_interface(uint16_t interface, uint16_t altsetting);
+void usb_init_descriptors(void);
 
 
 #endif // USB_XMEGA_H_
@@ -20,7 +20,7 @@
 
 /// From Atmel: Macros for XMEGA instructions not yet supported by the toolchain
 // Load and Clear
-#ifdef __GNUC__
+#if defined(__GNUC__) && defined(__AVR__)
 #define LACR16(addr,msk) \
 	__asm__ __volatile__ ( \
 	"ldi r16, %1" "\n\t" \
@@ -31,7 +31,7 @@
 #endif
 
 // Load and Set
-#ifdef __GNUC__
+#if defined(__GNUC__) && defined(__AVR__)
 #define LASR16(addr,msk) \
 	__asm__ __volatile__ ( \
 	"ldi r16, %1" "\n\t" \
@@ -42,7 +42,7 @@
 #endif
 
 // Exchange
-#ifdef __GNUC__
+#if defined(__GNUC__) && defined(__AVR__)
 #define XCHR16(addr,msk) \
 	__asm__ __volatile__ ( \
 	"ldi r16, %1" "\n\t" \
@@ -53,7 +53,7 @@
 #endif
 
 // Load and toggle
-#ifdef __GNUC__
+#if defined(__GNUC__) && defined(__AVR__)
 #define LATR16(addr,msk) \
 	__asm__ __volatile__ ( \
 	"ldi r16, %1" "\n\t" \
@@ -34,6 +34,7 @@ extern uint8_t	NVM_read_production_signature_byte(uint8_t index);
 extern uint8_t	NVM_read_user_signature_byte(uint16_t index);
 extern uint32_t	NVM_application_crc(void);
 extern uint32_t	NVM_boot_crc(void);
+extern uint32_t	NVM_flash_range_crc(uint32_t start, uint32_t end);
 
 
 #endif /* XMEGA_H_ */
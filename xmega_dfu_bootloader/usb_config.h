@@ -12,10 +12,24 @@
 /****************************************************************************************
 * USB configuration
 */
-// USB clock
-#define USB_USE_PLL			// configure in usb_configure_clock() in usb_xmega.c
+// Clock profile, configured in usb_configure_clock() in usb_xmega.c. Select one.
+// USB_USE_PLL:		16MHz crystal, PLL at 48MHz for USB, CPU at 24MHz
+// USB_USE_RC32:	RC32M DFLL tuned to 48MHz by USB SOF for USB, CPU at 32MHz from
+//					the 2MHz RC oscillator and PLL. No crystal needed.
+#define USB_USE_PLL
 //#define USB_USE_RC32
 
+// CPU clock for the profile, used by _delay_ms(). avr_compiler.h supplies a default if it
+// is included first, so always override it.
+#undef F_CPU
+#if defined(USB_USE_PLL) && !defined(USB_USE_RC32)
+#define F_CPU				24000000UL
+#elif defined(USB_USE_RC32) && !defined(USB_USE_PLL)
+#define F_CPU				32000000UL
+#else
+#error Select exactly one of USB_USE_PLL and USB_USE_RC32
+#endif
+
 
 // USB vendor and product IDs, version number
 #define USB_VID				0x9999
@@ -35,6 +49,13 @@
 #define	USB_SERIAL_NUMBER
 
 
+/****************************************************************************************
+* Export the low level USB driver to the application through a fixed address table (see
+* usb_api.h). The linker places .usbtable at 0x10FC0 (word address) in the project.
+*/
+//#define USB_API_TABLE
+
+
 /****************************************************************************************
 * Use Microsoft WCID descriptors
 */
@@ -66,49 +87,41 @@ static inline void dfu_cb_enter_dfu_mode(void)
 
 
 /****************************************************************************************
-* Enable HID, otherwise vendor specific bulk endpoints
+* Enable HID firmware update transport (see dfu_hid.c) instead of the DFU mode interface.
+* HID needs no driver installation on Windows. Disable USB_DFU_MODE and USB_WCID when
+* using it.
 */
 //#define USB_HID
-#define USB_HID_REPORT_SIZE		3
-#define USB_HID_POLL_RATE_MS	0x08		// HID polling rate in milliseconds
-
-
-// HID report descriptor
-#if defined(USB_HID) && defined(HID_DECLARE_REPORT_DESCRIPTOR)
-const __flash uint8_t hid_report_descriptor[] = {
-	0x05, 0x01,					// USAGE_PAGE (Generic Desktop)
-	0x09, 0x04,					// USAGE (Joystick)
-	0xa1, 0x00,					// COLLECTION (Physical)
-	0x05, 0x09,					//   USAGE_PAGE (Button)
-	0x19, 0x01,					//   USAGE_MINIMUM (Button 1)
-	0x29, 0x08,					//   USAGE_MAXIMUM (Button 8)
-	0x15, 0x00,					//   LOGICAL_MINIMUM (0)
-	0x25, 0x01,					//   LOGICAL_MAXIMUM (1)
-	0x95, 0x08,					//   REPORT_COUNT (8)
-	0x75, 0x01,					//   REPORT_SIZE (1)
-	0x81, 0x02,					//   INPUT (Data,Var,Abs)
-	0x05, 0x01,					//   USAGE_PAGE (Generic Desktop)
-	0x09, 0x30,					//   USAGE (X)
-	0x09, 0x31,					//   USAGE (Y)
-	0x15, 0x81,					//   LOGICAL_MINIMUM (-127)
-	0x25, 0x7f,					//   LOGICAL_MAXIMUM (127)
-	0x75, 0x08,					//   REPORT_SIZE (8)
-	0x95, 0x02,					//   REPORT_COUNT (2)
-	0x81, 0x02,					//   INPUT (Data,Var,Abs)
-
-	0x95, 0x03,					//	 REPORT_COUNT (3)
-	0x09, 0x00,					//	 USAGE (Undefined)
-	0xB2, 0x02, 0x01,			//	 FEATURE (Data,Var,Abs,Buf)
-
-	0x95, 0x03,					//   REPORT_COUNT (3)
-	0x09, 0x00,					//   USAGE (Undefined)
-	0x92, 0x02, 0x01,			//   OUTPUT (Data,Var,Abs,Buf)
-
-	0xc0						// END_COLLECTION
-};
-_Static_assert(sizeof(hid_report_descriptor) <= USB_EP0_BUFFER_SIZE, "HID descriptor exceeds EP0 buffer size");
+#define USB_HID_REPORT_SIZE		64
+#define USB_HID_POLL_RATE_MS	0x01		// HID polling rate in milliseconds
+
+#if defined(USB_HID) && defined(USB_DFU_MODE)
+#error USB_HID and USB_DFU_MODE both use interface 0
+#endif
+#if defined(USB_HID) && defined(USB_WCID)
+#error USB_WCID would bind WinUSB to the HID interface
+#endif
+
+
+// HID report descriptor, placed in the descriptor table by descriptors.c
+#define USB_HID_REPORT_DESCRIPTOR {																\
+	0x06, 0x00, 0xFF,			/* USAGE_PAGE (Vendor Defined Page 1) */						\
+	0x09, 0x01,					/* USAGE (Vendor Usage 1) */									\
+	0xa1, 0x01,					/* COLLECTION (Application) */									\
+	0x15, 0x00,					/*   LOGICAL_MINIMUM (0) */										\
+	0x26, 0xff, 0x00,			/*   LOGICAL_MAXIMUM (255) */									\
+	0x75, 0x08,					/*   REPORT_SIZE (8) */											\
+	0x95, USB_HID_REPORT_SIZE,	/*   REPORT_COUNT (USB_HID_REPORT_SIZE) */						\
+	0x09, 0x01,					/*   USAGE (Vendor Usage 1) */									\
+	0x81, 0x02,					/*   INPUT (Data,Var,Abs) */									\
+	0x95, USB_HID_REPORT_SIZE,	/*   REPORT_COUNT (USB_HID_REPORT_SIZE) */						\
+	0x09, 0x01,					/*   USAGE (Vendor Usage 1) */									\
+	0x91, 0x02,					/*   OUTPUT (Data,Var,Abs) */									\
+	0xc0						/* END_COLLECTION */											\
+}
+#ifdef USB_HID
 _Static_assert(USB_HID_REPORT_SIZE <= USB_EP0_BUFFER_SIZE, "HID report exceeds EP0 buffer size");
-#endif	// defined(USB_HID) && defined(HID_DECLARE_REPORT_DESCRIPTOR)
+#endif
 
 
 // GET_REPORT handlers. *report is USB_MAX_PACKET_SIZE.